@@ -1,11 +1,44 @@
 #include "opencltuner.h"
+#include "opencltunedb.h"
+#include "opencltunelog.h"
+#include "opencltunefailures.h"
+#include "opencltuneworker.h"
+#include "openclmicrobench.h"
+#include "opencltrace.h"
 
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
 
 using namespace std;
 
-int main()
+int main(int argc, char* argv[])
 {
+    //Conversion between the text and the memory-mappable binary tuning database formats
+    if (argc == 4 && string(argv[1]) == "db-to-binary") {
+        try {
+            OpenCLTuneDatabaseMapped::write(argv[3], OpenCLTuneDatabase::load(argv[2]));
+        }
+        //Also catches IOError
+        catch (const StringError& e) {
+            cerr << "Could not convert " << argv[2] << " to binary: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc == 4 && string(argv[1]) == "db-to-text") {
+        try {
+            OpenCLTuneDatabaseMapped mapped(argv[2]);
+            mapped.toDatabase().save(argv[3]);
+        }
+        //Also catches IOError
+        catch (const StringError& e) {
+            cerr << "Could not convert " << argv[2] << " to text: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
 	int gpuIdxForTuning = 0;
     enabled_t testFP16Mode = enabled_t::Auto;
     enabled_t testFP16StorageMode = enabled_t::Auto;
@@ -14,14 +47,153 @@ int main()
     OpenCLTuner::ModelInfoForTuning modelInfo = { FEATURES1_NUM, 224, 224 };
     bool full = false;
     string openCLTunerFile = "tune.txt";
+    string openCLTunerDbFile = "tunedb.txt";
+    string openCLTunerDbBinaryFile = "tunedb.bin";
+    //Every tested config is appended here, use a .csv extension for CSV instead of JSON lines
+    string openCLTunerLogFile = "tunelog.jsonl";
+    //Configs that failed to compile or run on a device and driver, skipped by later runs on the same ones
+    string openCLTunerFailuresFile = "tunefailures.tsv";
+    //Test the recorded failures again anyway, such as after changing something the driver version does not show
+    bool reprobeKnownFailures = false;
+    //If more than 0, tune in a worker process that is restarted when a config crashes it or runs this long
+    double workerTimeoutSeconds = 0.0;
+    //Set for the worker process itself
+    bool isWorker = false;
+    //Optionally write a Chrome trace of the tuning run
+    string openCLTunerTraceFile;
+    OpenCLTuner::TimingMode timingMode = OpenCLTuner::TimingMode::KERNEL;
+    //If more than 1, also measure throughput with up to this many threads enqueueing at once after tuning
+    int numStreams = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-trace" && i + 1 < argc)
+            openCLTunerTraceFile = argv[++i];
+        else if (arg == "-sustained")
+            timingMode = OpenCLTuner::TimingMode::SUSTAINED;
+        else if (arg == "-reprobe-failures")
+            reprobeKnownFailures = true;
+        else if (arg == "-isolate" && i + 1 < argc) {
+            workerTimeoutSeconds = atof(argv[++i]);
+            if (!(workerTimeoutSeconds > 0)) {
+                cerr << "-isolate expects a timeout in seconds" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "-worker")
+            isWorker = true;
+        else if (arg == "-streams" && i + 1 < argc && Global::tryStringToInt(argv[i + 1], numStreams) && numStreams >= 1)
+            i++;
+        else {
+            cerr << "Usage: tune [-trace <file.json>] [-sustained] [-streams <n>] [-reprobe-failures] [-isolate <timeoutSeconds>]" << endl;
+            cerr << "       tune db-to-binary <in.txt> <out.bin>" << endl;
+            cerr << "       tune db-to-text <in.bin> <out.txt>" << endl;
+            return 1;
+        }
+    }
+
+    string currentConfigFile = openCLTunerFailuresFile + ".current";
+    if (workerTimeoutSeconds > 0 && !isWorker) {
+        vector<string> workerArgs;
+        vector<string> restartArgs;
+        for (int i = 1; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "-isolate") {
+                i++;
+                continue;
+            }
+            workerArgs.push_back(arg);
+            //Restarted workers must skip the config that the previous worker died on
+            if (arg != "-reprobe-failures")
+                restartArgs.push_back(arg);
+        }
+        workerArgs.push_back("-worker");
+        restartArgs.push_back("-worker");
+        return OpenCLTuneWorker::supervise(argv[0], workerArgs, restartArgs, currentConfigFile, workerTimeoutSeconds, cerr);
+    }
 
     vector<DeviceInfo> allDeviceInfos = DeviceInfo::getAllDeviceInfosOnSystem();
 
 	bool enableProfiling = true;
-	DevicesContext devicesContext(allDeviceInfos, { gpuIdxForTuning }, enableProfiling);
+    //Kernels are timed one at a time, so tune on an in-order queue
+    bool enableOutOfOrderExecution = false;
+	DevicesContext devicesContext(allDeviceInfos, { gpuIdxForTuning }, enableProfiling, enableOutOfOrderExecution, numStreams);
 
-    OpenCLTuneParams initialParams;
     int batchSize = OpenCLTuner::DEFAULT_BATCH_SIZE;
+    const InitializedDevice* device = devicesContext.findGpuExn(gpuIdxForTuning);
+    OpenCLTuneKey tuneKey = OpenCLTuneKey::forDevice(device->info, modelInfo.trunkNumChannels, nnXLen, nnYLen, batchSize, testFP16Mode);
+
+    //Only a missing database starts empty. Any other problem stops the run, since the database is rewritten at the end
+    //and would lose the entries of every other device.
+    OpenCLTuneDatabase tuneDb;
+    if (!ifstream(openCLTunerDbFile).good())
+        cerr << "No tuning database at " << openCLTunerDbFile << ", starting a new one" << endl;
+    else {
+        try {
+            tuneDb = OpenCLTuneDatabase::load(openCLTunerDbFile);
+        }
+        catch (const IOError& e) {
+            cerr << "Could not read tuning database, fix or move it before tuning: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    //Warm-start from the results of a previous run if there are any, preferring the closest database entry for this device
+    OpenCLTuneParams initialParams;
+    OpenCLTuneKey matchedKey;
+    const OpenCLTuneParams* dbParams = tuneDb.findNearest(tuneKey, &matchedKey);
+    if (dbParams != nullptr) {
+        initialParams = *dbParams;
+        cerr << "Loaded previous tuning results for " << matchedKey.desc() << " from " << openCLTunerDbFile << endl;
+    }
+    else {
+        try {
+            initialParams = OpenCLTuneParams::load(openCLTunerFile);
+            cerr << "Loaded previous tuning results from " << openCLTunerFile << endl;
+        }
+        catch (const IOError& e) {
+            cerr << "Not using previous tuning results: " << e.what() << endl;
+        }
+    }
+
+    //With no entries for this device, try the best configs of the most similar devices in the database first
+    OpenCLDeviceFeatures deviceFeatures = OpenCLDeviceFeatures::forDevice(device->info);
+    OpenCLTuner::TuneRunOptions runOptions;
+    if (dbParams == nullptr) {
+        vector<OpenCLTuneKey> similarKeys;
+        runOptions.seedConfigs = tuneDb.findSimilarDevices(tuneKey, deviceFeatures, 3, &similarKeys);
+        for (const OpenCLTuneKey& similarKey : similarKeys)
+            cerr << "Seeding tuning with results for similar device " << similarKey.desc() << endl;
+    }
+
+    //Peaks are measured once per device and driver and kept in the database next to its tuning results
+    deviceFeatures.peaksDriverVersion = tuneKey.driverVersion;
+    auto storedDevice = tuneDb.devices.find(std::make_pair(deviceFeatures.deviceName, deviceFeatures.vendor));
+    if (storedDevice != tuneDb.devices.end() && storedDevice->second.peaks.isMeasured() &&
+        storedDevice->second.peaksDriverVersion == deviceFeatures.peaksDriverVersion) {
+        deviceFeatures.peaks = storedDevice->second.peaks;
+        cerr << "Using stored peaks " << deviceFeatures.peaks.desc() << endl;
+    }
+    else
+        deviceFeatures.peaks = OpenCLMicrobench::measure(devicesContext, gpuIdxForTuning, cerr);
+    runOptions.peaks.gflopsFP32 = deviceFeatures.peaks.gflopsFP32;
+    runOptions.peaks.gflopsFP16 = deviceFeatures.peaks.gflopsFP16;
+    runOptions.peaks.gbytesPerSecond = deviceFeatures.peaks.globalMemGBytesPerSecond;
+
+    OpenCLTuneLog tuneLog(openCLTunerLogFile, tuneKey.desc());
+    runOptions.log = &tuneLog;
+    runOptions.timingMode = timingMode;
+    OpenCLTuneFailures knownFailures(openCLTunerFailuresFile, tuneKey.deviceName, tuneKey.vendor, tuneKey.driverVersion);
+    if (isWorker)
+        knownFailures.trackCurrentConfig(currentConfigFile);
+    if (knownFailures.size() > 0)
+        cerr << "Loaded " << knownFailures.size() << " known failing configs for this device and driver from " << openCLTunerFailuresFile
+             << (reprobeKnownFailures ? ", testing them again" : "") << endl;
+    runOptions.knownFailures = &knownFailures;
+    runOptions.reprobeKnownFailures = reprobeKnownFailures;
+    OpenCLTrace trace;
+    if (openCLTunerTraceFile.size() > 0)
+        runOptions.trace = &trace;
+
     bool verboseErrors = false;
     bool verboseTuner = false;
     OpenCLTuneParams results;
@@ -40,10 +212,26 @@ int main()
         cerr,
         verboseErrors,
         verboseTuner,
+        runOptions,
         results
     );
     
+    if (runOptions.trace != nullptr)
+        trace.save(openCLTunerTraceFile);
+
+    if (numStreams > 1)
+        OpenCLTuner::measureConcurrentStreams(results, devicesContext, gpuIdxForTuning, batchSize, modelInfo, numStreams, cerr);
+
+    if (!OpenCLTuner::checkConvolutionChain(results, devicesContext, gpuIdxForTuning, batchSize, modelInfo, cerr)) {
+        cerr << "The tuned kernels do not compute a 3x3 convolution correctly together, not saving the tuned config" << endl;
+        return 1;
+    }
+
     OpenCLTuneParams::save(openCLTunerFile, results);
+    tuneDb.add(tuneKey, results);
+    tuneDb.addDevice(deviceFeatures);
+    tuneDb.save(openCLTunerDbFile);
+    OpenCLTuneDatabaseMapped::write(openCLTunerDbBinaryFile, tuneDb);
 
     return 0;
 }
@@ -1,6 +1,22 @@
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <cstring>
+
+//The half conversions use F16C or AVX-512 and the host references AVX2 when the CPU has them, picked at runtime so
+//that builds for a baseline x86 target such as the default MSVC one still get them
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define HOST_X86_SIMD
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+    //MSVC allows any intrinsic without /arch
+    #define SIMD_TARGET(features)
+  #else
+    #include <cpuid.h>
+    #define SIMD_TARGET(features) __attribute__((target(features)))
+  #endif
+#endif
 
 #include "openclhelpers.h"
 #include "opencltuner.h"
@@ -165,34 +181,89 @@ static size_t byteSizeofVectorContents(const typename std::vector<T>& vec) {
     return sizeof(T) * vec.size();
 }
 
-cl_program OpenCLHelpers::compileProgram(const string& name, cl_context context, const vector<cl_device_id>& devices, const string& str, const string& options) {
+static const string mathOptions = " -cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero";
+//The subset of mathOptions that OpenCL 1.2 accepts as link options
+static const string linkMathOptions = "-cl-fast-relaxed-math -cl-denorms-are-zero";
+
+static string getBuildLogs(const string& name, cl_program program, const vector<cl_device_id>& devices) {
+  string s;
+  for(int i = 0; i<devices.size(); i++) {
+    cl_int err2;
+    vector<char> buf(100000);
+    size_t retSize;
+    err2 = clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, byteSizeofVectorContents(buf), buf.data(), &retSize);
+    CHECK_ERR(err2);
+    s += "BUILD LOG FOR " + name + " ON DEVICE " + to_string(i) + "\n";
+    s += buf.data() + string("\n");
+  }
+  return s;
+}
+
+static cl_program createProgram(cl_context context, const string& str) {
   const char* lines[1] = {str.c_str()};
   const size_t sizes[1] = {str.size()};
   cl_int err;
   cl_program program = clCreateProgramWithSource(context,1,lines,sizes,&err);
   CHECK_ERR(err);
+  return program;
+}
 
-  const string opts = options + " -cl-mad-enable -cl-fast-relaxed-math -cl-no-signed-zeros -cl-denorms-are-zero";
+cl_program OpenCLHelpers::compileProgram(const string& name, cl_context context, const vector<cl_device_id>& devices, const string& str, const string& options) {
+  cl_program program = createProgram(context, str);
 
-  err = clBuildProgram(program, devices.size(), devices.data(), opts.c_str(), NULL, NULL);
+  const string opts = options + mathOptions;
+
+  cl_int err = clBuildProgram(program, devices.size(), devices.data(), opts.c_str(), NULL, NULL);
   if(err != 0) {
     string s;
     s += OpenCLHelpers::getErrorMessage(err) + string("\n");
-    for(int i = 0; i<devices.size(); i++) {
-      cl_int err2;
-      vector<char> buf(100000);
-      size_t retSize;
-      err2 = clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, byteSizeofVectorContents(buf), buf.data(), &retSize);
-      CHECK_ERR(err2);
-      s += "BUILD LOG FOR " + name + " ON DEVICE " + to_string(i) + "\n";
-      s += buf.data() + string("\n");
-    }
+    s += getBuildLogs(name, program, devices);
     clReleaseProgram(program);
     throw CompileError(s);
   }
   return program;
 }
 
+cl_program OpenCLHelpers::compileProgramWithHeader(
+  const string& name,
+  cl_context context,
+  const vector<cl_device_id>& devices,
+  ProgramHeaders& headers,
+  const string& headerName,
+  const string& headerSource,
+  const string& str,
+  const string& options
+) {
+  cl_program header = headers.get(headerName, headerSource);
+  const char* headerNames[1] = {headerName.c_str()};
+  cl_program compiled = createProgram(context, str);
+
+  const string opts = options + mathOptions;
+
+  cl_int err = clCompileProgram(compiled, devices.size(), devices.data(), opts.c_str(), 1, &header, headerNames, NULL, NULL);
+  if(err != 0) {
+    string s;
+    s += OpenCLHelpers::getErrorMessage(err) + string("\n");
+    s += getBuildLogs(name, compiled, devices);
+    clReleaseProgram(compiled);
+    throw CompileError(s);
+  }
+
+  cl_program program = clLinkProgram(context, devices.size(), devices.data(), linkMathOptions.c_str(), 1, &compiled, NULL, NULL, &err);
+  clReleaseProgram(compiled);
+  if(err != 0) {
+    string s;
+    s += OpenCLHelpers::getErrorMessage(err) + string("\n");
+    //A failed link may or may not still return a program holding the log
+    if(program != NULL) {
+      s += getBuildLogs(name, program, devices);
+      clReleaseProgram(program);
+    }
+    throw CompileError(s);
+  }
+  return program;
+}
+
 bool OpenCLHelpers::tryCompileProgram(
   const string& name,
   cl_context context,
@@ -212,110 +283,108 @@ bool OpenCLHelpers::tryCompileProgram(
   return true;
 }
 
-cl_mem OpenCLHelpers::createReadOnlyBuffer(cl_context clContext, vector<float>& data) {
-  cl_int err;
-  cl_mem buf = clCreateBuffer(
-    clContext,
-    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-    byteSizeofVectorContents(data),
-    data.data(),
-    &err
-  );
-  CHECK_ERR(err);
-  return buf;
+bool OpenCLHelpers::tryCompileProgramWithHeader(
+  const string& name,
+  cl_context context,
+  const vector<cl_device_id>& devices,
+  ProgramHeaders& headers,
+  const string& headerName,
+  const string& headerSource,
+  const string& str,
+  const string& options,
+  cl_program& buf,
+  string& errorMessage
+) {
+  try {
+    buf = compileProgramWithHeader(name,context,devices,headers,headerName,headerSource,str,options);
+  }
+  catch(CompileError& e) {
+    errorMessage = e.what();
+    return false;
+  }
+  return true;
 }
-cl_mem OpenCLHelpers::createReadOnlyBuffer(cl_context clContext, vector<half_t>& data) {
+
+static cl_mem createBuffer(cl_context clContext, bool hostUnifiedMemory, cl_mem_flags flags, size_t numBytes, void* dataToCopy) {
+  if(hostUnifiedMemory)
+    flags |= CL_MEM_ALLOC_HOST_PTR;
+  if(dataToCopy != NULL)
+    flags |= CL_MEM_COPY_HOST_PTR;
+
   cl_int err;
   cl_mem buf = clCreateBuffer(
     clContext,
-    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-    byteSizeofVectorContents(data),
-    data.data(),
+    flags,
+    numBytes,
+    dataToCopy,
     &err
   );
   CHECK_ERR(err);
   return buf;
 }
 
-cl_mem OpenCLHelpers::createReadWriteBuffer(cl_context clContext, vector<float>& data) {
-  cl_int err;
-  cl_mem buf = clCreateBuffer(
-    clContext,
-    CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-    byteSizeofVectorContents(data),
-    data.data(),
-    &err
-  );
-  CHECK_ERR(err);
-  return buf;
+cl_mem OpenCLHelpers::createReadOnlyBuffer(cl_context clContext, bool hostUnifiedMemory, vector<float>& data) {
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_ONLY, byteSizeofVectorContents(data), data.data());
 }
-cl_mem OpenCLHelpers::createReadWriteBuffer(cl_context clContext, vector<half_t>& data) {
-  cl_int err;
-  cl_mem buf = clCreateBuffer(
-    clContext,
-    CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
-    byteSizeofVectorContents(data),
-    data.data(),
-    &err
-  );
-  CHECK_ERR(err);
-  return buf;
+cl_mem OpenCLHelpers::createReadOnlyBuffer(cl_context clContext, bool hostUnifiedMemory, vector<half_t>& data) {
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_ONLY, byteSizeofVectorContents(data), data.data());
 }
 
-cl_mem OpenCLHelpers::createReadWriteBufferFloat(cl_context clContext, size_t numElts) {
+cl_mem OpenCLHelpers::createReadWriteBuffer(cl_context clContext, bool hostUnifiedMemory, vector<float>& data) {
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_WRITE, byteSizeofVectorContents(data), data.data());
+}
+cl_mem OpenCLHelpers::createReadWriteBuffer(cl_context clContext, bool hostUnifiedMemory, vector<half_t>& data) {
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_WRITE, byteSizeofVectorContents(data), data.data());
+}
+
+cl_mem OpenCLHelpers::createReadWriteBufferFloat(cl_context clContext, bool hostUnifiedMemory, size_t numElts) {
   //Minimum allocation size, just in case, to avoid allocations of size 0
   if(numElts < 32)
     numElts = 32;
-
-  cl_int err;
-  cl_mem buf = clCreateBuffer(
-    clContext,
-    CL_MEM_READ_WRITE,
-    numElts * sizeof(float),
-    NULL,
-    &err
-  );
-  CHECK_ERR(err);
-  return buf;
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_WRITE, numElts * sizeof(float), NULL);
 }
-cl_mem OpenCLHelpers::createReadWriteBufferHalf(cl_context clContext, size_t numElts) {
+cl_mem OpenCLHelpers::createReadWriteBufferHalf(cl_context clContext, bool hostUnifiedMemory, size_t numElts) {
   //Minimum allocation size, just in case, to avoid allocations of size 0
   if(numElts < 32)
     numElts = 32;
+  return createBuffer(clContext, hostUnifiedMemory, CL_MEM_READ_WRITE, numElts * sizeof(half_t), NULL);
+}
 
+
+//Buffers in host accessible memory are read by mapping them, which on unified memory is just a pointer to the
+//buffer, rather than by a read that may go through a driver staging buffer
+static void blockingReadBufferBytes(cl_command_queue commandQueue, cl_mem srcBuf, size_t numBytes, void* dst) {
   cl_int err;
-  cl_mem buf = clCreateBuffer(
-    clContext,
-    CL_MEM_READ_WRITE,
-    numElts * sizeof(half_t),
-    NULL,
-    &err
-  );
+  cl_mem_flags flags;
+  err = clGetMemObjectInfo(srcBuf, CL_MEM_FLAGS, sizeof(cl_mem_flags), &flags, NULL);
   CHECK_ERR(err);
-  return buf;
+  if((flags & CL_MEM_ALLOC_HOST_PTR) != 0) {
+    void* mapped = clEnqueueMapBuffer(commandQueue, srcBuf, CL_TRUE, CL_MAP_READ, 0, numBytes, 0, NULL, NULL, &err);
+    CHECK_ERR(err);
+    memcpy(dst, mapped, numBytes);
+    err = clEnqueueUnmapMemObject(commandQueue, srcBuf, mapped, 0, NULL, NULL);
+    CHECK_ERR(err);
+  }
+  else {
+    cl_bool blocking = CL_TRUE;
+    err = clEnqueueReadBuffer(commandQueue, srcBuf, blocking, 0, numBytes, dst, 0, NULL, NULL);
+    CHECK_ERR(err);
+  }
 }
 
-
 void OpenCLHelpers::blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf) {
   dstBuf.resize(numElts);
-  cl_bool blocking = CL_TRUE;
-  cl_int err;
-  err = clEnqueueReadBuffer(commandQueue, srcBuf, blocking, 0, byteSizeofVectorContents(dstBuf), dstBuf.data(), 0, NULL, NULL);
-  CHECK_ERR(err);
+  blockingReadBufferBytes(commandQueue, srcBuf, byteSizeofVectorContents(dstBuf), dstBuf.data());
 }
 void OpenCLHelpers::blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<half_t>& dstBuf) {
   dstBuf.resize(numElts);
-  cl_bool blocking = CL_TRUE;
-  cl_int err;
-  err = clEnqueueReadBuffer(commandQueue, srcBuf, blocking, 0, byteSizeofVectorContents(dstBuf), dstBuf.data(), 0, NULL, NULL);
-  CHECK_ERR(err);
+  blockingReadBufferBytes(commandQueue, srcBuf, byteSizeofVectorContents(dstBuf), dstBuf.data());
 }
 void OpenCLHelpers::blockingReadBufferHalfToFloat(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf) {
   vector<half_t> tmpHalf;
   blockingReadBuffer(commandQueue, srcBuf, numElts, tmpHalf);
-   dstBuf.resize(numElts);
-  for(size_t i = 0; i<numElts; i++)
-    dstBuf[i] = tmpHalf[i];
+  dstBuf.resize(numElts);
+  halfsToFloats(tmpHalf.data(), dstBuf.data(), numElts);
 }
 void OpenCLHelpers::blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf, bool useFP16) {
   if(useFP16)
@@ -324,6 +393,396 @@ void OpenCLHelpers::blockingReadBuffer(cl_command_queue commandQueue, cl_mem src
     blockingReadBuffer(commandQueue, srcBuf, numElts, dstBuf);
 }
 
+//----------------------------------------------------------------------------------------
+
+BufferPool::BufferPool(cl_context c, bool unified)
+  : context(c),
+    hostUnifiedMemory(unified),
+    mutex(),
+    freeBuffers(),
+    acquiredBuffers(),
+    curBytesInUse(0),
+    curBytesAllocated(0),
+    maxBytesInUse(0),
+    maxBytesAllocated(0),
+    driverAllocations(0),
+    acquires(0)
+{}
+
+BufferPool::~BufferPool() {
+  //Freeing a buffer still acquired would leave its PooledBuffer pointing at a released cl_mem, so they are leaked
+  //instead if this ever fails
+  assert(acquiredBuffers.empty());
+  trim();
+}
+
+cl_mem BufferPool::acquire(cl_mem_flags flags, size_t numBytes) {
+  //Minimum allocation size, just in case, to avoid allocations of size 0
+  if(numBytes < 128)
+    numBytes = 128;
+  numBytes = OpenCLHelpers::powerOf2ify(numBytes);
+  if(hostUnifiedMemory)
+    flags |= CL_MEM_ALLOC_HOST_PTR;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  acquires++;
+  cl_mem buf;
+  vector<cl_mem>& available = freeBuffers[std::make_pair(flags, numBytes)];
+  if(available.size() > 0) {
+    buf = available.back();
+    available.pop_back();
+  }
+  else {
+    cl_int err;
+    buf = clCreateBuffer(context, flags, numBytes, NULL, &err);
+    CHECK_ERR(err);
+    driverAllocations++;
+    curBytesAllocated += numBytes;
+    maxBytesAllocated = std::max(maxBytesAllocated, curBytesAllocated);
+  }
+  acquiredBuffers[buf] = Entry{flags, numBytes};
+  curBytesInUse += numBytes;
+  maxBytesInUse = std::max(maxBytesInUse, curBytesInUse);
+  return buf;
+}
+
+void BufferPool::release(cl_mem buf) {
+  if(buf == NULL)
+    return;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = acquiredBuffers.find(buf);
+  if(iter == acquiredBuffers.end())
+    throw StringError("BufferPool::release: buffer was not acquired from this pool");
+  Entry entry = iter->second;
+  acquiredBuffers.erase(iter);
+  curBytesInUse -= entry.numBytes;
+  freeBuffers[std::make_pair(entry.flags, entry.numBytes)].push_back(buf);
+}
+
+void BufferPool::trim() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(auto iter = freeBuffers.begin(); iter != freeBuffers.end(); ++iter) {
+    for(cl_mem buf: iter->second) {
+      clReleaseMemObject(buf);
+      curBytesAllocated -= iter->first.second;
+    }
+  }
+  freeBuffers.clear();
+}
+
+size_t BufferPool::bytesInUse() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return curBytesInUse;
+}
+size_t BufferPool::bytesAllocated() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return curBytesAllocated;
+}
+size_t BufferPool::peakBytesInUse() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return maxBytesInUse;
+}
+size_t BufferPool::peakBytesAllocated() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return maxBytesAllocated;
+}
+int64_t BufferPool::numDriverAllocations() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return driverAllocations;
+}
+int64_t BufferPool::numAcquires() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return acquires;
+}
+
+PooledBuffer::PooledBuffer()
+  : pool(NULL), buffer(NULL)
+{}
+PooledBuffer::PooledBuffer(BufferPool* p, cl_mem b)
+  : pool(p), buffer(b)
+{}
+PooledBuffer::~PooledBuffer() {
+  reset();
+}
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+  : pool(other.pool), buffer(other.buffer)
+{
+  other.buffer = NULL;
+}
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+  if(this != &other) {
+    reset();
+    pool = other.pool;
+    buffer = other.buffer;
+    other.buffer = NULL;
+  }
+  return *this;
+}
+void PooledBuffer::reset() {
+  if(buffer != NULL && pool != NULL)
+    pool->release(buffer);
+  buffer = NULL;
+}
+cl_mem PooledBuffer::detach() {
+  cl_mem buf = buffer;
+  buffer = NULL;
+  return buf;
+}
+
+//Like blockingReadBufferBytes, buffers in host accessible memory are filled by mapping them
+static void blockingWriteBufferBytes(cl_command_queue commandQueue, cl_mem dstBuf, size_t numBytes, const void* src) {
+  cl_int err;
+  cl_mem_flags flags;
+  err = clGetMemObjectInfo(dstBuf, CL_MEM_FLAGS, sizeof(cl_mem_flags), &flags, NULL);
+  CHECK_ERR(err);
+  if((flags & CL_MEM_ALLOC_HOST_PTR) != 0) {
+    void* mapped = clEnqueueMapBuffer(commandQueue, dstBuf, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, numBytes, 0, NULL, NULL, &err);
+    CHECK_ERR(err);
+    memcpy(mapped, src, numBytes);
+    err = clEnqueueUnmapMemObject(commandQueue, dstBuf, mapped, 0, NULL, NULL);
+    CHECK_ERR(err);
+  }
+  else {
+    cl_bool blocking = CL_TRUE;
+    err = clEnqueueWriteBuffer(commandQueue, dstBuf, blocking, 0, numBytes, src, 0, NULL, NULL);
+    CHECK_ERR(err);
+  }
+}
+
+PooledBuffer OpenCLHelpers::acquireReadOnlyBuffer(BufferPool& pool, cl_command_queue commandQueue, const vector<float>& data) {
+  PooledBuffer buf(&pool, pool.acquire(CL_MEM_READ_ONLY, byteSizeofVectorContents(data)));
+  blockingWriteBufferBytes(commandQueue, buf.get(), byteSizeofVectorContents(data), data.data());
+  return buf;
+}
+PooledBuffer OpenCLHelpers::acquireReadOnlyBuffer(BufferPool& pool, cl_command_queue commandQueue, const vector<half_t>& data) {
+  PooledBuffer buf(&pool, pool.acquire(CL_MEM_READ_ONLY, byteSizeofVectorContents(data)));
+  blockingWriteBufferBytes(commandQueue, buf.get(), byteSizeofVectorContents(data), data.data());
+  return buf;
+}
+PooledBuffer OpenCLHelpers::acquireReadWriteBufferFloat(BufferPool& pool, size_t numElts) {
+  return PooledBuffer(&pool, pool.acquire(CL_MEM_READ_WRITE, numElts * sizeof(float)));
+}
+PooledBuffer OpenCLHelpers::acquireReadWriteBufferHalf(BufferPool& pool, size_t numElts) {
+  return PooledBuffer(&pool, pool.acquire(CL_MEM_READ_WRITE, numElts * sizeof(half_t)));
+}
+
+//Quiet NaNs, which no kernel output here is expected to contain
+static void fillWithNaN(cl_command_queue commandQueue, cl_mem buf, const void* pattern, size_t patternSize, size_t numElts) {
+  cl_int err = clEnqueueFillBuffer(commandQueue, buf, pattern, patternSize, 0, numElts * patternSize, 0, NULL, NULL);
+  CHECK_ERR(err);
+}
+PooledBuffer OpenCLHelpers::acquireNaNFilledBufferFloat(BufferPool& pool, cl_command_queue commandQueue, size_t numElts) {
+  PooledBuffer buf = acquireReadWriteBufferFloat(pool, numElts);
+  const uint32_t nanBits = 0x7fc00000u;
+  fillWithNaN(commandQueue, buf.get(), &nanBits, sizeof(nanBits), numElts);
+  return buf;
+}
+PooledBuffer OpenCLHelpers::acquireNaNFilledBufferHalf(BufferPool& pool, cl_command_queue commandQueue, size_t numElts) {
+  PooledBuffer buf = acquireReadWriteBufferHalf(pool, numElts);
+  const uint16_t nanBits = 0x7e00u;
+  fillWithNaN(commandQueue, buf.get(), &nanBits, sizeof(nanBits), numElts);
+  return buf;
+}
+
+static_assert(sizeof(half_t) == sizeof(uint16_t), "half_t must be a plain 16 bit value");
+
+//Scalar conversions that compute every case and select one rather than branching, so that the compiler can
+//vectorize the loops using them. Bit exact with half_float::half_cast.
+static inline uint16_t floatToHalfBits(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000u;
+  x &= 0x7fffffffu;
+
+  //Too large for a half, or inf or nan
+  const uint16_t overflowed = x > 0x7f800000u ? 0x7e00u : 0x7c00u;
+
+  //Smaller than the smallest normal half. Adding 0.5 lets the float adder do the rounding of the denormal.
+  const uint32_t denormMagicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+  float denormMagic;
+  memcpy(&denormMagic, &denormMagicBits, sizeof(denormMagic));
+  float xf;
+  memcpy(&xf, &x, sizeof(xf));
+  float denormSum = xf + denormMagic;
+  uint32_t denormBits;
+  memcpy(&denormBits, &denormSum, sizeof(denormBits));
+  const uint16_t denorm = (uint16_t)(denormBits - denormMagicBits);
+
+  //Normal, rebias the exponent and round the mantissa to nearest even
+  const uint32_t mantissaOdd = (x >> 13) & 1u;
+  const uint16_t normal = (uint16_t)((x + ((uint32_t)(15 - 127) << 23) + 0xfffu + mantissaOdd) >> 13);
+
+  uint16_t h = x >= ((127u + 16u) << 23) ? overflowed : x < (113u << 23) ? denorm : normal;
+  return (uint16_t)(h | sign);
+}
+
+static inline float halfBitsToFloat(uint16_t h) {
+  const uint32_t expMask = 0x7c00u << 13;
+  uint32_t bits = ((uint32_t)h & 0x7fffu) << 13;
+  const uint32_t exp = bits & expMask;
+  bits += (uint32_t)(127 - 15) << 23;
+
+  //Inf or nan, push the exponent all the way up
+  const uint32_t infNanBits = bits + ((uint32_t)(128 - 16) << 23);
+  //Denormal, renormalize by letting the float adder subtract the implicit bit
+  const uint32_t denormBitsIn = bits + (1u << 23);
+  float denorm;
+  memcpy(&denorm, &denormBitsIn, sizeof(denorm));
+  const uint32_t magicBits = 113u << 23;
+  float magic;
+  memcpy(&magic, &magicBits, sizeof(magic));
+  denorm -= magic;
+  uint32_t denormBits;
+  memcpy(&denormBits, &denorm, sizeof(denormBits));
+
+  uint32_t result = exp == expMask ? infNanBits : exp == 0 ? denormBits : bits;
+  result |= ((uint32_t)h & 0x8000u) << 16;
+  float f;
+  memcpy(&f, &result, sizeof(f));
+  return f;
+}
+
+#ifdef HOST_X86_SIMD
+enum class HalfConversionSimd { NONE, F16C, AVX512 };
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+#ifdef _MSC_VER
+  int r[4];
+  __cpuidex(r, (int)leaf, (int)subleaf);
+  for(int i = 0; i<4; i++)
+    regs[i] = (uint32_t)r[i];
+#else
+  if(!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]))
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+#endif
+}
+
+//The register state the OS saves on context switches, only valid if the CPU reports OSXSAVE
+static uint64_t xgetbv0() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  uint32_t eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static HalfConversionSimd detectHalfConversionSimd() {
+  uint32_t regs[4];
+  cpuid(0, 0, regs);
+  uint32_t maxLeaf = regs[0];
+  if(maxLeaf < 1)
+    return HalfConversionSimd::NONE;
+  cpuid(1, 0, regs);
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  bool f16c = (regs[2] & (1u << 29)) != 0;
+  if(!osxsave || !avx || !f16c)
+    return HalfConversionSimd::NONE;
+  //The OS must save the ymm registers, and for AVX-512 also the opmask and zmm registers
+  uint64_t xcr0 = xgetbv0();
+  if((xcr0 & 0x6) != 0x6)
+    return HalfConversionSimd::NONE;
+  if(maxLeaf >= 7 && (xcr0 & 0xe6) == 0xe6) {
+    cpuid(7, 0, regs);
+    if((regs[1] & (1u << 16)) != 0)
+      return HalfConversionSimd::AVX512;
+  }
+  return HalfConversionSimd::F16C;
+}
+
+static HalfConversionSimd halfConversionSimd() {
+  static const HalfConversionSimd simd = detectHalfConversionSimd();
+  return simd;
+}
+
+static bool detectAVX2FMA() {
+  uint32_t regs[4];
+  cpuid(0, 0, regs);
+  uint32_t maxLeaf = regs[0];
+  if(maxLeaf < 7)
+    return false;
+  cpuid(1, 0, regs);
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  bool fma = (regs[2] & (1u << 12)) != 0;
+  if(!osxsave || !avx || !fma || (xgetbv0() & 0x6) != 0x6)
+    return false;
+  cpuid(7, 0, regs);
+  return (regs[1] & (1u << 5)) != 0;
+}
+
+//Each converts the leading multiple of its vector width and returns how many elements that was
+SIMD_TARGET("avx,f16c")
+static size_t floatsToHalfsF16C(const float* src, uint16_t* out, size_t numElts) {
+  size_t i = 0;
+  for(; i + 8 <= numElts; i += 8)
+    _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  return i;
+}
+//The AVX-512 conversions are the zero-masked forms with every lane enabled, the same instruction, since GCC warns
+//about the undefined pass-through value of the unmasked forms
+SIMD_TARGET("avx512f")
+static size_t floatsToHalfsAVX512(const float* src, uint16_t* out, size_t numElts) {
+  size_t i = 0;
+  for(; i + 16 <= numElts; i += 16)
+    _mm256_storeu_si256((__m256i*)(out + i), _mm512_maskz_cvtps_ph(0xffff, _mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  return i;
+}
+SIMD_TARGET("avx,f16c")
+static size_t halfsToFloatsF16C(const uint16_t* in, float* dst, size_t numElts) {
+  size_t i = 0;
+  for(; i + 8 <= numElts; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+  return i;
+}
+SIMD_TARGET("avx512f")
+static size_t halfsToFloatsAVX512(const uint16_t* in, float* dst, size_t numElts) {
+  size_t i = 0;
+  for(; i + 16 <= numElts; i += 16)
+    _mm512_storeu_ps(dst + i, _mm512_maskz_cvtph_ps(0xffff, _mm256_loadu_si256((const __m256i*)(in + i))));
+  return i;
+}
+#endif
+
+void OpenCLHelpers::floatsToHalfs(const float* src, half_t* dst, size_t numElts) {
+  uint16_t* out = reinterpret_cast<uint16_t*>(dst);
+  size_t i = 0;
+#ifdef HOST_X86_SIMD
+  HalfConversionSimd simd = halfConversionSimd();
+  if(simd == HalfConversionSimd::AVX512)
+    i += floatsToHalfsAVX512(src, out, numElts);
+  if(simd != HalfConversionSimd::NONE)
+    i += floatsToHalfsF16C(src + i, out + i, numElts - i);
+#endif
+  for(; i < numElts; i++)
+    out[i] = floatToHalfBits(src[i]);
+}
+
+void OpenCLHelpers::halfsToFloats(const half_t* src, float* dst, size_t numElts) {
+  const uint16_t* in = reinterpret_cast<const uint16_t*>(src);
+  size_t i = 0;
+#ifdef HOST_X86_SIMD
+  HalfConversionSimd simd = halfConversionSimd();
+  if(simd == HalfConversionSimd::AVX512)
+    i += halfsToFloatsAVX512(in, dst, numElts);
+  if(simd != HalfConversionSimd::NONE)
+    i += halfsToFloatsF16C(in + i, dst + i, numElts - i);
+#endif
+  for(; i < numElts; i++)
+    dst[i] = halfBitsToFloat(in[i]);
+}
+
+bool OpenCLHelpers::hostSupportsAVX2FMA() {
+#ifdef HOST_X86_SIMD
+  static const bool supported = detectAVX2FMA();
+  return supported;
+#else
+  return false;
+#endif
+}
+
 vector<DeviceInfo> DeviceInfo::getAllDeviceInfosOnSystem() {
   //Some opencl headers/implementations are buggy and have more platforms or more devices than they
   //say their maximum is, so just add a buffer.
@@ -415,11 +874,43 @@ vector<DeviceInfo> DeviceInfo::getAllDeviceInfosOnSystem() {
     CHECK_ERR(err);
     string openCLVersion = string(buf.data());
 
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DRIVER_VERSION, bufLen, buf.data(), &sizeRet);
+    assert(sizeRet < bufLen-1);
+    CHECK_ERR(err);
+    string driverVersion = string(buf.data());
+
     err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_EXTENSIONS, bufLen, buf.data(), &sizeRet);
     assert(sizeRet < bufLen-1);
     CHECK_ERR(err);
     string extensions = string(buf.data());
 
+    cl_uint maxComputeUnits;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &maxComputeUnits, NULL);
+    CHECK_ERR(err);
+    cl_uint maxClockFrequency;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &maxClockFrequency, NULL);
+    CHECK_ERR(err);
+    size_t maxWorkGroupSize;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    CHECK_ERR(err);
+    cl_ulong localMemSize;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, NULL);
+    CHECK_ERR(err);
+    cl_uint preferredVectorWidthFloat;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(cl_uint), &preferredVectorWidthFloat, NULL);
+    CHECK_ERR(err);
+    cl_uint preferredVectorWidthHalf;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF, sizeof(cl_uint), &preferredVectorWidthHalf, NULL);
+    CHECK_ERR(err);
+    cl_bool hostUnifiedMemory;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &hostUnifiedMemory, NULL);
+    CHECK_ERR(err);
+    //New in OpenCL 1.2, so older devices fail the query and count as having no linker
+    cl_bool linkerAvailable;
+    err = clGetDeviceInfo(deviceIds[gpuIdx], CL_DEVICE_LINKER_AVAILABLE, sizeof(cl_bool), &linkerAvailable, NULL);
+    if(err != 0)
+      linkerAvailable = CL_FALSE;
+
     int defaultDesirability = 0;
     //Compute desirability for this device for default device selection
     {
@@ -468,9 +959,18 @@ vector<DeviceInfo> DeviceInfo::getAllDeviceInfosOnSystem() {
     info.vendor = vendor;
     info.deviceType = deviceType;
     info.openCLVersion = openCLVersion;
+    info.driverVersion = driverVersion;
     info.extensions = extensions;
     info.defaultDesirability = defaultDesirability;
     info.supportsFP16Compute = (extensions.find("cl_khr_fp16") != string::npos);
+    info.maxComputeUnits = (int)maxComputeUnits;
+    info.maxClockFrequency = (int)maxClockFrequency;
+    info.maxWorkGroupSize = (int)maxWorkGroupSize;
+    info.localMemSize = localMemSize;
+    info.preferredVectorWidthFloat = (int)preferredVectorWidthFloat;
+    info.preferredVectorWidthHalf = (int)preferredVectorWidthHalf;
+    info.hostUnifiedMemory = hostUnifiedMemory == CL_TRUE;
+    info.linkerAvailable = linkerAvailable == CL_TRUE;
     allDeviceInfos.push_back(info);
   }
 
@@ -480,7 +980,13 @@ vector<DeviceInfo> DeviceInfo::getAllDeviceInfosOnSystem() {
 //----------------------------------------------------------------------------------------
 
 
-DevicesContext::DevicesContext(const vector<DeviceInfo>& allDeviceInfos, const vector<int>& gIdxsToUse, bool enableProfiling)
+DevicesContext::DevicesContext(
+  const vector<DeviceInfo>& allDeviceInfos,
+  const vector<int>& gIdxsToUse,
+  bool enableProfiling,
+  bool enableOutOfOrderExecution,
+  int numComputeQueuesPerDevice
+)
   : initializedPlatforms(),
     devicesToUse(),
     uniqueDeviceNamesToUse()
@@ -494,6 +1000,9 @@ DevicesContext::DevicesContext(const vector<DeviceInfo>& allDeviceInfos, const v
     }
   }
 
+  if(numComputeQueuesPerDevice < 1)
+    throw StringError("numComputeQueuesPerDevice must be at least 1: " + to_string(numComputeQueuesPerDevice));
+
   //Sort and ensure no duplicates
   vector<int> gpuIdxsToUse = gIdxsToUse;
   std::sort(gpuIdxsToUse.begin(),gpuIdxsToUse.end());
@@ -574,19 +1083,41 @@ DevicesContext::DevicesContext(const vector<DeviceInfo>& allDeviceInfos, const v
     cl_device_id deviceId = deviceInfo.deviceId;
     cl_context context = initializedPlatforms[i]->context;
 
-    //TODO - someday, maybe consider CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
     cl_int err;
-    cl_command_queue commandQueue;
+    cl_command_queue_properties queueProperties = 0;
     if(enableProfiling)
-      commandQueue = clCreateCommandQueue(context, deviceId, CL_QUEUE_PROFILING_ENABLE, &err);
-    else
-      commandQueue = clCreateCommandQueue(context, deviceId, 0, &err);
+      queueProperties |= CL_QUEUE_PROFILING_ENABLE;
+
+    //Out-of-order execution is optional in OpenCL 1.2, so only ask for it where the device reports supporting it
+    bool outOfOrderExecution = false;
+    if(enableOutOfOrderExecution) {
+      cl_command_queue_properties supportedProperties;
+      err = clGetDeviceInfo(deviceId, CL_DEVICE_QUEUE_PROPERTIES, sizeof(cl_command_queue_properties), &supportedProperties, NULL);
+      CHECK_ERR(err);
+      if((supportedProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0) {
+        queueProperties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+        outOfOrderExecution = true;
+      }
+      else {
+        cout << "OpenCL Device " << gpuIdx << " does not support out-of-order execution, using an in-order queue" << endl;
+      }
+    }
+
+    vector<cl_command_queue> computeQueues;
+    for(int q = 0; q<numComputeQueuesPerDevice; q++) {
+      computeQueues.push_back(clCreateCommandQueue(context, deviceId, queueProperties, &err));
+      CHECK_ERR(err);
+    }
 
-    CHECK_ERR(err);
     InitializedDevice* device = new InitializedDevice();
     device->info = deviceInfo;
     device->context = context;
-    device->commandQueue = commandQueue;
+    device->commandQueue = computeQueues[0];
+    device->computeQueues = computeQueues;
+    device->queuePool = new CommandQueuePool(computeQueues);
+    device->outOfOrderExecution = outOfOrderExecution;
+    device->bufferPool = new BufferPool(context, deviceInfo.hostUnifiedMemory);
+    device->programHeaders = deviceInfo.linkerAvailable ? new ProgramHeaders(context) : nullptr;
     devicesToUse.push_back(device);
 
     string message =
@@ -606,9 +1137,16 @@ DevicesContext::DevicesContext(const vector<DeviceInfo>& allDeviceInfos, const v
 DevicesContext::~DevicesContext() {
   for(int i = 0; i<devicesToUse.size(); i++) {
     InitializedDevice* device = devicesToUse[i];
-    clFlush(device->commandQueue);
-    clFinish(device->commandQueue);
-    clReleaseCommandQueue(device->commandQueue);
+    const vector<cl_command_queue>& queues = device->computeQueues;
+    for(cl_command_queue queue: queues) {
+      clFlush(queue);
+      clFinish(queue);
+    }
+    delete device->bufferPool;
+    delete device->programHeaders;
+    delete device->queuePool;
+    for(cl_command_queue queue: queues)
+      clReleaseCommandQueue(queue);
     delete device;
   }
 
@@ -619,6 +1157,76 @@ DevicesContext::~DevicesContext() {
   }
 }
 
+ProgramHeaders::ProgramHeaders(cl_context c)
+  : context(c),
+    mutex(),
+    headers()
+{}
+
+ProgramHeaders::~ProgramHeaders() {
+  for(auto iter = headers.begin(); iter != headers.end(); ++iter)
+    clReleaseProgram(iter->second);
+}
+
+cl_program ProgramHeaders::get(const string& name, const string& source) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = headers.find(name);
+  if(iter != headers.end())
+    return iter->second;
+  cl_program header = createProgram(context, source);
+  headers[name] = header;
+  return header;
+}
+
+CommandQueuePool::CommandQueuePool(const vector<cl_command_queue>& qs)
+  : mutex(),
+    queues(qs),
+    numLeases(qs.size(), 0)
+{
+  if(queues.size() <= 0)
+    throw StringError("CommandQueuePool: no queues");
+}
+
+cl_command_queue CommandQueuePool::lease() {
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t best = 0;
+  for(size_t i = 1; i<queues.size(); i++) {
+    if(numLeases[i] < numLeases[best])
+      best = i;
+  }
+  numLeases[best]++;
+  return queues[best];
+}
+
+void CommandQueuePool::giveBack(cl_command_queue queue) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(size_t i = 0; i<queues.size(); i++) {
+    if(queues[i] == queue) {
+      assert(numLeases[i] > 0);
+      numLeases[i]--;
+      return;
+    }
+  }
+  throw StringError("CommandQueuePool::giveBack: queue was not leased from this pool");
+}
+
+int CommandQueuePool::numQueues() const {
+  return (int)queues.size();
+}
+
+CommandQueueLease::CommandQueueLease(CommandQueuePool* p)
+  : pool(p), queue(p->lease())
+{}
+CommandQueueLease::~CommandQueueLease() {
+  if(queue != NULL)
+    pool->giveBack(queue);
+}
+CommandQueueLease::CommandQueueLease(CommandQueueLease&& other) noexcept
+  : pool(other.pool), queue(other.queue)
+{
+  other.queue = NULL;
+}
+
 const InitializedDevice* DevicesContext::findGpuExn(int gpuIdx) const {
   if(gpuIdx == -1)
     gpuIdx = defaultGpuIdx;
@@ -673,14 +1281,30 @@ size_t OpenCLHelpers::roundUpToMultiple(size_t size, size_t ofThis) {
   return (size + ofThis - 1) / ofThis * ofThis;
 }
 
-cl_int OpenCLHelpers::doBatchedXGemm_KM_KN_NM(
+OpenCLHelpers::KernelLaunch::KernelLaunch(cl_kernel k, cl_uint dims, const size_t* global, const size_t* local)
+  : kernel(k), workDim(dims)
+{
+  assert(dims >= 1 && dims <= 3);
+  for(cl_uint i = 0; i<3; i++) {
+    globalSizes[i] = i < dims ? global[i] : 1;
+    localSizes[i] = i < dims ? local[i] : 1;
+  }
+}
+
+cl_int OpenCLHelpers::KernelLaunch::enqueue(
+  cl_command_queue commandQueue, cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf
+) const {
+  return clEnqueueNDRangeKernel(
+    commandQueue, kernel, workDim, NULL, globalSizes, localSizes, numEventsInWaitList, eventWaitList, eventBuf
+  );
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareBatchedXGemm_KM_KN_NM(
   cl_kernel kernel,
-  cl_command_queue commandQueue,
   const OpenCLParams::XGemmParams& tuneParams,
   int M, int N, int K,
   cl_mem A, cl_mem B, cl_mem C,
-  int numBatchElts,
-  cl_event* eventBuf
+  int numBatchElts
 ) {
   clSetKernelArg(kernel, 0, sizeof(int), (void *)&M);
   clSetKernelArg(kernel, 1, sizeof(int), (void *)&N);
@@ -708,21 +1332,30 @@ cl_int OpenCLHelpers::doBatchedXGemm_KM_KN_NM(
   size_t globalSizes[nKernelDims] = {M * MDIMC / MWG, N * NDIMC / NWG, (size_t)numBatchElts};
   size_t localSizes[nKernelDims] = {MDIMC, NDIMC, 1};
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doBatchedHGemmWmma_KM_KN_NM(
+cl_int OpenCLHelpers::doBatchedXGemm_KM_KN_NM(
   cl_kernel kernel,
   cl_command_queue commandQueue,
-  const OpenCLTuneParams& tuneParams,
+  const OpenCLParams::XGemmParams& tuneParams,
   int M, int N, int K,
   cl_mem A, cl_mem B, cl_mem C,
   int numBatchElts,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareBatchedXGemm_KM_KN_NM(
+    kernel, tuneParams, M, N, K, A, B, C, numBatchElts
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareBatchedHGemmWmma_KM_KN_NM(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  int M, int N, int K,
+  cl_mem A, cl_mem B, cl_mem C,
+  int numBatchElts
 ) {
   clSetKernelArg(kernel, 0, sizeof(int), (void *)&M);
   clSetKernelArg(kernel, 1, sizeof(int), (void *)&N);
@@ -747,21 +1380,30 @@ cl_int OpenCLHelpers::doBatchedHGemmWmma_KM_KN_NM(
   size_t globalSizes[nKernelDims] = {M * MWAVE / MWG / MWARP * WARP_SIZE, N * NWAVE / NWG / NWARP, (size_t)numBatchElts};
   size_t localSizes[nKernelDims] = {MWAVE/MWARP * WARP_SIZE, NWAVE/NWARP, 1};
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doBatchedXGemmDirect_KM_KN_NM(
+cl_int OpenCLHelpers::doBatchedHGemmWmma_KM_KN_NM(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
   int M, int N, int K,
   cl_mem A, cl_mem B, cl_mem C,
   int numBatchElts,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareBatchedHGemmWmma_KM_KN_NM(
+    kernel, tuneParams, M, N, K, A, B, C, numBatchElts
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareBatchedXGemmDirect_KM_KN_NM(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  int M, int N, int K,
+  cl_mem A, cl_mem B, cl_mem C,
+  int numBatchElts
 ) {
   int cTranspose = 0;
 
@@ -787,22 +1429,31 @@ cl_int OpenCLHelpers::doBatchedXGemmDirect_KM_KN_NM(
   size_t globalSizes[nKernelDims] = {mCeiled * MDIMCD / WGD, nCeiled * NDIMCD / WGD, (size_t)numBatchElts};
   size_t localSizes[nKernelDims] = {MDIMCD, NDIMCD, 1};
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doStridedBatchedXGemmDirect_KM_KN_NM(
+cl_int OpenCLHelpers::doBatchedXGemmDirect_KM_KN_NM(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
   int M, int N, int K,
-  int aStride, int bStride, int cStride,
   cl_mem A, cl_mem B, cl_mem C,
   int numBatchElts,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareBatchedXGemmDirect_KM_KN_NM(
+    kernel, tuneParams, M, N, K, A, B, C, numBatchElts
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareStridedBatchedXGemmDirect_KM_KN_NM(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  int M, int N, int K,
+  int aStride, int bStride, int cStride,
+  cl_mem A, cl_mem B, cl_mem C,
+  int numBatchElts
 ) {
   int cTranspose = 0;
 
@@ -831,21 +1482,31 @@ cl_int OpenCLHelpers::doStridedBatchedXGemmDirect_KM_KN_NM(
   size_t globalSizes[nKernelDims] = {mCeiled * MDIMCD / WGD, nCeiled * NDIMCD / WGD, (size_t)numBatchElts};
   size_t localSizes[nKernelDims] = {MDIMCD, NDIMCD, 1};
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doBatchedXGemmDirect_MK_NK_MN(
+cl_int OpenCLHelpers::doStridedBatchedXGemmDirect_KM_KN_NM(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
   int M, int N, int K,
+  int aStride, int bStride, int cStride,
   cl_mem A, cl_mem B, cl_mem C,
   int numBatchElts,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareStridedBatchedXGemmDirect_KM_KN_NM(
+    kernel, tuneParams, M, N, K, aStride, bStride, cStride, A, B, C, numBatchElts
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareBatchedXGemmDirect_MK_NK_MN(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  int M, int N, int K,
+  cl_mem A, cl_mem B, cl_mem C,
+  int numBatchElts
 ) {
   int cTranspose = 1;
 
@@ -871,22 +1532,31 @@ cl_int OpenCLHelpers::doBatchedXGemmDirect_MK_NK_MN(
   size_t globalSizes[nKernelDims] = {mCeiled * MDIMCD / WGD, nCeiled * NDIMCD / WGD, (size_t)numBatchElts};
   size_t localSizes[nKernelDims] = {MDIMCD, NDIMCD, 1};
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doWinogradTransform(
+cl_int OpenCLHelpers::doBatchedXGemmDirect_MK_NK_MN(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
+  int M, int N, int K,
+  cl_mem A, cl_mem B, cl_mem C,
+  int numBatchElts,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
+  cl_event* eventBuf
+) {
+  return prepareBatchedXGemmDirect_MK_NK_MN(
+    kernel, tuneParams, M, N, K, A, B, C, numBatchElts
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareWinogradTransform(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
   cl_mem input, cl_mem convWorkspace,
   int nnXLen, int nnYLen,
   int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
-  int inChannels, int inChannelsPadMultiple,
-  cl_event* eventBuf
+  int inChannels, int inChannelsPadMultiple
 ) {
   int inChannelsPadded = roundUpToMultiple(inChannels, inChannelsPadMultiple);
   int batchNumTilesPadded = roundUpToMultiple(batchSize * numTilesX * numTilesY, batchNumTilesPadMultiple);
@@ -913,23 +1583,33 @@ cl_int OpenCLHelpers::doWinogradTransform(
     roundUpToMultiple(inChannelsPadded,localSizes[1])
   };
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doWinogradTransformWithBNRelu(
+cl_int OpenCLHelpers::doWinogradTransform(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
   cl_mem input, cl_mem convWorkspace,
-  cl_mem scaleBuf, cl_mem biasBuf, cl_mem mask,
   int nnXLen, int nnYLen,
   int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
   int inChannels, int inChannelsPadMultiple,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareWinogradTransform(
+    kernel, tuneParams, input, convWorkspace, nnXLen, nnYLen, batchSize, numTilesX, numTilesY, batchNumTilesPadMultiple, inChannels, inChannelsPadMultiple
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareWinogradTransformWithBNRelu(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  cl_mem input, cl_mem convWorkspace,
+  cl_mem scaleBuf, cl_mem biasBuf, cl_mem mask,
+  int nnXLen, int nnYLen,
+  int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+  int inChannels, int inChannelsPadMultiple
 ) {
   int inChannelsPadded = roundUpToMultiple(inChannels, inChannelsPadMultiple);
   int batchNumTilesPadded = roundUpToMultiple(batchSize * numTilesX * numTilesY, batchNumTilesPadMultiple);
@@ -959,22 +1639,33 @@ cl_int OpenCLHelpers::doWinogradTransformWithBNRelu(
     roundUpToMultiple(inChannelsPadded,localSizes[1])
   };
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
-  return err;
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
 }
 
-cl_int OpenCLHelpers::doWinogradUntransform(
+cl_int OpenCLHelpers::doWinogradTransformWithBNRelu(
   cl_kernel kernel,
   cl_command_queue commandQueue,
   const OpenCLTuneParams& tuneParams,
-  cl_mem convWorkspace2, cl_mem output,
+  cl_mem input, cl_mem convWorkspace,
+  cl_mem scaleBuf, cl_mem biasBuf, cl_mem mask,
   int nnXLen, int nnYLen,
   int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
-  int outChannels, int outChannelsPadMultiple,
+  int inChannels, int inChannelsPadMultiple,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
   cl_event* eventBuf
+) {
+  return prepareWinogradTransformWithBNRelu(
+    kernel, tuneParams, input, convWorkspace, scaleBuf, biasBuf, mask, nnXLen, nnYLen, batchSize, numTilesX, numTilesY, batchNumTilesPadMultiple, inChannels, inChannelsPadMultiple
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+OpenCLHelpers::KernelLaunch OpenCLHelpers::prepareWinogradUntransform(
+  cl_kernel kernel,
+  const OpenCLTuneParams& tuneParams,
+  cl_mem convWorkspace2, cl_mem output,
+  int nnXLen, int nnYLen,
+  int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+  int outChannels, int outChannelsPadMultiple
 ) {
   int outChannelsPadded = roundUpToMultiple(outChannels, outChannelsPadMultiple);
   int batchNumTilesPadded = roundUpToMultiple(batchSize * numTilesX * numTilesY, batchNumTilesPadMultiple);
@@ -1003,9 +1694,176 @@ cl_int OpenCLHelpers::doWinogradUntransform(
     roundUpToMultiple(batchSize * outChannels,localSizes[2])
   };
 
-  cl_int err;
-  err = clEnqueueNDRangeKernel(
-    commandQueue, kernel, nKernelDims, NULL, globalSizes, localSizes, 0, NULL, eventBuf
-  );
+  return KernelLaunch(kernel, nKernelDims, globalSizes, localSizes);
+}
+
+cl_int OpenCLHelpers::doWinogradUntransform(
+  cl_kernel kernel,
+  cl_command_queue commandQueue,
+  const OpenCLTuneParams& tuneParams,
+  cl_mem convWorkspace2, cl_mem output,
+  int nnXLen, int nnYLen,
+  int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+  int outChannels, int outChannelsPadMultiple,
+  cl_uint numEventsInWaitList, const cl_event* eventWaitList,
+  cl_event* eventBuf
+) {
+  return prepareWinogradUntransform(
+    kernel, tuneParams, convWorkspace2, output, nnXLen, nnYLen, batchSize, numTilesX, numTilesY, batchNumTilesPadMultiple, outChannels, outChannelsPadMultiple
+  ).enqueue(commandQueue, numEventsInWaitList, eventWaitList, eventBuf);
+}
+
+
+//----------------------------------------------------------------------------------------
+
+OpenCLEventGraph::OpenCLEventGraph()
+  : uses(),
+    events()
+{}
+
+OpenCLEventGraph::~OpenCLEventGraph() {
+  clear();
+}
+
+vector<cl_event> OpenCLEventGraph::dependencies(const vector<cl_mem>& reads, const vector<cl_mem>& writes) const {
+  vector<cl_event> deps;
+  auto addDep = [&](cl_event event) {
+    if(event != NULL && !contains(deps, event))
+      deps.push_back(event);
+  };
+  //Read after write
+  for(cl_mem buf: reads) {
+    auto iter = uses.find(buf);
+    if(iter != uses.end())
+      addDep(iter->second.lastWrite);
+  }
+  //Write after write and write after read
+  for(cl_mem buf: writes) {
+    auto iter = uses.find(buf);
+    if(iter != uses.end()) {
+      addDep(iter->second.lastWrite);
+      for(cl_event event: iter->second.readsSinceWrite)
+        addDep(event);
+    }
+  }
+  return deps;
+}
+
+cl_int OpenCLEventGraph::enqueue(
+  const vector<cl_mem>& reads,
+  const vector<cl_mem>& writes,
+  const std::function<cl_int(cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf)>& launch,
+  cl_event* eventBuf
+) {
+  vector<cl_event> deps = dependencies(reads, writes);
+  cl_event event;
+  cl_int err = launch((cl_uint)deps.size(), deps.size() > 0 ? deps.data() : NULL, &event);
+  if(err != CL_SUCCESS)
+    return err;
+
+  events.push_back(event);
+  for(cl_mem buf: reads)
+    uses[buf].readsSinceWrite.push_back(event);
+  //A command writing a buffer it also reads orders everything after it on that buffer by itself
+  for(cl_mem buf: writes) {
+    BufferUse& use = uses[buf];
+    use.lastWrite = event;
+    use.readsSinceWrite.clear();
+  }
+  if(eventBuf != NULL) {
+    clRetainEvent(event);
+    *eventBuf = event;
+  }
+  return err;
+}
+
+cl_int OpenCLEventGraph::waitAll() {
+  cl_int err = CL_SUCCESS;
+  if(events.size() > 0)
+    err = clWaitForEvents((cl_uint)events.size(), events.data());
+  clear();
   return err;
 }
+
+void OpenCLEventGraph::clear() {
+  for(cl_event event: events)
+    clReleaseEvent(event);
+  events.clear();
+  uses.clear();
+}
+
+//----------------------------------------------------------------------------------------
+
+OpenCLLaunchPlan::OpenCLLaunchPlan()
+  : kernels(),
+    launches()
+{}
+
+OpenCLLaunchPlan::~OpenCLLaunchPlan() {
+  for(cl_kernel kernel: kernels)
+    clReleaseKernel(kernel);
+}
+
+cl_kernel OpenCLLaunchPlan::newKernelLike(cl_kernel kernel) {
+  cl_int err;
+  cl_program program;
+  err = clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &program, NULL);
+  CHECK_ERR(err);
+  size_t nameSize;
+  err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, &nameSize);
+  CHECK_ERR(err);
+  vector<char> name(nameSize + 1, '\0');
+  err = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, nameSize, name.data(), NULL);
+  CHECK_ERR(err);
+
+  cl_kernel newKernel = clCreateKernel(program, name.data(), &err);
+  CHECK_ERR(err);
+  kernels.push_back(newKernel);
+  return newKernel;
+}
+
+void OpenCLLaunchPlan::add(const OpenCLHelpers::KernelLaunch& launch) {
+  if(!contains(kernels, launch.kernel))
+    throw StringError("OpenCLLaunchPlan::add: kernel was not made by newKernelLike of this plan");
+  for(const OpenCLHelpers::KernelLaunch& other: launches) {
+    if(other.kernel == launch.kernel)
+      throw StringError("OpenCLLaunchPlan::add: kernel is already used by another call in this plan");
+  }
+  launches.push_back(launch);
+}
+
+cl_int OpenCLLaunchPlan::replay(cl_command_queue commandQueue, vector<cl_event>* eventsBuf) const {
+  cl_int err;
+  cl_command_queue_properties properties;
+  err = clGetCommandQueueInfo(commandQueue, CL_QUEUE_PROPERTIES, sizeof(properties), &properties, NULL);
+  if(err != CL_SUCCESS)
+    return err;
+  bool outOfOrder = (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+  if(eventsBuf != NULL)
+    eventsBuf->clear();
+  //On an out-of-order queue, each call waits on the event of the previous one
+  cl_event prevEvent = NULL;
+  for(size_t i = 0; i<launches.size(); i++) {
+    cl_event event = NULL;
+    bool wantEvent = eventsBuf != NULL || outOfOrder;
+    err = launches[i].enqueue(commandQueue, prevEvent != NULL ? 1 : 0, prevEvent != NULL ? &prevEvent : NULL, wantEvent ? &event : NULL);
+    //Events not handed to the caller are only needed until the next call is enqueued
+    if(eventsBuf == NULL && prevEvent != NULL)
+      clReleaseEvent(prevEvent);
+    prevEvent = NULL;
+    if(err != CL_SUCCESS)
+      return err;
+    if(eventsBuf != NULL)
+      eventsBuf->push_back(event);
+    if(outOfOrder)
+      prevEvent = event;
+  }
+  if(eventsBuf == NULL && prevEvent != NULL)
+    clReleaseEvent(prevEvent);
+  return CL_SUCCESS;
+}
+
+size_t OpenCLLaunchPlan::size() const {
+  return launches.size();
+}
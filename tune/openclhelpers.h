@@ -4,6 +4,9 @@
 #include <string>
 #include <map>
 #include <stdexcept>
+#include <cstdint>
+#include <mutex>
+#include <functional>
 
 #include "openclincludes.h"
 
@@ -71,11 +74,24 @@ struct DeviceInfo {
     std::string vendor;
     cl_device_type deviceType;
     std::string openCLVersion;
+    std::string driverVersion;
     std::string extensions;
 
     int defaultDesirability;
     bool supportsFP16Compute;
 
+    //Hardware characteristics, used to judge how similar two devices are
+    int maxComputeUnits;
+    int maxClockFrequency;
+    int maxWorkGroupSize;
+    cl_ulong localMemSize;
+    int preferredVectorWidthFloat;
+    int preferredVectorWidthHalf;
+    //The device shares physical memory with the host, as integrated GPUs and CPU devices do
+    bool hostUnifiedMemory;
+    //The device can compile and link programs separately with clCompileProgram and clLinkProgram
+    bool linkerAvailable;
+
     static constexpr int MAX_PLATFORMS = 32;
     static constexpr int MAX_DEVICES = 512;
     static std::vector<DeviceInfo> getAllDeviceInfosOnSystem();
@@ -89,10 +105,150 @@ struct InitializedPlatform {
     std::vector<cl_device_id> deviceIdsToUseForThisPlatform;
 };
 
+//Recycles device buffers so that allocating buffers of the same shapes over and over does not go back to the driver,
+//which on some vendors takes milliseconds per call. Sizes are rounded up to size classes with powerOf2ify and a
+//released buffer is kept for the next request of the same size class and flags. Thread-safe.
+struct BufferPool {
+    //hostUnifiedMemory is DeviceInfo::hostUnifiedMemory of the device of context
+    BufferPool(cl_context context, bool hostUnifiedMemory);
+    //Every acquired buffer must have been released by then
+    ~BufferPool();
+
+    BufferPool() = delete;
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    //Returns a buffer of at least numBytes, with CL_MEM_ALLOC_HOST_PTR added on unified memory like the
+    //create* functions of OpenCLHelpers. Its contents are whatever it was last used for.
+    cl_mem acquire(cl_mem_flags flags, size_t numBytes);
+    //Returns a buffer from acquire to the pool
+    void release(cl_mem buffer);
+    //Frees all buffers not currently acquired
+    void trim();
+
+    //Bytes of buffers currently acquired, and bytes held from the driver including buffers kept for reuse
+    size_t bytesInUse() const;
+    size_t bytesAllocated() const;
+    size_t peakBytesInUse() const;
+    size_t peakBytesAllocated() const;
+    //Number of acquires that had to create a new buffer
+    int64_t numDriverAllocations() const;
+    int64_t numAcquires() const;
+
+private:
+    struct Entry {
+        cl_mem_flags flags;
+        size_t numBytes;
+    };
+
+    cl_context context;
+    bool hostUnifiedMemory;
+    mutable std::mutex mutex;
+    //Buffers available for reuse, by flags and size class
+    std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl_mem>> freeBuffers;
+    std::map<cl_mem, Entry> acquiredBuffers;
+    size_t curBytesInUse;
+    size_t curBytesAllocated;
+    size_t maxBytesInUse;
+    size_t maxBytesAllocated;
+    int64_t driverAllocations;
+    int64_t acquires;
+};
+
+//A buffer acquired from a BufferPool, returned to it on destruction
+struct PooledBuffer {
+    PooledBuffer();
+    PooledBuffer(BufferPool* pool, cl_mem buffer);
+    ~PooledBuffer();
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    cl_mem get() const { return buffer; }
+    BufferPool* getPool() const { return pool; }
+    //Returns the buffer to the pool now
+    void reset();
+    //Gives up ownership without returning the buffer, which the caller must later pass to getPool()->release
+    cl_mem detach();
+
+private:
+    BufferPool* pool;
+    cl_mem buffer;
+};
+
+//The headers shared by many programs, each created once as a program of just its source and passed to every
+//clCompileProgram that includes it, rather than concatenated into the source of each program. Thread-safe.
+struct ProgramHeaders {
+    ProgramHeaders(cl_context context);
+    ~ProgramHeaders();
+
+    ProgramHeaders() = delete;
+    ProgramHeaders(const ProgramHeaders&) = delete;
+    ProgramHeaders& operator=(const ProgramHeaders&) = delete;
+
+    //The header program for name, created from source on the first call for name
+    cl_program get(const std::string& name, const std::string& source);
+
+private:
+    cl_context context;
+    std::mutex mutex;
+    std::map<std::string, cl_program> headers;
+};
+
+//Hands out the compute queues of a device to worker threads, so that threads enqueueing work at the same time do not
+//serialize on one queue. Each lease gets the queue with the fewest current leases, so queues are shared only once
+//there are more leases than queues. Thread-safe.
+struct CommandQueuePool {
+    CommandQueuePool(const std::vector<cl_command_queue>& queues);
+
+    CommandQueuePool() = delete;
+    CommandQueuePool(const CommandQueuePool&) = delete;
+    CommandQueuePool& operator=(const CommandQueuePool&) = delete;
+
+    cl_command_queue lease();
+    void giveBack(cl_command_queue queue);
+    int numQueues() const;
+
+private:
+    mutable std::mutex mutex;
+    std::vector<cl_command_queue> queues;
+    std::vector<int> numLeases;
+};
+
+//A queue leased from a CommandQueuePool for as long as this exists, typically by one worker thread
+struct CommandQueueLease {
+    CommandQueueLease(CommandQueuePool* pool);
+    ~CommandQueueLease();
+
+    CommandQueueLease(CommandQueueLease&& other) noexcept;
+    CommandQueueLease& operator=(CommandQueueLease&& other) = delete;
+    CommandQueueLease(const CommandQueueLease&) = delete;
+    CommandQueueLease& operator=(const CommandQueueLease&) = delete;
+
+    cl_command_queue get() const { return queue; }
+
+private:
+    CommandQueuePool* pool;
+    cl_command_queue queue;
+};
+
 struct InitializedDevice {
     DeviceInfo info;
     cl_context context;
+    //The first of computeQueues
     cl_command_queue commandQueue;
+    //All queues for kernels, lease them through queuePool when using the device from several threads
+    std::vector<cl_command_queue> computeQueues;
+    //Owned, hands out computeQueues
+    CommandQueuePool* queuePool;
+    //The queue was created with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, so commands only wait on their event wait lists
+    bool outOfOrderExecution;
+    //Owned, for buffers allocated repeatedly on this device
+    BufferPool* bufferPool;
+    //Owned, nullptr unless info.linkerAvailable
+    ProgramHeaders* programHeaders;
 };
 
 //Wrapper around cl_context for sharing initialization code
@@ -108,7 +264,15 @@ struct DevicesContext {
     //All unique names of devices being used
     std::vector<std::string> uniqueDeviceNamesToUse;
 
-    DevicesContext(const std::vector<DeviceInfo>& allDeviceInfos, const std::vector<int>& gpuIdxsToUse, bool enableProfiling);
+    //If enableOutOfOrderExecution, devices that support it get out-of-order queues, see InitializedDevice::outOfOrderExecution.
+    //Each device gets numComputeQueuesPerDevice compute queues.
+    DevicesContext(
+        const std::vector<DeviceInfo>& allDeviceInfos,
+        const std::vector<int>& gpuIdxsToUse,
+        bool enableProfiling,
+        bool enableOutOfOrderExecution,
+        int numComputeQueuesPerDevice
+    );
     ~DevicesContext();
 
     DevicesContext() = delete;
@@ -123,6 +287,47 @@ struct DevicesContext {
     std::vector<cl_device_id> findDeviceIdsToUseWithName(const std::string& name) const;
 };
 
+//Orders the commands enqueued through it by the buffers they read and write, so that on an out-of-order queue each
+//command waits on exactly the earlier commands it conflicts with: the last writer of anything it reads or writes, and
+//the readers since then of anything it writes. Independent work, like the policy and value heads or two halves of a
+//batch, is then free to overlap. On an in-order queue the wait lists are redundant but harmless.
+//Not thread-safe, use one per sequence of work.
+struct OpenCLEventGraph {
+    OpenCLEventGraph();
+    ~OpenCLEventGraph();
+
+    OpenCLEventGraph(const OpenCLEventGraph&) = delete;
+    OpenCLEventGraph& operator=(const OpenCLEventGraph&) = delete;
+
+    //Calls launch with the wait list for a command reading reads and writing writes, such as one of the launchers in
+    //OpenCLHelpers, and records the event it produces. Returns the error of launch, recording nothing on failure.
+    //If eventBuf is not null, it also receives the event, retained for the caller to release.
+    cl_int enqueue(
+        const std::vector<cl_mem>& reads,
+        const std::vector<cl_mem>& writes,
+        const std::function<cl_int(cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf)>& launch,
+        cl_event* eventBuf
+    );
+    //Events for commands that must finish before one reading reads and writing writes, which enqueue passes to launch
+    std::vector<cl_event> dependencies(const std::vector<cl_mem>& reads, const std::vector<cl_mem>& writes) const;
+
+    //Blocks until every recorded command is done and forgets them
+    cl_int waitAll();
+    //Forgets every recorded command without waiting
+    void clear();
+
+private:
+    struct BufferUse {
+        //The last command writing the buffer, or null
+        cl_event lastWrite = nullptr;
+        //Commands reading the buffer since lastWrite
+        std::vector<cl_event> readsSinceWrite;
+    };
+    std::map<cl_mem, BufferUse> uses;
+    //Every recorded event, each retained once
+    std::vector<cl_event> events;
+};
+
 namespace OpenCLHelpers {
     const std::string getErrorMessage(cl_int error);
     void checkErrors(cl_int error, const char* file, const char* func, int line);
@@ -144,22 +349,89 @@ namespace OpenCLHelpers {
         cl_program& buf,
         std::string& errorMessage
     );
+    //Like compileProgram, but compiles with clCompileProgram and links with clLinkProgram, resolving an #include of
+    //headerName in str to the program of headerSource in headers
+    cl_program compileProgramWithHeader(
+        const std::string& name,
+        cl_context context,
+        const std::vector<cl_device_id>& devices,
+        ProgramHeaders& headers,
+        const std::string& headerName,
+        const std::string& headerSource,
+        const std::string& str,
+        const std::string& options
+    );
+    bool tryCompileProgramWithHeader(
+        const std::string& name,
+        cl_context context,
+        const std::vector<cl_device_id>& devices,
+        ProgramHeaders& headers,
+        const std::string& headerName,
+        const std::string& headerSource,
+        const std::string& str,
+        const std::string& options,
+        cl_program& buf,
+        std::string& errorMessage
+    );
 
-    cl_mem createReadOnlyBuffer(cl_context context, std::vector<float>& data);
-    cl_mem createReadOnlyBuffer(cl_context context, std::vector<half_float::half>& data);
-    cl_mem createReadWriteBuffer(cl_context context, std::vector<float>& data);
-    cl_mem createReadWriteBuffer(cl_context context, std::vector<half_float::half>& data);
-    cl_mem createReadWriteBufferFloat(cl_context context, size_t numElts);
-    cl_mem createReadWriteBufferHalf(cl_context context, size_t numElts);
+    //If hostUnifiedMemory, buffers are created in host accessible memory with CL_MEM_ALLOC_HOST_PTR, so that the
+    //device works directly on the memory the host fills, and blockingReadBuffer maps such buffers rather than copying
+    //them through a driver staging buffer. Pass DeviceInfo::hostUnifiedMemory, each device gets its own context.
+    cl_mem createReadOnlyBuffer(cl_context context, bool hostUnifiedMemory, std::vector<float>& data);
+    cl_mem createReadOnlyBuffer(cl_context context, bool hostUnifiedMemory, std::vector<half_float::half>& data);
+    cl_mem createReadWriteBuffer(cl_context context, bool hostUnifiedMemory, std::vector<float>& data);
+    cl_mem createReadWriteBuffer(cl_context context, bool hostUnifiedMemory, std::vector<half_float::half>& data);
+    cl_mem createReadWriteBufferFloat(cl_context context, bool hostUnifiedMemory, size_t numElts);
+    cl_mem createReadWriteBufferHalf(cl_context context, bool hostUnifiedMemory, size_t numElts);
+
+    //Pooled equivalents of the functions above. The read only ones are filled with a blocking write on commandQueue.
+    PooledBuffer acquireReadOnlyBuffer(BufferPool& pool, cl_command_queue commandQueue, const std::vector<float>& data);
+    PooledBuffer acquireReadOnlyBuffer(BufferPool& pool, cl_command_queue commandQueue, const std::vector<half_float::half>& data);
+    PooledBuffer acquireReadWriteBufferFloat(BufferPool& pool, size_t numElts);
+    PooledBuffer acquireReadWriteBufferHalf(BufferPool& pool, size_t numElts);
+    //Read write buffers whose first numElts are filled with NaN on commandQueue, so that elements a kernel fails to
+    //write show up as non-finite rather than as whatever the pooled buffer held before
+    PooledBuffer acquireNaNFilledBufferFloat(BufferPool& pool, cl_command_queue commandQueue, size_t numElts);
+    PooledBuffer acquireNaNFilledBufferHalf(BufferPool& pool, cl_command_queue commandQueue, size_t numElts);
 
     void blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf);
     void blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<half_float::half>& dstBuf);
     void blockingReadBufferHalfToFloat(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf);
     void blockingReadBuffer(cl_command_queue commandQueue, cl_mem srcBuf, size_t numElts, std::vector<float>& dstBuf, bool useFP16);
 
+    //Bulk conversion between float and half, rounding to nearest even like half_float::half_cast.
+    //Uses AVX-512 or F16C when the CPU has them, checked once at runtime, and a branch-free scalar conversion otherwise.
+    void floatsToHalfs(const float* src, half_float::half* dst, size_t numElts);
+    void halfsToFloats(const half_float::half* src, float* dst, size_t numElts);
+
+    //Whether the host CPU and OS support AVX2 and FMA, checked once at runtime, always false on other than x86
+    bool hostSupportsAVX2FMA();
+
     size_t powerOf2ify(size_t size);
     size_t roundUpToMultiple(size_t size, size_t ofThis);
 
+    //One kernel call with its arguments already set on kernel and its sizes computed, to enqueue any number of times.
+    //Arguments stay set on a kernel until changed, so this is only valid until kernel is prepared again.
+    struct KernelLaunch {
+        cl_kernel kernel;
+        cl_uint workDim;
+        size_t globalSizes[3];
+        size_t localSizes[3];
+
+        KernelLaunch(cl_kernel kernel, cl_uint workDim, const size_t* globalSizes, const size_t* localSizes);
+        cl_int enqueue(cl_command_queue commandQueue, cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf) const;
+    };
+
+    //Launchers for the kernels. Each enqueues one kernel after the events in eventWaitList, like clEnqueueNDRangeKernel,
+    //which on an out-of-order queue is the only ordering between commands. See OpenCLEventGraph.
+    //The prepare functions set the arguments and compute the sizes of the same call without enqueueing it, see OpenCLLaunchPlan.
+    KernelLaunch prepareBatchedXGemm_KM_KN_NM(
+        cl_kernel kernel,
+        const OpenCLParams::XGemmParams& tuneParams,
+        int M, int N, int K,
+        cl_mem A, cl_mem B, cl_mem C,
+        int numBatchElts
+    );
     cl_int doBatchedXGemm_KM_KN_NM(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -167,9 +439,17 @@ namespace OpenCLHelpers {
         int M, int N, int K,
         cl_mem A, cl_mem B, cl_mem C,
         int numBatchElts,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareBatchedHGemmWmma_KM_KN_NM(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        int M, int N, int K,
+        cl_mem A, cl_mem B, cl_mem C,
+        int numBatchElts
+    );
     cl_int doBatchedHGemmWmma_KM_KN_NM(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -177,9 +457,17 @@ namespace OpenCLHelpers {
         int M, int N, int K,
         cl_mem A, cl_mem B, cl_mem C,
         int numBatchElts,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareBatchedXGemmDirect_KM_KN_NM(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        int M, int N, int K,
+        cl_mem A, cl_mem B, cl_mem C,
+        int numBatchElts
+    );
     cl_int doBatchedXGemmDirect_KM_KN_NM(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -187,9 +475,18 @@ namespace OpenCLHelpers {
         int M, int N, int K,
         cl_mem A, cl_mem B, cl_mem C,
         int numBatchElts,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareStridedBatchedXGemmDirect_KM_KN_NM(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        int M, int N, int K,
+        int aStride, int bStride, int cStride,
+        cl_mem A, cl_mem B, cl_mem C,
+        int numBatchElts
+    );
     cl_int doStridedBatchedXGemmDirect_KM_KN_NM(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -198,9 +495,17 @@ namespace OpenCLHelpers {
         int aStride, int bStride, int cStride,
         cl_mem A, cl_mem B, cl_mem C,
         int numBatchElts,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareBatchedXGemmDirect_MK_NK_MN(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        int M, int N, int K,
+        cl_mem A, cl_mem B, cl_mem C,
+        int numBatchElts
+    );
     cl_int doBatchedXGemmDirect_MK_NK_MN(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -208,9 +513,18 @@ namespace OpenCLHelpers {
         int M, int N, int K,
         cl_mem A, cl_mem B, cl_mem C,
         int numBatchElts,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareWinogradTransform(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        cl_mem input, cl_mem convWorkspace,
+        int nnXLen, int nnYLen,
+        int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+        int inChannels, int inChannelsPadMultiple
+    );
     cl_int doWinogradTransform(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -219,9 +533,19 @@ namespace OpenCLHelpers {
         int nnXLen, int nnYLen,
         int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
         int inChannels, int inChannelsPadMultiple,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareWinogradTransformWithBNRelu(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        cl_mem input, cl_mem convWorkspace,
+        cl_mem scaleBuf, cl_mem biasBuf, cl_mem mask,
+        int nnXLen, int nnYLen,
+        int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+        int inChannels, int inChannelsPadMultiple
+    );
     cl_int doWinogradTransformWithBNRelu(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -231,9 +555,18 @@ namespace OpenCLHelpers {
         int nnXLen, int nnYLen,
         int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
         int inChannels, int inChannelsPadMultiple,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
+    KernelLaunch prepareWinogradUntransform(
+        cl_kernel kernel,
+        const OpenCLTuneParams& tuneParams,
+        cl_mem convWorkspace2, cl_mem output,
+        int nnXLen, int nnYLen,
+        int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
+        int outChannels, int outChannelsPadMultiple
+    );
     cl_int doWinogradUntransform(
         cl_kernel kernel,
         cl_command_queue commandQueue,
@@ -242,6 +575,7 @@ namespace OpenCLHelpers {
         int nnXLen, int nnYLen,
         int batchSize, int numTilesX, int numTilesY, int batchNumTilesPadMultiple,
         int outChannels, int outChannelsPadMultiple,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
@@ -251,6 +585,7 @@ namespace OpenCLHelpers {
         const OpenCLTuneParams& tuneParams,
         int batchSize, int gpoolChannels, int nnXYLen,
         cl_mem gpoolConvOut, cl_mem gpoolConcat, cl_mem maskSum,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
@@ -260,6 +595,7 @@ namespace OpenCLHelpers {
         const OpenCLTuneParams& tuneParams,
         int batchSize, int gpoolChannels, int nnXYLen,
         cl_mem gpoolConvOut, cl_mem gpoolConcat, cl_mem maskSum,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
@@ -272,7 +608,35 @@ namespace OpenCLHelpers {
         int batchSize,
         int nnXLen,
         int nnYLen,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList,
         cl_event* eventBuf
     );
 
 }
+
+//A fixed sequence of kernel calls, such as a whole net evaluation at one batch size, with the arguments and sizes of
+//every call computed once so that replaying it is only the enqueues, like a CUDA graph for OpenCL 1.2.
+//Every call gets its own kernel object from newKernelLike, since arguments stay set on a kernel between calls.
+//Buffers bound into the plan must outlive it.
+struct OpenCLLaunchPlan {
+    OpenCLLaunchPlan();
+    ~OpenCLLaunchPlan();
+
+    OpenCLLaunchPlan(const OpenCLLaunchPlan&) = delete;
+    OpenCLLaunchPlan& operator=(const OpenCLLaunchPlan&) = delete;
+
+    //A new kernel object for the same program and kernel function as kernel, owned by the plan, to pass to one of
+    //the prepare functions of OpenCLHelpers
+    cl_kernel newKernelLike(cl_kernel kernel);
+    //Appends a call prepared on a kernel from newKernelLike
+    void add(const OpenCLHelpers::KernelLaunch& launch);
+
+    //Enqueues every call in order, each after the previous one even on an out-of-order queue.
+    //If eventsBuf is not null, it receives one event per call, for the caller to release.
+    cl_int replay(cl_command_queue commandQueue, std::vector<cl_event>* eventsBuf) const;
+    size_t size() const;
+
+private:
+    std::vector<cl_kernel> kernels;
+    std::vector<OpenCLHelpers::KernelLaunch> launches;
+};
@@ -1,10 +1,190 @@
 #include "openclkernels.h"
 
+#include <cctype>
+#include <set>
+#include <vector>
+
 using namespace std;
 
 string OpenCLKernels::fp16StorageDefine = " -DPRECISION_STORAGE=16";
 string OpenCLKernels::fp16ComputeDefine = " -DPRECISION=16";
 
+string OpenCLKernels::commonHeaderName = "common.opencl";
+string OpenCLKernels::clblastCommonHeaderName = "clblast_common.opencl";
+
+static string includeOf(const string& headerName) {
+  return "#include \"" + headerName + "\"\n";
+}
+
+static string stripComments(const string& source) {
+  string ret;
+  size_t i = 0;
+  bool inString = false;
+  while(i < source.size()) {
+    if(inString) {
+      if(source[i] == '"' || source[i] == '\n')
+        inString = false;
+      ret += source[i++];
+    }
+    else if(source.compare(i, 2, "//") == 0) {
+      while(i < source.size() && source[i] != '\n')
+        i++;
+    }
+    else if(source.compare(i, 2, "/*") == 0) {
+      size_t end = source.find("*/", i + 2);
+      i = (end == string::npos) ? source.size() : end + 2;
+      ret += ' ';
+    }
+    else {
+      if(source[i] == '"')
+        inString = true;
+      ret += source[i++];
+    }
+  }
+  return ret;
+}
+
+static bool isIdentifierChar(char c) {
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+static set<string> identifiersIn(const string& text) {
+  set<string> ret;
+  size_t i = 0;
+  while(i < text.size()) {
+    if(isIdentifierChar(text[i])) {
+      size_t start = i;
+      while(i < text.size() && isIdentifierChar(text[i]))
+        i++;
+      ret.insert(text.substr(start, i - start));
+    }
+    else
+      i++;
+  }
+  return ret;
+}
+
+//A top level piece of a program: a preprocessor directive, a declaration, or a function definition
+struct SourceChunk {
+  string text;
+  //Empty unless a function definition
+  string functionName;
+  bool isKernel;
+};
+
+//The name of the function defined by text, which starts with its signature, ignoring any __attribute__((...))
+static string definedFunctionName(const string& text) {
+  string header = text.substr(0, text.find('{'));
+  size_t attr;
+  while((attr = header.find("__attribute__")) != string::npos) {
+    size_t end = header.find('(', attr);
+    int depth = 0;
+    for(; end < header.size(); end++) {
+      if(header[end] == '(') depth++;
+      else if(header[end] == ')' && --depth == 0) break;
+    }
+    header.erase(attr, end + 1 - attr);
+  }
+  size_t paren = header.find('(');
+  if(paren == string::npos)
+    return "";
+  size_t end = paren;
+  while(end > 0 && isspace((unsigned char)header[end-1]))
+    end--;
+  size_t start = end;
+  while(start > 0 && isIdentifierChar(header[start-1]))
+    start--;
+  return header.substr(start, end - start);
+}
+
+static vector<SourceChunk> splitTopLevel(const string& source) {
+  vector<SourceChunk> chunks;
+  string cur;
+  int depth = 0;
+  bool sawFunctionBody = false;
+  auto finish = [&]() {
+    SourceChunk chunk;
+    chunk.text = cur;
+    chunk.functionName = sawFunctionBody ? definedFunctionName(cur) : "";
+    chunk.isKernel = sawFunctionBody && cur.find("__kernel") != string::npos;
+    chunks.push_back(chunk);
+    cur.clear();
+    sawFunctionBody = false;
+  };
+
+  size_t i = 0;
+  while(i < source.size()) {
+    //Directives at the top level are chunks of their own, including continuation lines
+    if(depth == 0 && source[i] == '#' && cur.find_first_not_of(" \t\n") == string::npos) {
+      while(i < source.size()) {
+        if(source[i] == '\n' && (cur.empty() || cur.back() != '\\'))
+          break;
+        cur += source[i++];
+      }
+      finish();
+      continue;
+    }
+    char c = source[i++];
+    cur += c;
+    if(c == '{') {
+      //A brace at the top level after a closing paren opens a function body, rather than a struct or initializer
+      if(depth == 0) {
+        size_t last = cur.find_last_not_of(" \t\n", cur.size() - 2);
+        sawFunctionBody = last != string::npos && cur[last] == ')';
+      }
+      depth++;
+    }
+    else if(c == '}') {
+      depth--;
+      if(depth == 0 && sawFunctionBody)
+        finish();
+    }
+    else if(c == ';' && depth == 0)
+      finish();
+  }
+  if(cur.find_first_not_of(" \t\n") != string::npos)
+    finish();
+  return chunks;
+}
+
+string OpenCLKernels::sourceForKernel(const string& source, const string& entryPoint) {
+  vector<SourceChunk> chunks = splitTopLevel(stripComments(source));
+
+  //Keep everything that is not a function, the entry point, and then every function named by anything kept
+  vector<bool> keep(chunks.size());
+  set<string> referenced;
+  for(size_t i = 0; i<chunks.size(); i++) {
+    keep[i] = chunks[i].functionName.empty() || chunks[i].functionName == entryPoint;
+    if(keep[i]) {
+      set<string> ids = identifiersIn(chunks[i].text);
+      referenced.insert(ids.begin(), ids.end());
+    }
+  }
+  bool changed = true;
+  while(changed) {
+    changed = false;
+    for(size_t i = 0; i<chunks.size(); i++) {
+      if(keep[i] || chunks[i].isKernel || referenced.find(chunks[i].functionName) == referenced.end())
+        continue;
+      keep[i] = true;
+      set<string> ids = identifiersIn(chunks[i].text);
+      referenced.insert(ids.begin(), ids.end());
+      changed = true;
+    }
+  }
+
+  string ret;
+  for(size_t i = 0; i<chunks.size(); i++) {
+    if(!keep[i])
+      continue;
+    size_t start = chunks[i].text.find_first_not_of(" \t\n");
+    if(start == string::npos)
+      continue;
+    ret += chunks[i].text.substr(start) + "\n";
+  }
+  return ret;
+}
+
 string OpenCLKernels::common = R"%%(
 #ifndef PRECISION
   #define PRECISION 32
@@ -200,7 +380,7 @@ __kernel void conv2dNCHW(
 )%%";
 
 
-string OpenCLKernels::winogradTransformNCHW = OpenCLKernels::common + R"%%(
+static const string winogradTransformNCHWBody = R"%%(
 
 //Expected defines---------------------------------
 
@@ -381,6 +561,8 @@ __kernel void transform(
 }
 
 )%%";
+string OpenCLKernels::winogradTransformNCHW = OpenCLKernels::common + winogradTransformNCHWBody;
+string OpenCLKernels::winogradTransformNCHWIncludingCommon = includeOf(OpenCLKernels::commonHeaderName) + winogradTransformNCHWBody;
 
 string OpenCLKernels::winogradBNReluTransformNCHW = OpenCLKernels::common + R"%%(
 
@@ -572,7 +754,7 @@ __kernel void bnReluTransform(
 
 )%%";
 
-string OpenCLKernels::winogradUntransformNCHW = OpenCLKernels::common + R"%%(
+static const string winogradUntransformNCHWBody = R"%%(
 
 //Expected defines---------------------------------
 
@@ -729,6 +911,8 @@ __kernel void untransform(
 }
 
 )%%";
+string OpenCLKernels::winogradUntransformNCHW = OpenCLKernels::common + winogradUntransformNCHWBody;
+string OpenCLKernels::winogradUntransformNCHWIncludingCommon = includeOf(OpenCLKernels::commonHeaderName) + winogradUntransformNCHWBody;
 
 
 string OpenCLKernels::scaleBiasMaskNCHW = OpenCLKernels::common + R"%%(
@@ -1046,26 +1230,170 @@ __kernel void extractChannel0NCHW(__global realstore* in, __global realstore* ou
 )%%";
 
 //.
-string OpenCLKernels::xgemmDirect =
+string OpenCLKernels::clblastCommon =
 #include "external/clblast/common.opencl"
+;
+
+static const string xgemmDirectBody =
 #include "external/clblast/xgemm_direct_part1.opencl"
 #include "external/clblast/xgemm_direct_part2.opencl"
 #include "external/clblast/xgemm_direct_part3.opencl"
 #include "external/clblast/xgemm_direct_batched.opencl"
 ;
+string OpenCLKernels::xgemmDirect = OpenCLKernels::clblastCommon + xgemmDirectBody;
+string OpenCLKernels::xgemmDirectIncludingCommon = includeOf(OpenCLKernels::clblastCommonHeaderName) + xgemmDirectBody;
 
-string OpenCLKernels::xgemm =
-"#define ROUTINE_GEMMBATCHED\n"
-#include "external/clblast/common.opencl"
+static const string xgemmBody =
 #include "external/clblast/xgemm_part1a.opencl"
 #include "external/clblast/xgemm_part1b.opencl"
 #include "external/clblast/xgemm_part2.opencl"
 #include "external/clblast/xgemm_part3.opencl"
 #include "external/clblast/xgemm_batched.opencl"
 ;
+string OpenCLKernels::xgemm = "#define ROUTINE_GEMMBATCHED\n" + OpenCLKernels::clblastCommon + xgemmBody;
+string OpenCLKernels::xgemmIncludingCommon = "#define ROUTINE_GEMMBATCHED\n" + includeOf(OpenCLKernels::clblastCommonHeaderName) + xgemmBody;
 
-string OpenCLKernels::hgemmWmma =
-""
-#include "external/clblast/common.opencl"
+string OpenCLKernels::xgemmDirectStridedBatchedNN = sourceForKernel(OpenCLKernels::xgemmDirect, "XgemmDirectStridedBatchedNN");
+string OpenCLKernels::xgemmDirectStridedBatchedNNIncludingCommon = sourceForKernel(OpenCLKernels::xgemmDirectIncludingCommon, "XgemmDirectStridedBatchedNN");
+string OpenCLKernels::xgemmBatched = sourceForKernel(OpenCLKernels::xgemm, "XgemmBatched");
+string OpenCLKernels::xgemmBatchedIncludingCommon = sourceForKernel(OpenCLKernels::xgemmIncludingCommon, "XgemmBatched");
+
+static const string hgemmWmmaBody =
 #include "hgemm_wmma.opencl"
 ;
+string OpenCLKernels::hgemmWmma = OpenCLKernels::clblastCommon + hgemmWmmaBody;
+string OpenCLKernels::hgemmWmmaIncludingCommon = includeOf(OpenCLKernels::clblastCommonHeaderName) + hgemmWmmaBody;
+
+//Kernels for measuring the peak capabilities of a device, not used by the net itself
+string OpenCLKernels::microbench = OpenCLKernels::common + R"%%(
+
+#if PRECISION == 16
+  typedef half4 real4;
+#else
+  typedef float4 real4;
+#endif
+
+//8 independent chains of vector multiply-adds so that latency is hidden, 64 flops per vector lane per iteration
+__kernel void peakFlops(__global realstore* out, float aF, float bF, int numIters) {
+  const real a = floatToReal(aF);
+  const real b = floatToReal(bF);
+  real4 x0 = (real4)(floatToReal((float)get_global_id(0) * 1e-6f));
+  real4 x1 = x0 + ONE;
+  real4 x2 = x0 + TWO;
+  real4 x3 = x0 + FOUR;
+  real4 x4 = x0 - ONE;
+  real4 x5 = x0 - TWO;
+  real4 x6 = x0 - FOUR;
+  real4 x7 = x0 + HALF;
+  for(int i = 0; i < numIters; i++) {
+    x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);
+    x4 = mad(x4, a, b); x5 = mad(x5, a, b); x6 = mad(x6, a, b); x7 = mad(x7, a, b);
+    x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);
+    x4 = mad(x4, a, b); x5 = mad(x5, a, b); x6 = mad(x6, a, b); x7 = mad(x7, a, b);
+    x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);
+    x4 = mad(x4, a, b); x5 = mad(x5, a, b); x6 = mad(x6, a, b); x7 = mad(x7, a, b);
+    x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);
+    x4 = mad(x4, a, b); x5 = mad(x5, a, b); x6 = mad(x6, a, b); x7 = mad(x7, a, b);
+  }
+  real4 sum = ((x0 + x1) + (x2 + x3)) + ((x4 + x5) + (x6 + x7));
+  STORE(out, get_global_id(0), sum.x + sum.y + sum.z + sum.w);
+}
+
+__kernel void copyGlobal(__global const float4* restrict in, __global float4* restrict out) {
+  const int idx = get_global_id(0);
+  out[idx] = in[idx];
+}
+
+//Each iteration reads 4 float4s from local memory, at addresses that vary so the reads cannot be hoisted.
+//The local size must be a power of 2.
+__kernel void localMemBandwidth(__global float* out, int numIters, __local float4* buf) {
+  const int lid = get_local_id(0);
+  const int localMask = get_local_size(0) - 1;
+  buf[lid] = (float4)((float)lid);
+  barrier(CLK_LOCAL_MEM_FENCE);
+  float4 acc0 = (float4)(0.0f);
+  float4 acc1 = (float4)(0.0f);
+  int idx = lid;
+  for(int i = 0; i < numIters; i++) {
+    acc0 += buf[idx];
+    idx = (idx + 1) & localMask;
+    acc1 += buf[idx];
+    idx = (idx + 1) & localMask;
+    acc0 += buf[idx];
+    idx = (idx + 1) & localMask;
+    acc1 += buf[idx];
+    idx = (idx + 1) & localMask;
+  }
+  float4 acc = acc0 + acc1;
+  out[get_global_id(0)] = acc.x + acc.y + acc.z + acc.w;
+}
+
+__kernel void emptyKernel(__global float* out) {
+}
+)%%";
+
+//Compares a tuning candidate's output against a reference output, both on the device, so that only a few scalars need
+//to be read back. Both are viewed as 3D arrays of size0 x size1 x size2 with element (i0,i1,i2) at
+//i0 + stride1 * i1 + stride2 * i2, so that padding is skipped without copying.
+//Each work group writes its partial squared error, squared reference magnitude, max absolute error and count of
+//non-finite values to partials. The local size must be a power of 2.
+string OpenCLKernels::compareOutputs = OpenCLKernels::common + R"%%(
+__kernel void compareOutputs(
+  __global const realstore* restrict ref, int refStride1, int refStride2,
+  __global const realstore* restrict out, int outStride1, int outStride2,
+  int size0, int size1, int size2,
+  __global float* restrict partials,
+  __local float* scratch
+) {
+  const int lid = get_local_id(0);
+  const int localSize = get_local_size(0);
+  const int n = size0 * size1 * size2;
+
+  float sqErr = 0.0f;
+  float sqMag = 0.0f;
+  float maxAbsErr = 0.0f;
+  float numNonFinite = 0.0f;
+  for(int idx = get_global_id(0); idx < n; idx += get_global_size(0)) {
+    const int i0 = idx % size0;
+    const int rest = idx / size0;
+    const int i1 = rest % size1;
+    const int i2 = rest / size1;
+    const float r = LOAD(ref, i0 + refStride1 * i1 + refStride2 * i2);
+    const float o = LOAD(out, i0 + outStride1 * i1 + outStride2 * i2);
+    //Outputs start out as NaN, so an element that is NaN in both was written by neither config, such as the tail of
+    //a buffer sized for more channels than any call uses. Anything else non-finite is a wrong or missing write.
+    if(!isfinite(r) && !isfinite(o))
+      continue;
+    if(!isfinite(r) || !isfinite(o))
+      numNonFinite += 1.0f;
+    else {
+      const float d = r - o;
+      sqErr += d * d;
+      sqMag += r * r;
+      maxAbsErr = fmax(maxAbsErr, fabs(d));
+    }
+  }
+
+  scratch[lid * 4 + 0] = sqErr;
+  scratch[lid * 4 + 1] = sqMag;
+  scratch[lid * 4 + 2] = maxAbsErr;
+  scratch[lid * 4 + 3] = numNonFinite;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for(int s = localSize / 2; s > 0; s >>= 1) {
+    if(lid < s) {
+      scratch[lid * 4 + 0] += scratch[(lid + s) * 4 + 0];
+      scratch[lid * 4 + 1] += scratch[(lid + s) * 4 + 1];
+      scratch[lid * 4 + 2] = fmax(scratch[lid * 4 + 2], scratch[(lid + s) * 4 + 2]);
+      scratch[lid * 4 + 3] += scratch[(lid + s) * 4 + 3];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if(lid == 0) {
+    const int group = get_group_id(0);
+    partials[group * 4 + 0] = scratch[0];
+    partials[group * 4 + 1] = scratch[1];
+    partials[group * 4 + 2] = scratch[2];
+    partials[group * 4 + 3] = scratch[3];
+  }
+}
+)%%";
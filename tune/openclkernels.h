@@ -27,4 +27,29 @@ namespace OpenCLKernels {
   extern std::string xgemmDirect;
   extern std::string xgemm;
   extern std::string hgemmWmma;
+
+  //The shared definitions at the start of the kernels above, and the kernels tuned per candidate config with an
+  //#include of them in their place, for OpenCLHelpers::compileProgramWithHeader
+  extern std::string commonHeaderName;
+  extern std::string clblastCommonHeaderName;
+  extern std::string clblastCommon;
+  extern std::string winogradTransformNCHWIncludingCommon;
+  extern std::string winogradUntransformNCHWIncludingCommon;
+  extern std::string xgemmDirectIncludingCommon;
+  extern std::string xgemmIncludingCommon;
+  extern std::string hgemmWmmaIncludingCommon;
+
+  //Reduces a program source to what the kernel named entryPoint needs. Comments are removed, along with the other
+  //kernels and every function that nothing kept refers to. Preprocessor directives are all kept, so the result
+  //builds with the same options as the full source.
+  std::string sourceForKernel(const std::string& source, const std::string& entryPoint);
+
+  //The only kernels of xgemmDirect and xgemm that the tuner and the net use, reduced by sourceForKernel
+  extern std::string xgemmDirectStridedBatchedNN;
+  extern std::string xgemmDirectStridedBatchedNNIncludingCommon;
+  extern std::string xgemmBatched;
+  extern std::string xgemmBatchedIncludingCommon;
+
+  extern std::string microbench;
+  extern std::string compareOutputs;
 }
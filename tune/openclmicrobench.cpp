@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "openclmicrobench.h"
+#include "openclkernels.h"
+
+using namespace std;
+using namespace OpenCLHelpers;
+
+//Long enough that launch overhead and timer resolution do not matter
+static constexpr double TARGET_KERNEL_SECONDS = 0.01;
+static constexpr int NUM_TIMED_REPS = 5;
+
+bool OpenCLDevicePeaks::isMeasured() const {
+    return gflopsFP32 > 0 && globalMemGBytesPerSecond > 0;
+}
+
+string OpenCLDevicePeaks::desc() const {
+    ostringstream o;
+    o << "FP32 " << gflopsFP32 << " GFLOP/s"
+      << " FP16 " << gflopsFP16 << " GFLOP/s"
+      << " global mem " << globalMemGBytesPerSecond << " GB/s"
+      << " local mem " << localMemGBytesPerSecond << " GB/s"
+      << " launch latency " << launchLatencyMicroseconds << " us";
+    return o.str();
+}
+
+//Runs the kernel once to warm up and then NUM_TIMED_REPS more times, returning the fastest time in seconds
+static double timeKernel(cl_command_queue commandQueue, cl_kernel kernel, size_t globalSize, size_t localSize) {
+    double bestSeconds = 1e30;
+    for (int i = 0; i < NUM_TIMED_REPS + 1; i++) {
+        cl_event event;
+        cl_int err;
+        err = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalSize, localSize > 0 ? &localSize : NULL, 0, NULL, &event); CHECK_ERR(err);
+        err = clWaitForEvents(1, &event); CHECK_ERR(err);
+
+        cl_ulong time_start, time_end;
+        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL); CHECK_ERR(err);
+        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL); CHECK_ERR(err);
+        clReleaseEvent(event);
+
+        if (i > 0)
+            bestSeconds = std::min(bestSeconds, (time_end - time_start) * 1e-9);
+    }
+    return bestSeconds;
+}
+
+//For kernels whose work scales with an iteration count in the given arg, picks the count that takes about
+//TARGET_KERNEL_SECONDS and returns the fastest time at that count
+static double timeKernelWithIters(
+    cl_command_queue commandQueue, cl_kernel kernel, size_t globalSize, size_t localSize, cl_uint itersArgIdx, int& numItersBuf
+) {
+    int numIters = 16;
+    while (true) {
+        clSetKernelArg(kernel, itersArgIdx, sizeof(int), (void*)&numIters);
+        double seconds = timeKernel(commandQueue, kernel, globalSize, localSize);
+        if (seconds >= TARGET_KERNEL_SECONDS || numIters >= (1 << 20)) {
+            numItersBuf = numIters;
+            return seconds;
+        }
+        double scale = seconds > 0 ? TARGET_KERNEL_SECONDS / seconds : 16.0;
+        numIters = (int)std::min((double)(1 << 20), std::max(numIters * 2.0, numIters * scale * 1.1));
+    }
+}
+
+static double measurePeakGFlops(
+    const InitializedDevice* device, size_t localSize, bool useFP16, ostream& out
+) {
+    const vector<cl_device_id> deviceIds = { device->info.deviceId };
+    cl_program program;
+    string compileError;
+    bool compileSuc = tryCompileProgram(
+        "microbenchProgram", device->context, deviceIds, OpenCLKernels::microbench,
+        useFP16 ? OpenCLKernels::fp16StorageDefine + OpenCLKernels::fp16ComputeDefine : "",
+        program, compileError
+    );
+    if (!compileSuc) {
+        out << "Could not compile " << (useFP16 ? "FP16" : "FP32") << " flops microbenchmark: " << compileError << endl;
+        return 0.0;
+    }
+
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(program, "peakFlops", &err); CHECK_ERR(err);
+    //Enough work items to fill every compute unit many times over
+    size_t globalSize = roundUpToMultiple((size_t)std::max(device->info.maxComputeUnits, 1) * 4096, localSize);
+    cl_mem output = createReadWriteBufferFloat(device->context, device->info.hostUnifiedMemory, globalSize);
+
+    float a = 0.999f;
+    float b = 0.001f;
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&output);
+    clSetKernelArg(kernel, 1, sizeof(float), (void*)&a);
+    clSetKernelArg(kernel, 2, sizeof(float), (void*)&b);
+    int numIters;
+    double seconds = timeKernelWithIters(device->commandQueue, kernel, globalSize, localSize, 3, numIters);
+
+    clReleaseMemObject(output);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+
+    //Each iteration is 4 multiply-adds on each of 8 chains of 4-wide vectors
+    double flops = (double)globalSize * numIters * 4 * 8 * 4 * 2;
+    return flops / seconds * 1e-9;
+}
+
+OpenCLDevicePeaks OpenCLMicrobench::measure(DevicesContext& devicesContext, int gpuIdx, ostream& out) {
+    const InitializedDevice* device = devicesContext.findGpuExn(gpuIdx);
+    const cl_context& context = device->context;
+    cl_command_queue commandQueue = device->commandQueue;
+    const vector<cl_device_id> deviceIds = { device->info.deviceId };
+
+    out << "Measuring peak capabilities of " << device->info.name << endl;
+
+    cl_int err;
+    cl_ulong maxAllocSize;
+    err = clGetDeviceInfo(device->info.deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocSize), &maxAllocSize, NULL); CHECK_ERR(err);
+
+    size_t localSize = (size_t)std::min(64, std::max(device->info.maxWorkGroupSize, 1));
+
+    OpenCLDevicePeaks peaks;
+    peaks.gflopsFP32 = measurePeakGFlops(device, localSize, false, out);
+    if (device->info.supportsFP16Compute)
+        peaks.gflopsFP16 = measurePeakGFlops(device, localSize, true, out);
+
+    cl_program program = compileProgram("microbenchProgram", context, deviceIds, OpenCLKernels::microbench, "");
+
+    //Global memory bandwidth, copying a buffer much larger than any cache
+    {
+        cl_kernel kernel = clCreateKernel(program, "copyGlobal", &err); CHECK_ERR(err);
+        size_t numFloat4s = std::min((size_t)(16 * 1024 * 1024), (size_t)(maxAllocSize / (4 * sizeof(float))));
+        cl_mem input = createReadWriteBufferFloat(context, device->info.hostUnifiedMemory, numFloat4s * 4);
+        cl_mem output = createReadWriteBufferFloat(context, device->info.hostUnifiedMemory, numFloat4s * 4);
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&input);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&output);
+        double seconds = timeKernel(commandQueue, kernel, numFloat4s, 0);
+        peaks.globalMemGBytesPerSecond = 2.0 * numFloat4s * 4 * sizeof(float) / seconds * 1e-9;
+        clReleaseMemObject(input);
+        clReleaseMemObject(output);
+        clReleaseKernel(kernel);
+    }
+
+    //Local memory bandwidth
+    {
+        cl_kernel kernel = clCreateKernel(program, "localMemBandwidth", &err); CHECK_ERR(err);
+        size_t bwLocalSize = powerOf2ify(std::min(256, std::max(device->info.maxWorkGroupSize, 1)));
+        if (bwLocalSize > (size_t)std::max(device->info.maxWorkGroupSize, 1))
+            bwLocalSize /= 2;
+        while (bwLocalSize > 1 && bwLocalSize * 4 * sizeof(float) > device->info.localMemSize)
+            bwLocalSize /= 2;
+        size_t globalSize = (size_t)std::max(device->info.maxComputeUnits, 1) * bwLocalSize * 16;
+        cl_mem output = createReadWriteBufferFloat(context, device->info.hostUnifiedMemory, globalSize);
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&output);
+        clSetKernelArg(kernel, 2, bwLocalSize * 4 * sizeof(float), NULL);
+        int numIters;
+        double seconds = timeKernelWithIters(commandQueue, kernel, globalSize, bwLocalSize, 1, numIters);
+        peaks.localMemGBytesPerSecond = (double)globalSize * numIters * 4 * 4 * sizeof(float) / seconds * 1e-9;
+        clReleaseMemObject(output);
+        clReleaseKernel(kernel);
+    }
+
+    //Launch latency, the round trip from the host for a kernel that does nothing
+    {
+        cl_kernel kernel = clCreateKernel(program, "emptyKernel", &err); CHECK_ERR(err);
+        cl_mem output = createReadWriteBufferFloat(context, device->info.hostUnifiedMemory, 1);
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&output);
+        size_t globalSize = 1;
+        const int numLaunches = 100;
+        //The first launch is warmup
+        for (int i = 0; i < numLaunches + 1; i++) {
+            auto start = std::chrono::steady_clock::now();
+            err = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalSize, NULL, 0, NULL, NULL); CHECK_ERR(err);
+            err = clFinish(commandQueue); CHECK_ERR(err);
+            if (i > 0)
+                peaks.launchLatencyMicroseconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e6 / numLaunches;
+        }
+        clReleaseMemObject(output);
+        clReleaseKernel(kernel);
+    }
+
+    clReleaseProgram(program);
+
+    out << "Measured " << peaks.desc() << endl;
+    return peaks;
+}
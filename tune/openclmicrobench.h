@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <ostream>
+
+#include "openclhelpers.h"
+
+//Measured peak capabilities of a device. 0 for anything not measured or not supported.
+struct OpenCLDevicePeaks {
+    double gflopsFP32 = 0.0;
+    double gflopsFP16 = 0.0;
+    double globalMemGBytesPerSecond = 0.0;
+    double localMemGBytesPerSecond = 0.0;
+    //Host time from enqueueing an empty kernel until clFinish returns
+    double launchLatencyMicroseconds = 0.0;
+
+    bool isMeasured() const;
+    std::string desc() const;
+};
+
+namespace OpenCLMicrobench {
+    //Runs a set of small benchmarks on the device to measure its peaks, takes a few seconds.
+    //Requires a DevicesContext created with profiling enabled.
+    OpenCLDevicePeaks measure(DevicesContext& devicesContext, int gpuIdx, std::ostream& out);
+}
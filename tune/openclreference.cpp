@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//AVX2 is picked at runtime like the half conversions in openclhelpers.cpp. NEON is part of every AArch64 CPU, so
+//it is enough that the compiler targets it.
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define REFERENCE_AVX2
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #define SIMD_TARGET(features)
+  #else
+    #define SIMD_TARGET(features) __attribute__((target(features)))
+  #endif
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+#include "openclreference.h"
+#include "openclhelpers.h"
+
+using namespace std;
+
+//Threads kept for the whole run, since the references are computed again for every stage and check
+class WorkerPool {
+public:
+    explicit WorkerPool(int numWorkers)
+        : task(nullptr),
+          numTasks(0),
+          nextTask(0),
+          numUnfinished(0),
+          generation(0),
+          stopping(false)
+    {
+        for (int i = 0; i < numWorkers; i++)
+            threads.push_back(std::thread([this]() { workerLoop(); }));
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    int numWorkers() const { return (int)threads.size(); }
+
+    //Runs f(i) for each i in [0,n) on the workers and the calling thread, returning once all have finished.
+    //Calls from several threads at once take turns.
+    void run(int n, const std::function<void(int)>& f) {
+        std::lock_guard<std::mutex> runLock(runMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &f;
+            numTasks = n;
+            nextTask = 0;
+            numUnfinished = n;
+            generation++;
+        }
+        workAvailable.notify_all();
+        runTasks();
+        std::unique_lock<std::mutex> lock(mutex);
+        allFinished.wait(lock, [this]() { return numUnfinished == 0; });
+        task = nullptr;
+    }
+
+private:
+    void runTasks() {
+        while (true) {
+            int i;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (task == nullptr || nextTask >= numTasks)
+                    return;
+                i = nextTask++;
+            }
+            (*task)(i);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--numUnfinished == 0)
+                allFinished.notify_all();
+        }
+    }
+
+    void workerLoop() {
+        uint64_t seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            workAvailable.wait(lock, [&]() { return stopping || generation != seenGeneration; });
+            if (stopping)
+                return;
+            seenGeneration = generation;
+            lock.unlock();
+            runTasks();
+            lock.lock();
+        }
+    }
+
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allFinished;
+    vector<std::thread> threads;
+    //Everything below is guarded by mutex
+    const std::function<void(int)>* task;
+    int numTasks;
+    int nextTask;
+    int numUnfinished;
+    uint64_t generation;
+    bool stopping;
+};
+
+//Splits [0,n) into contiguous chunks and runs f on each chunk in parallel, one chunk per hardware thread
+static void parallelFor(int n, const std::function<void(int start, int end)>& f) {
+    static WorkerPool pool(std::max(1, (int)std::thread::hardware_concurrency()) - 1);
+    int numChunks = std::min(n, pool.numWorkers() + 1);
+    if (numChunks <= 1) {
+        f(0, n);
+        return;
+    }
+    pool.run(numChunks, [&](int i) {
+        int start = (int)((int64_t)n * i / numChunks);
+        int end = (int)((int64_t)n * (i + 1) / numChunks);
+        f(start, end);
+    });
+}
+
+#ifdef REFERENCE_AVX2
+//Does the leading multiple of 8 of axpy and returns how many elements that was
+SIMD_TARGET("avx2,fma")
+static int axpyAVX2(int n, float a, const float* x, float* y) {
+    int i = 0;
+    __m256 av = _mm256_set1_ps(a);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(av, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    return i;
+}
+#endif
+
+//y += a * x
+static void axpy(int n, float a, const float* x, float* y) {
+    int i = 0;
+#if defined(REFERENCE_AVX2)
+    static const bool useAVX2 = OpenCLHelpers::hostSupportsAVX2FMA();
+    if (useAVX2)
+        i = axpyAVX2(n, a, x, y);
+#elif defined(__ARM_NEON)
+    float32x4_t av = vdupq_n_f32(a);
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(y + i, vmlaq_f32(vld1q_f32(y + i), av, vld1q_f32(x + i)));
+#endif
+    for (; i < n; i++)
+        y[i] += a * x[i];
+}
+
+void OpenCLReference::stridedBatchedGemm_KM_KN_NM(
+    int M, int N, int K,
+    const float* A, int aStride,
+    const float* B, int bStride,
+    float* C, int cStride,
+    int numBatchElts
+) {
+    //Each row of C is a sum of rows of A, so every step is a contiguous axpy
+    parallelFor(numBatchElts * N, [&](int start, int end) {
+        for (int row = start; row < end; row++) {
+            int batch = row / N;
+            int n = row % N;
+            const float* a = A + (size_t)batch * aStride;
+            const float* b = B + (size_t)batch * bStride;
+            float* c = C + (size_t)batch * cStride + (size_t)n * M;
+            std::fill(c, c + M, 0.0f);
+            for (int k = 0; k < K; k++)
+                axpy(M, b[(size_t)k * N + n], a + (size_t)k * M, c);
+        }
+    });
+}
+
+//Winograd matrices for a 3x3 convolution, matching the non-low-error variants in the kernels.
+//Returns nullptr if there is none for the tile size.
+static const float* getTransformMatrix(int inTileSize, int outTileSize) {
+    static const float transform2[4 * 4] = {
+        1,  0, -1,  0,
+        0,  1,  1,  0,
+        0, -1,  1,  0,
+        0,  1,  0, -1,
+    };
+    static const float transform4[6 * 6] = {
+        4,  0, -5,  0,  1,  0,
+        0, -4, -4,  1,  1,  0,
+        0,  4, -4, -1,  1,  0,
+        0, -2, -1,  2,  1,  0,
+        0,  2, -1, -2,  1,  0,
+        0,  4,  0, -5,  0,  1,
+    };
+    if (outTileSize == 2 && inTileSize == 4)
+        return transform2;
+    if (outTileSize == 4 && inTileSize == 6)
+        return transform4;
+    return nullptr;
+}
+static const float* getUntransformMatrix(int inTileSize, int outTileSize) {
+    static const float untransform2[2 * 4] = {
+        1,  1,  1,  0,
+        0,  1, -1, -1,
+    };
+    static const float untransform4[4 * 6] = {
+        1,  1,  1,  1,  1,  0,
+        0,  1, -1,  2, -2,  0,
+        0,  1,  1,  4,  4,  0,
+        0,  1, -1,  8, -8,  1,
+    };
+    if (outTileSize == 2 && inTileSize == 4)
+        return untransform2;
+    if (outTileSize == 4 && inTileSize == 6)
+        return untransform4;
+    return nullptr;
+}
+
+bool OpenCLReference::winogradTransform3x3(
+    const float* input, float* transformed,
+    int batchSize, int nnXLen, int nnYLen,
+    int inTileXSize, int inTileYSize, int outTileXSize, int outTileYSize,
+    int inChannels, int inChannelsPadded, int numTilesTotalPadded
+) {
+    const float* transformX = getTransformMatrix(inTileXSize, outTileXSize);
+    const float* transformY = getTransformMatrix(inTileYSize, outTileYSize);
+    if (transformX == nullptr || transformY == nullptr)
+        return false;
+
+    const int numTilesX = (nnXLen + outTileXSize - 1) / outTileXSize;
+    const int numTilesY = (nnYLen + outTileYSize - 1) / outTileYSize;
+    const int numTilesTotal = batchSize * numTilesX * numTilesY;
+    const int tileStride = numTilesTotalPadded;
+
+    //Work on all tiles of a channel at once, so that each step of the transform is an axpy across tiles
+    parallelFor(inChannelsPadded, [&](int start, int end) {
+        vector<float> tiles((size_t)inTileYSize * inTileXSize * tileStride);
+        vector<float> rowsDone((size_t)inTileYSize * inTileXSize * tileStride);
+        for (int ic = start; ic < end; ic++) {
+            std::fill(tiles.begin(), tiles.end(), 0.0f);
+            if (ic < inChannels) {
+                for (int tile = 0; tile < numTilesTotal; tile++) {
+                    int tileX = tile % numTilesX;
+                    int tileY = (tile / numTilesX) % numTilesY;
+                    int n = tile / (numTilesX * numTilesY);
+                    const float* channel = input + ((size_t)n * inChannels + ic) * nnYLen * nnXLen;
+                    for (int subY = 0; subY < inTileYSize; subY++) {
+                        int y = tileY * outTileYSize + subY - 1;
+                        for (int subX = 0; subX < inTileXSize; subX++) {
+                            int x = tileX * outTileXSize + subX - 1;
+                            if (y >= 0 && y < nnYLen && x >= 0 && x < nnXLen)
+                                tiles[((size_t)subY * inTileXSize + subX) * tileStride + tile] = channel[y * nnXLen + x];
+                        }
+                    }
+                }
+            }
+
+            std::fill(rowsDone.begin(), rowsDone.end(), 0.0f);
+            for (int subY = 0; subY < inTileYSize; subY++) {
+                for (int j = 0; j < inTileXSize; j++) {
+                    float* dst = rowsDone.data() + ((size_t)subY * inTileXSize + j) * tileStride;
+                    for (int a = 0; a < inTileXSize; a++) {
+                        float coeff = transformX[j * inTileXSize + a];
+                        if (coeff != 0.0f)
+                            axpy(numTilesTotal, coeff, tiles.data() + ((size_t)subY * inTileXSize + a) * tileStride, dst);
+                    }
+                }
+            }
+
+            for (int i = 0; i < inTileYSize; i++) {
+                for (int subX = 0; subX < inTileXSize; subX++) {
+                    float* dst = transformed + (((size_t)i * inTileXSize + subX) * inChannelsPadded + ic) * tileStride;
+                    std::fill(dst, dst + tileStride, 0.0f);
+                    for (int a = 0; a < inTileYSize; a++) {
+                        float coeff = transformY[i * inTileYSize + a];
+                        if (coeff != 0.0f)
+                            axpy(numTilesTotal, coeff, rowsDone.data() + ((size_t)a * inTileXSize + subX) * tileStride, dst);
+                    }
+                }
+            }
+        }
+    });
+    return true;
+}
+
+bool OpenCLReference::winogradUntransform3x3(
+    const float* transformed, float* output,
+    int batchSize, int nnXLen, int nnYLen,
+    int inTileXSize, int inTileYSize, int outTileXSize, int outTileYSize,
+    int outChannels, int outChannelsPadded, int numTilesTotalPadded
+) {
+    const float* untransformX = getUntransformMatrix(inTileXSize, outTileXSize);
+    const float* untransformY = getUntransformMatrix(inTileYSize, outTileYSize);
+    if (untransformX == nullptr || untransformY == nullptr)
+        return false;
+
+    const int numTilesX = (nnXLen + outTileXSize - 1) / outTileXSize;
+    const int numTilesY = (nnYLen + outTileYSize - 1) / outTileYSize;
+    const int numTilesTotal = batchSize * numTilesX * numTilesY;
+    const int tileStride = numTilesTotalPadded;
+
+    parallelFor(outChannels, [&](int start, int end) {
+        vector<float> rowsDone((size_t)inTileYSize * outTileXSize * numTilesTotal);
+        vector<float> result((size_t)outTileYSize * outTileXSize * numTilesTotal);
+        for (int oc = start; oc < end; oc++) {
+            std::fill(rowsDone.begin(), rowsDone.end(), 0.0f);
+            for (int subY = 0; subY < inTileYSize; subY++) {
+                for (int j = 0; j < outTileXSize; j++) {
+                    float* dst = rowsDone.data() + ((size_t)subY * outTileXSize + j) * numTilesTotal;
+                    for (int b = 0; b < inTileXSize; b++) {
+                        float coeff = untransformX[j * inTileXSize + b];
+                        if (coeff != 0.0f)
+                            axpy(numTilesTotal, coeff, transformed + (((size_t)subY * inTileXSize + b) * outChannelsPadded + oc) * tileStride, dst);
+                    }
+                }
+            }
+
+            std::fill(result.begin(), result.end(), 0.0f);
+            for (int i = 0; i < outTileYSize; i++) {
+                for (int j = 0; j < outTileXSize; j++) {
+                    float* dst = result.data() + ((size_t)i * outTileXSize + j) * numTilesTotal;
+                    for (int a = 0; a < inTileYSize; a++) {
+                        float coeff = untransformY[i * inTileYSize + a];
+                        if (coeff != 0.0f)
+                            axpy(numTilesTotal, coeff, rowsDone.data() + ((size_t)a * outTileXSize + j) * numTilesTotal, dst);
+                    }
+                }
+            }
+
+            for (int tile = 0; tile < numTilesTotal; tile++) {
+                int tileX = tile % numTilesX;
+                int tileY = (tile / numTilesX) % numTilesY;
+                int n = tile / (numTilesX * numTilesY);
+                float* channel = output + ((size_t)n * outChannels + oc) * nnYLen * nnXLen;
+                for (int i = 0; i < outTileYSize; i++) {
+                    int y = tileY * outTileYSize + i;
+                    for (int j = 0; j < outTileXSize; j++) {
+                        int x = tileX * outTileXSize + j;
+                        if (y < nnYLen && x < nnXLen)
+                            channel[y * nnXLen + x] = result[((size_t)i * outTileXSize + j) * numTilesTotal + tile];
+                    }
+                }
+            }
+        }
+    });
+    return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+//Host implementations of what the tuned kernels compute, to check the results of the OpenCL kernels against.
+//Vectorized with AVX2 when the CPU has it or NEON when compiled for it, with a scalar fallback, and spread across all
+//hardware threads.
+//Layouts and argument conventions follow the corresponding functions in OpenCLHelpers.
+namespace OpenCLReference {
+    //For each of numBatchElts batch elements, C[n][m] = sum_k A[k][m] * B[k][n], where
+    //A is K x M, B is K x N and C is N x M, and batch element i of each starts at i times its stride
+    void stridedBatchedGemm_KM_KN_NM(
+        int M, int N, int K,
+        const float* A, int aStride,
+        const float* B, int bStride,
+        float* C, int cStride,
+        int numBatchElts
+    );
+
+    //Winograd transform for a 3x3 convolution like the winogradTransformNCHW kernel, from input laid out as
+    //N, inChannels, H, W to transformed laid out as (inTileYSize, inTileXSize), inChannelsPadded, numTilesTotalPadded.
+    //Supports output tiles of size 2 and 4 along each dimension. Returns false for any other tile size.
+    bool winogradTransform3x3(
+        const float* input, float* transformed,
+        int batchSize, int nnXLen, int nnYLen,
+        int inTileXSize, int inTileYSize, int outTileXSize, int outTileYSize,
+        int inChannels, int inChannelsPadded, int numTilesTotalPadded
+    );
+
+    //Inverse of winogradTransform3x3 like the winogradUntransformNCHW kernel, from transformed laid out as
+    //(inTileYSize, inTileXSize), outChannelsPadded, numTilesTotalPadded to output laid out as N, outChannels, H, W.
+    //Returns false for unsupported tile sizes.
+    bool winogradUntransform3x3(
+        const float* transformed, float* output,
+        int batchSize, int nnXLen, int nnYLen,
+        int inTileXSize, int inTileYSize, int outTileXSize, int outTileYSize,
+        int outChannels, int outChannelsPadded, int numTilesTotalPadded
+    );
+}
@@ -0,0 +1,108 @@
+#include <fstream>
+#include <iomanip>
+
+#include "opencltrace.h"
+#include "openclhelpers.h"
+
+using namespace std;
+
+static constexpr int HOST_PID = 1;
+static constexpr int DEVICE_PID = 2;
+static constexpr int DEVICE_QUEUE_TID = 1;
+static constexpr int DEVICE_EXECUTION_TID = 2;
+
+OpenCLTrace::OpenCLTrace()
+    : startTime(std::chrono::steady_clock::now()),
+    events(),
+    openSpanNames(),
+    hasDeviceOffset(false),
+    deviceToHostOffsetMicros(0.0)
+{}
+
+double OpenCLTrace::nowMicros() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+OpenCLTrace::Span::Span(OpenCLTrace* t, const string& n)
+    : trace(t),
+    name(n),
+    startMicros(0.0),
+    ended(false)
+{
+    if (trace != nullptr) {
+        startMicros = trace->nowMicros();
+        trace->openSpanNames.push_back(name);
+    }
+}
+
+OpenCLTrace::Span::~Span() {
+    end();
+}
+
+void OpenCLTrace::Span::end() {
+    if (trace == nullptr || ended)
+        return;
+    ended = true;
+    double endMicros = trace->nowMicros();
+    trace->events.push_back(TraceEvent{ name, "host", HOST_PID, 1, startMicros, endMicros - startMicros });
+    for (int i = (int)trace->openSpanNames.size() - 1; i >= 0; i--) {
+        if (trace->openSpanNames[i] == name) {
+            trace->openSpanNames.erase(trace->openSpanNames.begin() + i);
+            break;
+        }
+    }
+}
+
+void OpenCLTrace::addDeviceEvent(cl_event event) {
+    cl_ulong timeQueued, timeSubmit, timeStart, timeEnd;
+    cl_int err;
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(timeQueued), &timeQueued, NULL); CHECK_ERR(err);
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(timeSubmit), &timeSubmit, NULL); CHECK_ERR(err);
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(timeStart), &timeStart, NULL); CHECK_ERR(err);
+    err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(timeEnd), &timeEnd, NULL); CHECK_ERR(err);
+
+    //OpenCL 1.2 has no way to read the device clock from the host, so assume the first event finished just now.
+    //Later events can then be off by the time between that event finishing and being recorded.
+    if (!hasDeviceOffset) {
+        deviceToHostOffsetMicros = nowMicros() - timeEnd * 1e-3;
+        hasDeviceOffset = true;
+    }
+    auto toMicros = [&](cl_ulong deviceNanos) { return deviceNanos * 1e-3 + deviceToHostOffsetMicros; };
+
+    string name = openSpanNames.size() > 0 ? openSpanNames.back() : "command";
+    events.push_back(TraceEvent{ name + " queued", "device", DEVICE_PID, DEVICE_QUEUE_TID, toMicros(timeQueued), (timeSubmit - timeQueued) * 1e-3 });
+    events.push_back(TraceEvent{ name + " submitted", "device", DEVICE_PID, DEVICE_QUEUE_TID, toMicros(timeSubmit), (timeStart - timeSubmit) * 1e-3 });
+    events.push_back(TraceEvent{ name, "device", DEVICE_PID, DEVICE_EXECUTION_TID, toMicros(timeStart), (timeEnd - timeStart) * 1e-3 });
+}
+
+static string jsonEscape(const string& s) {
+    string ret;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\')
+            ret += '\\';
+        if ((unsigned char)s[i] < 0x20)
+            ret += ' ';
+        else
+            ret += s[i];
+    }
+    return ret;
+}
+
+void OpenCLTrace::save(const string& filename) const {
+    ofstream out(filename);
+    if (out.fail())
+        throw IOError("Could not create file: " + filename);
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << "\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << HOST_PID << ",\"args\":{\"name\":\"host\"}}," << "\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << DEVICE_PID << ",\"args\":{\"name\":\"device\"}}," << "\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << DEVICE_PID << ",\"tid\":" << DEVICE_QUEUE_TID << ",\"args\":{\"name\":\"queue\"}}," << "\n";
+    out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << DEVICE_PID << ",\"tid\":" << DEVICE_EXECUTION_TID << ",\"args\":{\"name\":\"execution\"}}";
+    for (const TraceEvent& e : events) {
+        out << ",\n{\"name\":\"" << jsonEscape(e.name) << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\""
+            << ",\"pid\":" << e.pid << ",\"tid\":" << e.tid
+            << ",\"ts\":" << e.startMicros << ",\"dur\":" << e.durationMicros << "}";
+    }
+    out << "\n" << "]}" << "\n";
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "openclincludes.h"
+
+//Collects a timeline of host work and device commands and writes it in the Chrome trace event format,
+//viewable in chrome://tracing or Perfetto
+struct OpenCLTrace {
+    OpenCLTrace();
+
+    OpenCLTrace(const OpenCLTrace&) = delete;
+    OpenCLTrace& operator=(const OpenCLTrace&) = delete;
+
+    //A span of host work from construction until end() or destruction.
+    //Does nothing if trace is nullptr, so that callers need not check whether tracing is enabled.
+    struct Span {
+        Span(OpenCLTrace* trace, const std::string& name);
+        ~Span();
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        void end();
+
+    private:
+        OpenCLTrace* trace;
+        std::string name;
+        double startMicros;
+        bool ended;
+    };
+
+    //Records the queued, submitted and running phases of a completed command from its profiling info.
+    //The spans are named after the innermost open host span.
+    void addDeviceEvent(cl_event event);
+
+    void save(const std::string& filename) const;
+
+private:
+    struct TraceEvent {
+        std::string name;
+        std::string category;
+        int pid;
+        int tid;
+        double startMicros;
+        double durationMicros;
+    };
+
+    std::chrono::steady_clock::time_point startTime;
+    std::vector<TraceEvent> events;
+    std::vector<std::string> openSpanNames;
+    //Device profiling timestamps use their own clock, aligned to the host clock at the first device event
+    bool hasDeviceOffset;
+    double deviceToHostOffsetMicros;
+
+    double nowMicros() const;
+};
@@ -0,0 +1,931 @@
+#include <fstream>
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+#include <tuple>
+#include <cmath>
+#include <climits>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "opencltunedb.h"
+
+using namespace std;
+
+static const char* TUNEDB_VERSION_LINE = "TUNEDB_VERSION=1";
+static const char* TUNEDB_ENTRY_LINE = "@entry";
+static const char* TUNEDB_PARAMS_LINE = "@params";
+static const char* TUNEDB_DEVICE_LINE = "@device";
+
+OpenCLTuneKey OpenCLTuneKey::forDevice(
+    const DeviceInfo& info,
+    int trunkNumChannels,
+    int nnXLen,
+    int nnYLen,
+    int batchSize,
+    enabled_t fp16Mode
+) {
+    OpenCLTuneKey key;
+    key.deviceName = Global::trim(info.name);
+    key.vendor = Global::trim(info.vendor);
+    key.openCLVersion = Global::trim(info.openCLVersion);
+    key.driverVersion = Global::trim(info.driverVersion);
+    key.trunkNumChannels = trunkNumChannels;
+    key.nnXLen = nnXLen;
+    key.nnYLen = nnYLen;
+    key.batchSize = batchSize;
+    key.fp16Mode = fp16Mode;
+    return key;
+}
+
+string OpenCLTuneKey::desc() const {
+    enabled_t mode = fp16Mode;
+    string s;
+    s += deviceName + " (" + vendor + ")";
+    s += " " + openCLVersion;
+    s += " driver " + driverVersion;
+    s += " channels " + to_string(trunkNumChannels);
+    s += " board " + to_string(nnXLen) + "x" + to_string(nnYLen);
+    s += " batch " + to_string(batchSize);
+    s += " fp16 " + mode.toString();
+    return s;
+}
+
+bool OpenCLTuneKey::sameDevice(const OpenCLTuneKey& other) const {
+    return deviceName == other.deviceName && vendor == other.vendor;
+}
+
+bool OpenCLTuneKey::operator<(const OpenCLTuneKey& other) const {
+    //Device name and vendor come first so that all entries for a device are contiguous
+    return
+        std::tie(deviceName, vendor, openCLVersion, driverVersion, fp16Mode.x, nnXLen, nnYLen, trunkNumChannels, batchSize) <
+        std::tie(other.deviceName, other.vendor, other.openCLVersion, other.driverVersion, other.fp16Mode.x, other.nnXLen, other.nnYLen, other.trunkNumChannels, other.batchSize);
+}
+
+bool OpenCLTuneKey::operator==(const OpenCLTuneKey& other) const {
+    return !(*this < other) && !(other < *this);
+}
+
+static double logRatio(int a, int b) {
+    if (a <= 0 || b <= 0)
+        return a == b ? 0.0 : 8.0;
+    return std::abs(std::log2((double)a / (double)b));
+}
+
+//Smaller is more similar. Only meaningful for keys with the same device.
+static double keyDistance(
+    const OpenCLTuneKey& a,
+    bool sameDriverVersion, bool sameOpenCLVersion,
+    enabled_t fp16Mode, int nnXLen, int nnYLen, int trunkNumChannels, int batchSize
+) {
+    double d = 0.0;
+    if (!sameDriverVersion) d += 0.5;
+    if (!sameOpenCLVersion) d += 0.5;
+    if (a.fp16Mode != fp16Mode) d += 4.0;
+    d += 2.0 * logRatio(a.nnXLen * a.nnYLen, nnXLen * nnYLen);
+    d += 2.0 * logRatio(a.trunkNumChannels, trunkNumChannels);
+    d += 1.0 * logRatio(a.batchSize, batchSize);
+    return d;
+}
+static double keyDistance(const OpenCLTuneKey& a, const OpenCLTuneKey& b) {
+    return keyDistance(
+        a, a.driverVersion == b.driverVersion, a.openCLVersion == b.openCLVersion,
+        b.fp16Mode, b.nnXLen, b.nnYLen, b.trunkNumChannels, b.batchSize
+    );
+}
+
+OpenCLDeviceFeatures OpenCLDeviceFeatures::forDevice(const DeviceInfo& info) {
+    OpenCLDeviceFeatures features;
+    features.deviceName = Global::trim(info.name);
+    features.vendor = Global::trim(info.vendor);
+    features.deviceType = (int)info.deviceType;
+    features.maxComputeUnits = info.maxComputeUnits;
+    features.maxClockFrequency = info.maxClockFrequency;
+    features.maxWorkGroupSize = info.maxWorkGroupSize;
+    features.localMemSize = (int)std::min(info.localMemSize, (cl_ulong)INT_MAX);
+    features.preferredVectorWidthFloat = info.preferredVectorWidthFloat;
+    features.preferredVectorWidthHalf = info.preferredVectorWidthHalf;
+    features.supportsFP16Compute = info.supportsFP16Compute;
+    return features;
+}
+
+double OpenCLDeviceFeatures::distance(const OpenCLDeviceFeatures& other) const {
+    //Good configs depend first of all on the architecture, which vendor and device type are the best proxy for
+    double d = 0.0;
+    if (Global::toLower(vendor) != Global::toLower(other.vendor)) d += 4.0;
+    if (deviceType != other.deviceType) d += 4.0;
+    if (supportsFP16Compute != other.supportsFP16Compute) d += 0.5;
+    d += 1.0 * logRatio(localMemSize, other.localMemSize);
+    d += 1.0 * logRatio(maxComputeUnits, other.maxComputeUnits);
+    d += 0.5 * logRatio(preferredVectorWidthFloat, other.preferredVectorWidthFloat);
+    d += 0.5 * logRatio(preferredVectorWidthHalf, other.preferredVectorWidthHalf);
+    d += 0.5 * logRatio(maxWorkGroupSize, other.maxWorkGroupSize);
+    d += 0.25 * logRatio(maxClockFrequency, other.maxClockFrequency);
+    return d;
+}
+
+void OpenCLTuneDatabase::add(const OpenCLTuneKey& key, const OpenCLTuneParams& params) {
+    entries[key] = params;
+}
+
+void OpenCLTuneDatabase::addDevice(const OpenCLDeviceFeatures& features) {
+    devices[std::make_pair(features.deviceName, features.vendor)] = features;
+}
+
+const OpenCLTuneParams* OpenCLTuneDatabase::findExact(const OpenCLTuneKey& key) const {
+    auto iter = entries.find(key);
+    if (iter == entries.end())
+        return nullptr;
+    return &(iter->second);
+}
+
+const OpenCLTuneParams* OpenCLTuneDatabase::findNearest(const OpenCLTuneKey& key, OpenCLTuneKey* matchedKeyBuf) const {
+    //Smallest possible key for this device, everything for the device follows it in the map
+    OpenCLTuneKey deviceStart;
+    deviceStart.deviceName = key.deviceName;
+    deviceStart.vendor = key.vendor;
+    deviceStart.fp16Mode.x = enabled_t::False;
+    deviceStart.nnXLen = INT_MIN;
+    deviceStart.nnYLen = INT_MIN;
+    deviceStart.trunkNumChannels = INT_MIN;
+    deviceStart.batchSize = INT_MIN;
+
+    const OpenCLTuneKey* bestKey = nullptr;
+    const OpenCLTuneParams* bestParams = nullptr;
+    double bestDistance = 0.0;
+    for (auto iter = entries.lower_bound(deviceStart); iter != entries.end() && iter->first.sameDevice(key); ++iter) {
+        double distance = keyDistance(key, iter->first);
+        if (bestParams == nullptr || distance < bestDistance) {
+            bestKey = &(iter->first);
+            bestParams = &(iter->second);
+            bestDistance = distance;
+            if (distance <= 0.0)
+                break;
+        }
+    }
+    if (bestParams != nullptr && matchedKeyBuf != nullptr)
+        *matchedKeyBuf = *bestKey;
+    return bestParams;
+}
+
+vector<OpenCLTuneParams> OpenCLTuneDatabase::findSimilarDevices(
+    const OpenCLTuneKey& key,
+    const OpenCLDeviceFeatures& features,
+    int maxDevices,
+    vector<OpenCLTuneKey>* matchedKeysBuf
+) const {
+    vector<pair<double, const OpenCLDeviceFeatures*>> candidates;
+    for (auto iter = devices.begin(); iter != devices.end(); ++iter) {
+        const OpenCLDeviceFeatures& other = iter->second;
+        if (other.deviceName == key.deviceName && other.vendor == key.vendor)
+            continue;
+        candidates.push_back(make_pair(features.distance(other), &other));
+    }
+    std::stable_sort(
+        candidates.begin(), candidates.end(),
+        [](const pair<double, const OpenCLDeviceFeatures*>& a, const pair<double, const OpenCLDeviceFeatures*>& b) { return a.first < b.first; }
+    );
+
+    vector<OpenCLTuneParams> ret;
+    if (matchedKeysBuf != nullptr)
+        matchedKeysBuf->clear();
+    for (size_t i = 0; i < candidates.size() && (int)ret.size() < maxDevices; i++) {
+        //The entry for the other device whose model shape is closest to ours
+        OpenCLTuneKey otherKey = key;
+        otherKey.deviceName = candidates[i].second->deviceName;
+        otherKey.vendor = candidates[i].second->vendor;
+        OpenCLTuneKey matchedKey;
+        const OpenCLTuneParams* params = findNearest(otherKey, &matchedKey);
+        if (params == nullptr)
+            continue;
+        ret.push_back(*params);
+        if (matchedKeysBuf != nullptr)
+            matchedKeysBuf->push_back(matchedKey);
+    }
+    return ret;
+}
+
+void OpenCLTuneDatabase::save(const string& filename) const {
+    ofstream out(filename);
+    if (out.fail())
+        throw IOError("Could not create file: " + filename);
+    save(out);
+    out.flush();
+    out.close();
+}
+
+void OpenCLTuneDatabase::save(ostream& out) const {
+    out << TUNEDB_VERSION_LINE << "\n";
+    for (auto iter = devices.begin(); iter != devices.end(); ++iter) {
+        const OpenCLDeviceFeatures& features = iter->second;
+        out << TUNEDB_DEVICE_LINE << "\n";
+        out << "deviceName=" << features.deviceName << "\n";
+        out << "vendor=" << features.vendor << "\n";
+        out << "deviceType=" << features.deviceType << "\n";
+        out << "maxComputeUnits=" << features.maxComputeUnits << "\n";
+        out << "maxClockFrequency=" << features.maxClockFrequency << "\n";
+        out << "maxWorkGroupSize=" << features.maxWorkGroupSize << "\n";
+        out << "localMemSize=" << features.localMemSize << "\n";
+        out << "preferredVectorWidthFloat=" << features.preferredVectorWidthFloat << "\n";
+        out << "preferredVectorWidthHalf=" << features.preferredVectorWidthHalf << "\n";
+        out << "supportsFP16Compute=" << features.supportsFP16Compute << "\n";
+        if (features.peaks.isMeasured()) {
+            out << "peaksDriverVersion=" << features.peaksDriverVersion << "\n";
+            out << "peakGFlopsFP32=" << features.peaks.gflopsFP32 << "\n";
+            out << "peakGFlopsFP16=" << features.peaks.gflopsFP16 << "\n";
+            out << "globalMemGBytesPerSecond=" << features.peaks.globalMemGBytesPerSecond << "\n";
+            out << "localMemGBytesPerSecond=" << features.peaks.localMemGBytesPerSecond << "\n";
+            out << "launchLatencyMicroseconds=" << features.peaks.launchLatencyMicroseconds << "\n";
+        }
+    }
+    for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+        const OpenCLTuneKey& key = iter->first;
+        enabled_t mode = key.fp16Mode;
+        out << TUNEDB_ENTRY_LINE << "\n";
+        out << "deviceName=" << key.deviceName << "\n";
+        out << "vendor=" << key.vendor << "\n";
+        out << "openCLVersion=" << key.openCLVersion << "\n";
+        out << "driverVersion=" << key.driverVersion << "\n";
+        out << "trunkNumChannels=" << key.trunkNumChannels << "\n";
+        out << "nnXLen=" << key.nnXLen << "\n";
+        out << "nnYLen=" << key.nnYLen << "\n";
+        out << "batchSize=" << key.batchSize << "\n";
+        out << "fp16Mode=" << mode.toString() << "\n";
+        out << TUNEDB_PARAMS_LINE << "\n";
+        OpenCLTuneParams::save(out, iter->second);
+    }
+}
+
+static void splitKeyLine(const string& fileName, const string& line, string& name, string& value) {
+    size_t equalsPos = line.find_first_of('=');
+    if (equalsPos == string::npos)
+        throw IOError("OpenCLTuneDatabase::load: expected key=value but got " + line + " in file " + fileName);
+    name = Global::trim(line.substr(0, equalsPos));
+    value = Global::trim(line.substr(equalsPos + 1));
+}
+
+static bool tryStringToDouble(const string& str, double& x) {
+    istringstream in(str);
+    in >> x;
+    return !in.fail() && in.eof();
+}
+
+static void readDeviceLine(const string& fileName, const string& line, OpenCLDeviceFeatures& features) {
+    string name;
+    string value;
+    splitKeyLine(fileName, line, name, value);
+
+    bool suc = true;
+    int supportsFP16Compute = 0;
+    if (name == "deviceName") features.deviceName = value;
+    else if (name == "vendor") features.vendor = value;
+    else if (name == "deviceType") suc = Global::tryStringToInt(value, features.deviceType);
+    else if (name == "maxComputeUnits") suc = Global::tryStringToInt(value, features.maxComputeUnits);
+    else if (name == "maxClockFrequency") suc = Global::tryStringToInt(value, features.maxClockFrequency);
+    else if (name == "maxWorkGroupSize") suc = Global::tryStringToInt(value, features.maxWorkGroupSize);
+    else if (name == "localMemSize") suc = Global::tryStringToInt(value, features.localMemSize);
+    else if (name == "preferredVectorWidthFloat") suc = Global::tryStringToInt(value, features.preferredVectorWidthFloat);
+    else if (name == "preferredVectorWidthHalf") suc = Global::tryStringToInt(value, features.preferredVectorWidthHalf);
+    else if (name == "supportsFP16Compute") {
+        suc = Global::tryStringToInt(value, supportsFP16Compute);
+        features.supportsFP16Compute = supportsFP16Compute != 0;
+    }
+    else if (name == "peaksDriverVersion") features.peaksDriverVersion = value;
+    else if (name == "peakGFlopsFP32") suc = tryStringToDouble(value, features.peaks.gflopsFP32);
+    else if (name == "peakGFlopsFP16") suc = tryStringToDouble(value, features.peaks.gflopsFP16);
+    else if (name == "globalMemGBytesPerSecond") suc = tryStringToDouble(value, features.peaks.globalMemGBytesPerSecond);
+    else if (name == "localMemGBytesPerSecond") suc = tryStringToDouble(value, features.peaks.localMemGBytesPerSecond);
+    else if (name == "launchLatencyMicroseconds") suc = tryStringToDouble(value, features.peaks.launchLatencyMicroseconds);
+    else
+        throw IOError("OpenCLTuneDatabase::load: unknown device field " + name + " in file " + fileName);
+    if (!suc)
+        throw IOError("OpenCLTuneDatabase::load: could not parse value for device field " + name + " in file " + fileName);
+}
+
+static void readKeyLine(const string& fileName, const string& line, OpenCLTuneKey& key) {
+    string name;
+    string value;
+    splitKeyLine(fileName, line, name, value);
+
+    bool suc = true;
+    if (name == "deviceName") key.deviceName = value;
+    else if (name == "vendor") key.vendor = value;
+    else if (name == "openCLVersion") key.openCLVersion = value;
+    else if (name == "driverVersion") key.driverVersion = value;
+    else if (name == "trunkNumChannels") suc = Global::tryStringToInt(value, key.trunkNumChannels);
+    else if (name == "nnXLen") suc = Global::tryStringToInt(value, key.nnXLen);
+    else if (name == "nnYLen") suc = Global::tryStringToInt(value, key.nnYLen);
+    else if (name == "batchSize") suc = Global::tryStringToInt(value, key.batchSize);
+    else if (name == "fp16Mode") suc = enabled_t::tryParse(value, key.fp16Mode);
+    else
+        throw IOError("OpenCLTuneDatabase::load: unknown key field " + name + " in file " + fileName);
+    if (!suc)
+        throw IOError("OpenCLTuneDatabase::load: could not parse value for key field " + name + " in file " + fileName);
+}
+
+OpenCLTuneDatabase OpenCLTuneDatabase::load(const string& filename) {
+    ifstream in(filename);
+    if (in.fail())
+        throw IOError("Could not open file: " + filename);
+
+    string line;
+    if (!getline(in, line) || Global::trim(line) != TUNEDB_VERSION_LINE)
+        throw IOError("OpenCLTuneDatabase::load: expected first line to be " + string(TUNEDB_VERSION_LINE) + " in file " + filename);
+
+    OpenCLTuneDatabase db;
+    enum { OUTSIDE, IN_DEVICE, IN_KEY, IN_PARAMS } section = OUTSIDE;
+    OpenCLDeviceFeatures features;
+    OpenCLTuneKey key;
+    vector<string> paramLines;
+    auto finishEntry = [&]() {
+        if (section == IN_DEVICE)
+            db.addDevice(features);
+        if (section == IN_KEY)
+            throw IOError("OpenCLTuneDatabase::load: entry without params for " + key.desc() + " in file " + filename);
+        if (section == IN_PARAMS)
+            db.add(key, OpenCLTuneParams::loadFromLines(filename, paramLines));
+    };
+
+    while (getline(in, line)) {
+        string trimmed = Global::trim(line);
+        if (trimmed == TUNEDB_DEVICE_LINE) {
+            finishEntry();
+            features = OpenCLDeviceFeatures();
+            section = IN_DEVICE;
+        }
+        else if (trimmed == TUNEDB_ENTRY_LINE) {
+            finishEntry();
+            key = OpenCLTuneKey();
+            paramLines.clear();
+            section = IN_KEY;
+        }
+        else if (trimmed == TUNEDB_PARAMS_LINE) {
+            if (section != IN_KEY)
+                throw IOError("OpenCLTuneDatabase::load: " + string(TUNEDB_PARAMS_LINE) + " without a preceding key in file " + filename);
+            section = IN_PARAMS;
+        }
+        else if (section == IN_PARAMS) {
+            paramLines.push_back(line);
+        }
+        else if (trimmed.length() > 0) {
+            if (section == IN_DEVICE)
+                readDeviceLine(filename, trimmed, features);
+            else if (section == IN_KEY)
+                readKeyLine(filename, trimmed, key);
+            else
+                throw IOError("OpenCLTuneDatabase::load: unexpected line outside of an entry: " + trimmed + " in file " + filename);
+        }
+    }
+    finishEntry();
+    return db;
+}
+
+//----------------------------------------------------------------------------------------
+
+static const char TUNEDB_BINARY_MAGIC[8] = { 'O','C','L','T','U','N','D','B' };
+static const uint32_t TUNEDB_BINARY_VERSION = 5;
+
+//Number of int32s an OpenCLTuneParams is packed into, see packParams
+static constexpr int NUM_PACKED_PARAMS = 3 + 10 + 15 + 15 + 11 + 9;
+
+struct BinaryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tunerVersion;
+    uint32_t numEntries;
+    uint32_t entrySize;
+    uint32_t numDevices;
+    uint32_t devicesOffset;
+    uint32_t stringTableOffset;
+    uint32_t stringTableSize;
+};
+static_assert(sizeof(BinaryHeader) == 40, "BinaryHeader must have no padding");
+
+struct BinaryString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct BinaryEntry {
+    BinaryString deviceName;
+    BinaryString vendor;
+    BinaryString openCLVersion;
+    BinaryString driverVersion;
+    int32_t fp16Mode;
+    int32_t nnXLen;
+    int32_t nnYLen;
+    int32_t trunkNumChannels;
+    int32_t batchSize;
+    int32_t params[NUM_PACKED_PARAMS];
+};
+static_assert(NUM_PACKED_PARAMS == 63, "Bump TUNEDB_BINARY_VERSION when changing the packed params");
+static_assert(sizeof(BinaryEntry) == 4 * (8 + 5 + NUM_PACKED_PARAMS), "BinaryEntry must have no padding");
+
+struct BinaryDevice {
+    BinaryString deviceName;
+    BinaryString vendor;
+    int32_t deviceType;
+    int32_t maxComputeUnits;
+    int32_t maxClockFrequency;
+    int32_t maxWorkGroupSize;
+    int32_t localMemSize;
+    int32_t preferredVectorWidthFloat;
+    int32_t preferredVectorWidthHalf;
+    int32_t supportsFP16Compute;
+    BinaryString peaksDriverVersion;
+    double peakGFlopsFP32;
+    double peakGFlopsFP16;
+    double globalMemGBytesPerSecond;
+    double localMemGBytesPerSecond;
+    double launchLatencyMicroseconds;
+};
+static_assert(sizeof(BinaryDevice) == 4 * (6 + 8) + 8 * 5, "BinaryDevice must have no padding");
+static_assert(sizeof(BinaryHeader) % 8 == 0 && sizeof(BinaryEntry) % 8 == 0, "BinaryDevice records must be 8-byte aligned");
+
+static void packParams(const OpenCLTuneParams& p, int32_t* buf) {
+    int i = 0;
+    buf[i++] = p.shouldUseFP16Storage;
+    buf[i++] = p.shouldUseFP16Compute;
+    buf[i++] = p.shouldUseFP16TensorCores;
+
+    buf[i++] = p.xGemmDirect.WGD;
+    buf[i++] = p.xGemmDirect.MDIMCD;
+    buf[i++] = p.xGemmDirect.NDIMCD;
+    buf[i++] = p.xGemmDirect.MDIMAD;
+    buf[i++] = p.xGemmDirect.NDIMBD;
+    buf[i++] = p.xGemmDirect.KWID;
+    buf[i++] = p.xGemmDirect.VWMD;
+    buf[i++] = p.xGemmDirect.VWND;
+    buf[i++] = p.xGemmDirect.PADA;
+    buf[i++] = p.xGemmDirect.PADB;
+
+    for (const OpenCLParams::XGemmParams* x : { &p.xGemm, &p.xGemm16 }) {
+        buf[i++] = x->MWG;
+        buf[i++] = x->NWG;
+        buf[i++] = x->KWG;
+        buf[i++] = x->MDIMC;
+        buf[i++] = x->NDIMC;
+        buf[i++] = x->MDIMA;
+        buf[i++] = x->NDIMB;
+        buf[i++] = x->KWI;
+        buf[i++] = x->VWM;
+        buf[i++] = x->VWN;
+        buf[i++] = x->STRM;
+        buf[i++] = x->STRN;
+        buf[i++] = x->SA;
+        buf[i++] = x->SB;
+        buf[i++] = x->FIXED_SHAPE;
+    }
+
+    buf[i++] = p.hGemmWmma.MWG;
+    buf[i++] = p.hGemmWmma.NWG;
+    buf[i++] = p.hGemmWmma.KWG;
+    buf[i++] = p.hGemmWmma.MWAVE;
+    buf[i++] = p.hGemmWmma.NWAVE;
+    buf[i++] = p.hGemmWmma.MWARP;
+    buf[i++] = p.hGemmWmma.NWARP;
+    buf[i++] = p.hGemmWmma.VWM;
+    buf[i++] = p.hGemmWmma.VWN;
+    buf[i++] = p.hGemmWmma.SA;
+    buf[i++] = p.hGemmWmma.SB;
+
+    buf[i++] = p.conv3x3.INTILE_XSIZE;
+    buf[i++] = p.conv3x3.INTILE_YSIZE;
+    buf[i++] = p.conv3x3.OUTTILE_XSIZE;
+    buf[i++] = p.conv3x3.OUTTILE_YSIZE;
+    buf[i++] = p.conv3x3.transLocalSize0;
+    buf[i++] = p.conv3x3.transLocalSize1;
+    buf[i++] = p.conv3x3.untransLocalSize0;
+    buf[i++] = p.conv3x3.untransLocalSize1;
+    buf[i++] = p.conv3x3.untransLocalSize2;
+    assert(i == NUM_PACKED_PARAMS);
+}
+
+static void unpackParams(const int32_t* buf, OpenCLTuneParams& p) {
+    int i = 0;
+    p.shouldUseFP16Storage = buf[i++] != 0;
+    p.shouldUseFP16Compute = buf[i++] != 0;
+    p.shouldUseFP16TensorCores = buf[i++] != 0;
+
+    p.xGemmDirect.WGD = buf[i++];
+    p.xGemmDirect.MDIMCD = buf[i++];
+    p.xGemmDirect.NDIMCD = buf[i++];
+    p.xGemmDirect.MDIMAD = buf[i++];
+    p.xGemmDirect.NDIMBD = buf[i++];
+    p.xGemmDirect.KWID = buf[i++];
+    p.xGemmDirect.VWMD = buf[i++];
+    p.xGemmDirect.VWND = buf[i++];
+    p.xGemmDirect.PADA = buf[i++];
+    p.xGemmDirect.PADB = buf[i++];
+
+    for (OpenCLParams::XGemmParams* x : { &p.xGemm, &p.xGemm16 }) {
+        x->MWG = buf[i++];
+        x->NWG = buf[i++];
+        x->KWG = buf[i++];
+        x->MDIMC = buf[i++];
+        x->NDIMC = buf[i++];
+        x->MDIMA = buf[i++];
+        x->NDIMB = buf[i++];
+        x->KWI = buf[i++];
+        x->VWM = buf[i++];
+        x->VWN = buf[i++];
+        x->STRM = buf[i++];
+        x->STRN = buf[i++];
+        x->SA = buf[i++];
+        x->SB = buf[i++];
+        x->FIXED_SHAPE = buf[i++];
+    }
+
+    p.hGemmWmma.MWG = buf[i++];
+    p.hGemmWmma.NWG = buf[i++];
+    p.hGemmWmma.KWG = buf[i++];
+    p.hGemmWmma.MWAVE = buf[i++];
+    p.hGemmWmma.NWAVE = buf[i++];
+    p.hGemmWmma.MWARP = buf[i++];
+    p.hGemmWmma.NWARP = buf[i++];
+    p.hGemmWmma.VWM = buf[i++];
+    p.hGemmWmma.VWN = buf[i++];
+    p.hGemmWmma.SA = buf[i++];
+    p.hGemmWmma.SB = buf[i++];
+
+    p.conv3x3.INTILE_XSIZE = buf[i++];
+    p.conv3x3.INTILE_YSIZE = buf[i++];
+    p.conv3x3.OUTTILE_XSIZE = buf[i++];
+    p.conv3x3.OUTTILE_YSIZE = buf[i++];
+    p.conv3x3.transLocalSize0 = buf[i++];
+    p.conv3x3.transLocalSize1 = buf[i++];
+    p.conv3x3.untransLocalSize0 = buf[i++];
+    p.conv3x3.untransLocalSize1 = buf[i++];
+    p.conv3x3.untransLocalSize2 = buf[i++];
+    assert(i == NUM_PACKED_PARAMS);
+}
+
+//Moves from over to, replacing any existing file there
+static void replaceFile(const string& from, const string& to) {
+#ifdef _WIN32
+    bool suc = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool suc = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+    if (!suc) {
+        std::remove(from.c_str());
+        throw IOError("Could not replace file: " + to);
+    }
+}
+
+void OpenCLTuneDatabaseMapped::write(const string& filename, const OpenCLTuneDatabase& db) {
+    string stringTable;
+    auto addString = [&](const string& str) {
+        BinaryString bs;
+        bs.offset = (uint32_t)stringTable.size();
+        bs.length = (uint32_t)str.size();
+        stringTable += str;
+        return bs;
+    };
+
+    vector<BinaryEntry> entries;
+    entries.reserve(db.entries.size());
+    for (auto iter = db.entries.begin(); iter != db.entries.end(); ++iter) {
+        const OpenCLTuneKey& key = iter->first;
+        BinaryEntry entry;
+        entry.deviceName = addString(key.deviceName);
+        entry.vendor = addString(key.vendor);
+        entry.openCLVersion = addString(key.openCLVersion);
+        entry.driverVersion = addString(key.driverVersion);
+        entry.fp16Mode = (int32_t)key.fp16Mode.x;
+        entry.nnXLen = key.nnXLen;
+        entry.nnYLen = key.nnYLen;
+        entry.trunkNumChannels = key.trunkNumChannels;
+        entry.batchSize = key.batchSize;
+        packParams(iter->second, entry.params);
+        entries.push_back(entry);
+    }
+
+    vector<BinaryDevice> devices;
+    devices.reserve(db.devices.size());
+    for (auto iter = db.devices.begin(); iter != db.devices.end(); ++iter) {
+        const OpenCLDeviceFeatures& features = iter->second;
+        BinaryDevice device;
+        device.deviceName = addString(features.deviceName);
+        device.vendor = addString(features.vendor);
+        device.deviceType = features.deviceType;
+        device.maxComputeUnits = features.maxComputeUnits;
+        device.maxClockFrequency = features.maxClockFrequency;
+        device.maxWorkGroupSize = features.maxWorkGroupSize;
+        device.localMemSize = features.localMemSize;
+        device.preferredVectorWidthFloat = features.preferredVectorWidthFloat;
+        device.preferredVectorWidthHalf = features.preferredVectorWidthHalf;
+        device.supportsFP16Compute = features.supportsFP16Compute;
+        device.peaksDriverVersion = addString(features.peaksDriverVersion);
+        device.peakGFlopsFP32 = features.peaks.gflopsFP32;
+        device.peakGFlopsFP16 = features.peaks.gflopsFP16;
+        device.globalMemGBytesPerSecond = features.peaks.globalMemGBytesPerSecond;
+        device.localMemGBytesPerSecond = features.peaks.localMemGBytesPerSecond;
+        device.launchLatencyMicroseconds = features.peaks.launchLatencyMicroseconds;
+        devices.push_back(device);
+    }
+
+    BinaryHeader header;
+    std::memcpy(header.magic, TUNEDB_BINARY_MAGIC, sizeof(header.magic));
+    header.version = TUNEDB_BINARY_VERSION;
+    header.tunerVersion = TUNER_VERSION;
+    header.numEntries = (uint32_t)entries.size();
+    header.entrySize = sizeof(BinaryEntry);
+    header.numDevices = (uint32_t)devices.size();
+    header.devicesOffset = (uint32_t)(sizeof(BinaryHeader) + entries.size() * sizeof(BinaryEntry));
+    header.stringTableOffset = (uint32_t)(header.devicesOffset + devices.size() * sizeof(BinaryDevice));
+    header.stringTableSize = (uint32_t)stringTable.size();
+
+    //Write and check a temporary file first and then move it over the target, so that an earlier database there
+    //survives any failure and readers never map a partly written one
+    const string tmpFilename = filename + ".tmp";
+    ofstream out(tmpFilename, ios::binary);
+    if (out.fail())
+        throw IOError("Could not create file: " + tmpFilename);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)entries.data(), entries.size() * sizeof(BinaryEntry));
+    out.write((const char*)devices.data(), devices.size() * sizeof(BinaryDevice));
+    out.write(stringTable.data(), stringTable.size());
+    out.flush();
+    if (out.fail()) {
+        out.close();
+        std::remove(tmpFilename.c_str());
+        throw IOError("Error writing file: " + tmpFilename);
+    }
+    out.close();
+
+    //Check that reading the file back gives exactly the same database, so that no field can be silently left out of
+    //the packed params or the device records
+    ostringstream expected;
+    db.save(expected);
+    ostringstream actual;
+    try {
+        OpenCLTuneDatabaseMapped(tmpFilename).toDatabase().save(actual);
+        if (actual.str() != expected.str())
+            throw StringError("OpenCLTuneDatabaseMapped::write: " + tmpFilename + " does not read back as the database that was written");
+    }
+    catch (...) {
+        std::remove(tmpFilename.c_str());
+        throw;
+    }
+
+    replaceFile(tmpFilename, filename);
+}
+
+static void unmapData(const char* data, size_t dataSize) {
+#ifdef _WIN32
+    (void)dataSize;
+    UnmapViewOfFile(data);
+#else
+    munmap((void*)data, dataSize);
+#endif
+}
+
+OpenCLTuneDatabaseMapped::OpenCLTuneDatabaseMapped(const string& filename)
+    : data(nullptr),
+      dataSize(0)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw IOError("Could not open file: " + filename);
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        throw IOError("Could not get size of file: " + filename);
+    }
+    dataSize = (size_t)fileSize.QuadPart;
+    if (dataSize > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            //The view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw IOError("Could not open file: " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw IOError("Could not get size of file: " + filename);
+    }
+    dataSize = (size_t)st.st_size;
+    if (dataSize > 0) {
+        void* ptr = mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED)
+            data = (const char*)ptr;
+    }
+    close(fd);
+#endif
+    if (data == nullptr)
+        throw IOError("Could not memory-map file: " + filename);
+
+    //Validate everything once up front so that lookups can trust the contents
+    auto fail = [&](const string& msg) {
+        unmapData(data, dataSize);
+        data = nullptr;
+        throw IOError("OpenCLTuneDatabaseMapped: " + msg + " in file " + filename);
+    };
+    if (dataSize < sizeof(BinaryHeader))
+        fail("file too small");
+    const BinaryHeader* header = (const BinaryHeader*)data;
+    if (std::memcmp(header->magic, TUNEDB_BINARY_MAGIC, sizeof(header->magic)) != 0)
+        fail("not a binary tuning database");
+    if (header->version != TUNEDB_BINARY_VERSION)
+        fail("unsupported binary version " + to_string(header->version));
+    if (header->tunerVersion != (uint32_t)TUNER_VERSION)
+        fail("params are from tuner version " + to_string(header->tunerVersion) + " but this tuner uses version " + to_string(TUNER_VERSION));
+    if (header->entrySize != sizeof(BinaryEntry))
+        fail("unexpected entry size");
+    if (header->devicesOffset != sizeof(BinaryHeader) + (uint64_t)header->numEntries * sizeof(BinaryEntry) ||
+        header->stringTableOffset != header->devicesOffset + (uint64_t)header->numDevices * sizeof(BinaryDevice) ||
+        (uint64_t)header->stringTableOffset + header->stringTableSize > dataSize)
+        fail("inconsistent sizes");
+    auto checkString = [&](const BinaryString& bs) {
+        if ((uint64_t)bs.offset + bs.length > header->stringTableSize)
+            fail("string out of bounds");
+    };
+    const BinaryEntry* entries = (const BinaryEntry*)(data + sizeof(BinaryHeader));
+    for (uint32_t i = 0; i < header->numEntries; i++) {
+        checkString(entries[i].deviceName);
+        checkString(entries[i].vendor);
+        checkString(entries[i].openCLVersion);
+        checkString(entries[i].driverVersion);
+    }
+    const BinaryDevice* devices = (const BinaryDevice*)(data + header->devicesOffset);
+    for (uint32_t i = 0; i < header->numDevices; i++) {
+        checkString(devices[i].deviceName);
+        checkString(devices[i].vendor);
+        checkString(devices[i].peaksDriverVersion);
+    }
+}
+
+OpenCLTuneDatabaseMapped::~OpenCLTuneDatabaseMapped() {
+    if (data != nullptr)
+        unmapData(data, dataSize);
+}
+
+static const BinaryHeader* binaryHeader(const char* data) {
+    return (const BinaryHeader*)data;
+}
+static const BinaryEntry* binaryEntries(const char* data) {
+    return (const BinaryEntry*)(data + sizeof(BinaryHeader));
+}
+
+//Same ordering as std::string::compare
+static int compareString(const char* data, const BinaryString& bs, const string& str) {
+    const char* chars = data + binaryHeader(data)->stringTableOffset + bs.offset;
+    size_t len = std::min((size_t)bs.length, str.size());
+    int c = std::memcmp(chars, str.data(), len);
+    if (c != 0)
+        return c;
+    if (bs.length < str.size()) return -1;
+    if (bs.length > str.size()) return 1;
+    return 0;
+}
+static string readString(const char* data, const BinaryString& bs) {
+    return string(data + binaryHeader(data)->stringTableOffset + bs.offset, bs.length);
+}
+
+static int compareInt(int32_t a, int32_t b) {
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static int compareDevice(const char* data, const BinaryEntry& entry, const OpenCLTuneKey& key) {
+    int c;
+    if ((c = compareString(data, entry.deviceName, key.deviceName)) != 0) return c;
+    return compareString(data, entry.vendor, key.vendor);
+}
+
+//Must match OpenCLTuneKey::operator<
+static int compareKey(const char* data, const BinaryEntry& entry, const OpenCLTuneKey& key) {
+    int c;
+    if ((c = compareDevice(data, entry, key)) != 0) return c;
+    if ((c = compareString(data, entry.openCLVersion, key.openCLVersion)) != 0) return c;
+    if ((c = compareString(data, entry.driverVersion, key.driverVersion)) != 0) return c;
+    if ((c = compareInt(entry.fp16Mode, (int32_t)key.fp16Mode.x)) != 0) return c;
+    if ((c = compareInt(entry.nnXLen, key.nnXLen)) != 0) return c;
+    if ((c = compareInt(entry.nnYLen, key.nnYLen)) != 0) return c;
+    if ((c = compareInt(entry.trunkNumChannels, key.trunkNumChannels)) != 0) return c;
+    return compareInt(entry.batchSize, key.batchSize);
+}
+
+static OpenCLTuneKey readKey(const char* data, const BinaryEntry& entry) {
+    OpenCLTuneKey key;
+    key.deviceName = readString(data, entry.deviceName);
+    key.vendor = readString(data, entry.vendor);
+    key.openCLVersion = readString(data, entry.openCLVersion);
+    key.driverVersion = readString(data, entry.driverVersion);
+    key.fp16Mode.x = (enabled_t::value)entry.fp16Mode;
+    key.nnXLen = entry.nnXLen;
+    key.nnYLen = entry.nnYLen;
+    key.trunkNumChannels = entry.trunkNumChannels;
+    key.batchSize = entry.batchSize;
+    return key;
+}
+
+size_t OpenCLTuneDatabaseMapped::size() const {
+    return binaryHeader(data)->numEntries;
+}
+
+bool OpenCLTuneDatabaseMapped::findExact(const OpenCLTuneKey& key, OpenCLTuneParams& buf) const {
+    const BinaryEntry* entries = binaryEntries(data);
+    size_t lo = 0;
+    size_t hi = size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = compareKey(data, entries[mid], key);
+        if (c == 0) {
+            unpackParams(entries[mid].params, buf);
+            return true;
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+bool OpenCLTuneDatabaseMapped::findNearest(const OpenCLTuneKey& key, OpenCLTuneParams& buf, OpenCLTuneKey* matchedKeyBuf) const {
+    const BinaryEntry* entries = binaryEntries(data);
+    //Find the first entry for this device
+    size_t lo = 0;
+    size_t hi = size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compareDevice(data, entries[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    const BinaryEntry* best = nullptr;
+    double bestDistance = 0.0;
+    for (size_t i = lo; i < size() && compareDevice(data, entries[i], key) == 0; i++) {
+        const BinaryEntry& entry = entries[i];
+        double distance = keyDistance(
+            key,
+            compareString(data, entry.driverVersion, key.driverVersion) == 0,
+            compareString(data, entry.openCLVersion, key.openCLVersion) == 0,
+            enabled_t((enabled_t::value)entry.fp16Mode), entry.nnXLen, entry.nnYLen, entry.trunkNumChannels, entry.batchSize
+        );
+        if (best == nullptr || distance < bestDistance) {
+            best = &entry;
+            bestDistance = distance;
+            if (distance <= 0.0)
+                break;
+        }
+    }
+    if (best == nullptr)
+        return false;
+    unpackParams(best->params, buf);
+    if (matchedKeyBuf != nullptr)
+        *matchedKeyBuf = readKey(data, *best);
+    return true;
+}
+
+OpenCLTuneDatabase OpenCLTuneDatabaseMapped::toDatabase() const {
+    OpenCLTuneDatabase db;
+    const BinaryEntry* entries = binaryEntries(data);
+    for (size_t i = 0; i < size(); i++) {
+        OpenCLTuneParams params;
+        unpackParams(entries[i].params, params);
+        db.add(readKey(data, entries[i]), params);
+    }
+    const BinaryDevice* devices = (const BinaryDevice*)(data + binaryHeader(data)->devicesOffset);
+    for (size_t i = 0; i < binaryHeader(data)->numDevices; i++) {
+        const BinaryDevice& device = devices[i];
+        OpenCLDeviceFeatures features;
+        features.deviceName = readString(data, device.deviceName);
+        features.vendor = readString(data, device.vendor);
+        features.deviceType = device.deviceType;
+        features.maxComputeUnits = device.maxComputeUnits;
+        features.maxClockFrequency = device.maxClockFrequency;
+        features.maxWorkGroupSize = device.maxWorkGroupSize;
+        features.localMemSize = device.localMemSize;
+        features.preferredVectorWidthFloat = device.preferredVectorWidthFloat;
+        features.preferredVectorWidthHalf = device.preferredVectorWidthHalf;
+        features.supportsFP16Compute = device.supportsFP16Compute != 0;
+        features.peaksDriverVersion = readString(data, device.peaksDriverVersion);
+        features.peaks.gflopsFP32 = device.peakGFlopsFP32;
+        features.peaks.gflopsFP16 = device.peakGFlopsFP16;
+        features.peaks.globalMemGBytesPerSecond = device.globalMemGBytesPerSecond;
+        features.peaks.localMemGBytesPerSecond = device.localMemGBytesPerSecond;
+        features.peaks.launchLatencyMicroseconds = device.launchLatencyMicroseconds;
+        db.addDevice(features);
+    }
+    return db;
+}
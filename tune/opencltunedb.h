@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "core/commontypes.h"
+#include "openclhelpers.h"
+#include "openclmicrobench.h"
+#include "opencltuner.h"
+
+//Identifies the situation a set of tuned params was tuned for
+struct OpenCLTuneKey {
+    std::string deviceName;
+    std::string vendor;
+    std::string openCLVersion;
+    std::string driverVersion;
+    int trunkNumChannels = 0;
+    int nnXLen = 0;
+    int nnYLen = 0;
+    int batchSize = 0;
+    //The testFP16Mode the tuner was run with
+    enabled_t fp16Mode = enabled_t::Auto;
+
+    static OpenCLTuneKey forDevice(
+        const DeviceInfo& info,
+        int trunkNumChannels,
+        int nnXLen,
+        int nnYLen,
+        int batchSize,
+        enabled_t fp16Mode
+    );
+
+    std::string desc() const;
+    bool sameDevice(const OpenCLTuneKey& other) const;
+    bool operator<(const OpenCLTuneKey& other) const;
+    bool operator==(const OpenCLTuneKey& other) const;
+};
+
+//Hardware characteristics of a device with entries in the database, used to find similar devices
+struct OpenCLDeviceFeatures {
+    std::string deviceName;
+    std::string vendor;
+    int deviceType = 0;
+    int maxComputeUnits = 0;
+    int maxClockFrequency = 0;
+    int maxWorkGroupSize = 0;
+    int localMemSize = 0;
+    int preferredVectorWidthFloat = 0;
+    int preferredVectorWidthHalf = 0;
+    bool supportsFP16Compute = false;
+    //Not part of the distance, kept here so that they are stored next to the tuning results
+    OpenCLDevicePeaks peaks;
+    //Driver version the peaks were measured with, since a new driver can change them
+    std::string peaksDriverVersion;
+
+    static OpenCLDeviceFeatures forDevice(const DeviceInfo& info);
+    //Smaller is more similar, 0 for identical features
+    double distance(const OpenCLDeviceFeatures& other) const;
+};
+
+//Tuning results for many devices, drivers and model shapes in a single file.
+//Each entry is stored as its key followed by exactly what OpenCLTuneParams::save writes.
+struct OpenCLTuneDatabase {
+    std::map<OpenCLTuneKey, OpenCLTuneParams> entries;
+    //Keyed by device name and vendor
+    std::map<std::pair<std::string, std::string>, OpenCLDeviceFeatures> devices;
+
+    //Adds or replaces the entry for key
+    void add(const OpenCLTuneKey& key, const OpenCLTuneParams& params);
+    //Adds or replaces the features for a device
+    void addDevice(const OpenCLDeviceFeatures& features);
+
+    //Returns nullptr if there is no entry for exactly this key
+    const OpenCLTuneParams* findExact(const OpenCLTuneKey& key) const;
+    //Returns the closest entry for the same device name and vendor, preferring the same driver, precision mode,
+    //board size, and then the closest channel count and batch size. Returns nullptr if this device has no entries.
+    const OpenCLTuneParams* findNearest(const OpenCLTuneKey& key, OpenCLTuneKey* matchedKeyBuf) const;
+    //For a device with no entries of its own, the nearest entries of up to maxDevices other devices with recorded
+    //features, most similar device first.
+    std::vector<OpenCLTuneParams> findSimilarDevices(
+        const OpenCLTuneKey& key,
+        const OpenCLDeviceFeatures& features,
+        int maxDevices,
+        std::vector<OpenCLTuneKey>* matchedKeysBuf
+    ) const;
+
+    void save(const std::string& filename) const;
+    void save(std::ostream& out) const;
+    static OpenCLTuneDatabase load(const std::string& filename);
+};
+
+//Compact binary form of OpenCLTuneDatabase, memory-mapped read-only and searched in place without parsing
+//or allocating, for processes that need to look up their params at startup. Entries are fixed-size records
+//sorted in the same order as OpenCLTuneDatabase::entries, with the key strings in a shared string table.
+//Written and read in native (little-endian) byte order.
+struct OpenCLTuneDatabaseMapped {
+    explicit OpenCLTuneDatabaseMapped(const std::string& filename);
+    ~OpenCLTuneDatabaseMapped();
+
+    OpenCLTuneDatabaseMapped() = delete;
+    OpenCLTuneDatabaseMapped(const OpenCLTuneDatabaseMapped&) = delete;
+    OpenCLTuneDatabaseMapped& operator=(const OpenCLTuneDatabaseMapped&) = delete;
+
+    size_t size() const;
+    //Same semantics as the OpenCLTuneDatabase functions of the same name, returns false if nothing was found
+    bool findExact(const OpenCLTuneKey& key, OpenCLTuneParams& buf) const;
+    bool findNearest(const OpenCLTuneKey& key, OpenCLTuneParams& buf, OpenCLTuneKey* matchedKeyBuf) const;
+
+    OpenCLTuneDatabase toDatabase() const;
+    //Throws if the written file does not read back as db
+    static void write(const std::string& filename, const OpenCLTuneDatabase& db);
+
+private:
+    const char* data;
+    size_t dataSize;
+};
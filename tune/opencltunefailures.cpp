@@ -0,0 +1,132 @@
+#include <fstream>
+
+#include "opencltunefailures.h"
+#include "openclhelpers.h"
+
+using namespace std;
+
+static const char* FAILURE_RECORD = "failed";
+static const char* CLEARED_RECORD = "cleared";
+
+//Fields are separated by tabs and records by newlines, so neither can appear in a field
+static string field(const string& s) {
+    string ret = s;
+    for (size_t i = 0; i < ret.size(); i++) {
+        if (ret[i] == '\t' || ret[i] == '\n' || ret[i] == '\r')
+            ret[i] = ' ';
+    }
+    return Global::trim(ret);
+}
+
+OpenCLTuneFailures::OpenCLTuneFailures(
+    const string& filename,
+    const string& dName,
+    const string& v,
+    const string& dVersion
+)
+    : out(),
+    deviceName(field(dName)),
+    vendor(field(v)),
+    driverVersion(field(dVersion)),
+    failures(),
+    currentFilename()
+{
+    ifstream in(filename);
+    if (in.good()) {
+        string line;
+        while (getline(in, line)) {
+            vector<string> pieces = Global::split(line, '\t');
+            //The last line can be cut short if the tuner was killed while writing it
+            if (pieces.size() < 6)
+                continue;
+            if (pieces[1] != deviceName || pieces[2] != vendor || pieces[3] != driverVersion)
+                continue;
+            std::pair<string, string> key = std::make_pair(pieces[4], pieces[5]);
+            if (pieces[0] == FAILURE_RECORD && pieces.size() >= 7) {
+                OpenCLTuneFailure failure;
+                if (!Global::tryStringToInt(pieces[6], failure.errorCode))
+                    continue;
+                if (pieces.size() >= 8)
+                    failure.errorMessage = pieces[7];
+                failures[key] = failure;
+            }
+            else if (pieces[0] == CLEARED_RECORD)
+                failures.erase(key);
+        }
+        in.close();
+    }
+
+    out.open(filename, ios::app);
+    if (out.fail())
+        throw IOError("Could not open file: " + filename);
+}
+
+OpenCLTuneFailures::~OpenCLTuneFailures() {
+    out.close();
+}
+
+const OpenCLTuneFailure* OpenCLTuneFailures::find(const string& stage, const string& desc) const {
+    auto iter = failures.find(std::make_pair(field(stage), field(desc)));
+    if (iter == failures.end())
+        return nullptr;
+    return &(iter->second);
+}
+
+void OpenCLTuneFailures::add(const string& stage, const string& desc, int errorCode, const string& errorMessage) {
+    OpenCLTuneFailure failure;
+    failure.errorCode = errorCode;
+    failure.errorMessage = field(errorMessage);
+    failures[std::make_pair(field(stage), field(desc))] = failure;
+    writeRecord(FAILURE_RECORD, stage, desc, &failure);
+}
+
+void OpenCLTuneFailures::remove(const string& stage, const string& desc) {
+    if (failures.erase(std::make_pair(field(stage), field(desc))) > 0)
+        writeRecord(CLEARED_RECORD, stage, desc, nullptr);
+}
+
+size_t OpenCLTuneFailures::size() const {
+    return failures.size();
+}
+
+void OpenCLTuneFailures::trackCurrentConfig(const string& filename) {
+    currentFilename = filename;
+    ifstream in(filename);
+    string line;
+    if (in.good() && getline(in, line)) {
+        vector<string> pieces = Global::split(line, '\t');
+        if (pieces.size() >= 5 && pieces[0] == deviceName && pieces[1] == vendor && pieces[2] == driverVersion)
+            add(pieces[3], pieces[4], CRASHED_OR_HUNG, "The tuner crashed or hung while testing this config");
+    }
+    in.close();
+    writeCurrent("");
+}
+
+void OpenCLTuneFailures::beginConfig(const string& stage, const string& desc) {
+    if (currentFilename.size() > 0)
+        writeCurrent(deviceName + "\t" + vendor + "\t" + driverVersion + "\t" + field(stage) + "\t" + field(desc));
+}
+
+void OpenCLTuneFailures::endConfig() {
+    if (currentFilename.size() > 0)
+        writeCurrent("");
+}
+
+//Rewritten whole each time, so that the supervisor never sees a mix of two configs
+void OpenCLTuneFailures::writeCurrent(const string& line) {
+    ofstream current(currentFilename, ios::trunc);
+    if (current.fail())
+        throw IOError("Could not create file: " + currentFilename);
+    if (line.size() > 0)
+        current << line << "\n";
+    current.close();
+}
+
+void OpenCLTuneFailures::writeRecord(const string& kind, const string& stage, const string& desc, const OpenCLTuneFailure* failure) {
+    out << kind << "\t" << deviceName << "\t" << vendor << "\t" << driverVersion << "\t" << field(stage) << "\t" << field(desc);
+    if (failure != nullptr)
+        out << "\t" << failure->errorCode << "\t" << failure->errorMessage;
+    out << "\n";
+    //Flush every record so that it survives the tuner crashing on a later config
+    out.flush();
+}
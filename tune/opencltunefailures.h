@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <fstream>
+
+//A config that failed to compile or run in a way that will not change until the driver does
+struct OpenCLTuneFailure {
+    int errorCode = 0;
+    std::string errorMessage;
+};
+
+//Configs known to fail on one device and driver, kept across tuning runs so that later runs can skip them.
+//The file is shared by all devices and drivers and only ever appended to, one tab-separated record per line, so
+//that failures recorded before the tuner crashes or is killed are kept. Entries for other devices and drivers
+//are left alone, so a driver upgrade starts from no known failures.
+struct OpenCLTuneFailures {
+    //Not an OpenCL error code, for configs that the tuner crashed or hung on
+    static constexpr int CRASHED_OR_HUNG = -10000;
+
+    //Loads the failures recorded for this device and driver from filename if it exists
+    OpenCLTuneFailures(
+        const std::string& filename,
+        const std::string& deviceName,
+        const std::string& vendor,
+        const std::string& driverVersion
+    );
+    ~OpenCLTuneFailures();
+
+    OpenCLTuneFailures() = delete;
+    OpenCLTuneFailures(const OpenCLTuneFailures&) = delete;
+    OpenCLTuneFailures& operator=(const OpenCLTuneFailures&) = delete;
+
+    //stage is the tuning stage that compiles the kernel and desc identifies the config's compile options within it.
+    //Returns nullptr if the config is not known to fail.
+    const OpenCLTuneFailure* find(const std::string& stage, const std::string& desc) const;
+    void add(const std::string& stage, const std::string& desc, int errorCode, const std::string& errorMessage);
+    //For a config that worked when probed again
+    void remove(const std::string& stage, const std::string& desc);
+    size_t size() const;
+
+    //For a tuner running as a worker under OpenCLTuneWorker::supervise, which restarts it when it crashes or hangs.
+    //While a config is tested it is written to currentFilename, and this records any config left there by the
+    //previous worker as CRASHED_OR_HUNG.
+    void trackCurrentConfig(const std::string& currentFilename);
+    //Called around testing each config, these do nothing unless trackCurrentConfig was called
+    void beginConfig(const std::string& stage, const std::string& desc);
+    void endConfig();
+
+private:
+    std::ofstream out;
+    std::string deviceName;
+    std::string vendor;
+    std::string driverVersion;
+    std::map<std::pair<std::string, std::string>, OpenCLTuneFailure> failures;
+    std::string currentFilename;
+
+    void writeCurrent(const std::string& line);
+    void writeRecord(const std::string& kind, const std::string& stage, const std::string& desc, const OpenCLTuneFailure* failure);
+};
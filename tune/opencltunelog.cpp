@@ -0,0 +1,161 @@
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+
+#include "opencltunelog.h"
+#include "openclhelpers.h"
+
+using namespace std;
+
+static string jsonString(const string& s) {
+    string ret = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '"') ret += "\\\"";
+        else if (c == '\\') ret += "\\\\";
+        else if (c == '\n') ret += "\\n";
+        else if (c == '\r') ret += "\\r";
+        else if (c == '\t') ret += "\\t";
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+            ret += buf;
+        }
+        else
+            ret += c;
+    }
+    ret += "\"";
+    return ret;
+}
+
+//JSON has no infinity or nan
+static string jsonNumber(double x) {
+    if (!std::isfinite(x))
+        return "null";
+    ostringstream o;
+    o.precision(9);
+    o << x;
+    return o.str();
+}
+
+static string csvString(const string& s) {
+    string ret = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"')
+            ret += "\"\"";
+        else
+            ret += s[i];
+    }
+    ret += "\"";
+    return ret;
+}
+
+static string csvNumber(double x) {
+    if (!std::isfinite(x))
+        return "";
+    ostringstream o;
+    o.precision(9);
+    o << x;
+    return o.str();
+}
+
+OpenCLTuneLog::OpenCLTuneLog(const string& filename, const string& desc)
+    : out(filename, ios::app),
+    runDesc(desc),
+    isCSV(false)
+{
+    if (out.fail())
+        throw IOError("Could not open tuning log file: " + filename);
+    isCSV = filename.size() >= 4 && Global::toLower(filename.substr(filename.size() - 4)) == ".csv";
+
+    //Only write the header for a new file so that several runs can share one log
+    out.seekp(0, ios::end);
+    if (isCSV && out.tellp() == 0) {
+        out << "run,stage,index,numConfigs,isReference,status,params,compileSeconds,kernelSeconds,kernelWeights,"
+            << "callsPerSecond,gflops,gbytesPerSecond,squaredError,maxAbsError,numNonFinite,errorProp,score,errorCode,errorMessage" << "\n";
+    }
+}
+
+OpenCLTuneLog::~OpenCLTuneLog() {
+    out.flush();
+}
+
+void OpenCLTuneLog::write(const OpenCLTuneLogRecord& record) {
+    if (isCSV)
+        writeCSV(record);
+    else
+        writeJSON(record);
+    //Flush every record so that the log is still useful if a kernel crashes the driver
+    out.flush();
+}
+
+void OpenCLTuneLog::writeJSON(const OpenCLTuneLogRecord& record) {
+    out << "{\"run\":" << jsonString(runDesc);
+    out << ",\"stage\":" << jsonString(record.stage);
+    out << ",\"index\":" << record.index;
+    out << ",\"numConfigs\":" << record.numConfigs;
+    out << ",\"isReference\":" << (record.isReference ? "true" : "false");
+    out << ",\"status\":" << jsonString(record.status);
+    out << ",\"params\":{";
+    for (auto iter = record.params.begin(); iter != record.params.end(); ++iter) {
+        if (iter != record.params.begin())
+            out << ",";
+        out << jsonString(iter->first) << ":" << iter->second;
+    }
+    out << "}";
+    out << ",\"compileSeconds\":" << jsonNumber(record.compileSeconds);
+    out << ",\"kernelSeconds\":[";
+    for (size_t i = 0; i < record.kernelSeconds.size(); i++)
+        out << (i > 0 ? "," : "") << jsonNumber(record.kernelSeconds[i]);
+    out << "]";
+    out << ",\"kernelWeights\":[";
+    for (size_t i = 0; i < record.kernelWeights.size(); i++)
+        out << (i > 0 ? "," : "") << jsonNumber(record.kernelWeights[i]);
+    out << "]";
+    out << ",\"callsPerSecond\":" << jsonNumber(record.callsPerSecond);
+    out << ",\"gflops\":" << jsonNumber(record.gflops);
+    out << ",\"gbytesPerSecond\":" << jsonNumber(record.gbytesPerSecond);
+    out << ",\"squaredError\":" << jsonNumber(record.squaredError);
+    out << ",\"maxAbsError\":" << jsonNumber(record.maxAbsError);
+    out << ",\"numNonFinite\":" << record.numNonFinite;
+    out << ",\"errorProp\":" << jsonNumber(record.errorProp);
+    out << ",\"score\":" << jsonNumber(record.score);
+    out << ",\"errorCode\":" << record.errorCode;
+    out << ",\"errorMessage\":" << jsonString(record.errorMessage);
+    out << "}" << "\n";
+}
+
+void OpenCLTuneLog::writeCSV(const OpenCLTuneLogRecord& record) {
+    //Lists within a field are separated by spaces
+    string params;
+    for (auto iter = record.params.begin(); iter != record.params.end(); ++iter)
+        params += (params.size() > 0 ? " " : "") + iter->first + "=" + to_string(iter->second);
+    string kernelSeconds;
+    for (size_t i = 0; i < record.kernelSeconds.size(); i++)
+        kernelSeconds += (i > 0 ? " " : "") + csvNumber(record.kernelSeconds[i]);
+    string kernelWeights;
+    for (size_t i = 0; i < record.kernelWeights.size(); i++)
+        kernelWeights += (i > 0 ? " " : "") + csvNumber(record.kernelWeights[i]);
+
+    out << csvString(runDesc)
+        << "," << csvString(record.stage)
+        << "," << record.index
+        << "," << record.numConfigs
+        << "," << (record.isReference ? 1 : 0)
+        << "," << record.status
+        << "," << csvString(params)
+        << "," << csvNumber(record.compileSeconds)
+        << "," << csvString(kernelSeconds)
+        << "," << csvString(kernelWeights)
+        << "," << csvNumber(record.callsPerSecond)
+        << "," << csvNumber(record.gflops)
+        << "," << csvNumber(record.gbytesPerSecond)
+        << "," << csvNumber(record.squaredError)
+        << "," << csvNumber(record.maxAbsError)
+        << "," << record.numNonFinite
+        << "," << csvNumber(record.errorProp)
+        << "," << csvNumber(record.score)
+        << "," << record.errorCode
+        << "," << csvString(record.errorMessage)
+        << "\n";
+}
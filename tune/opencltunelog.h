@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+
+//Everything measured for one config tested by the tuner
+struct OpenCLTuneLogRecord {
+    std::string stage;
+    int index = 0;
+    int numConfigs = 0;
+    bool isReference = false;
+    //"ok", "compile_failed", "failed", or "wrong_output" if it did not match the host reference implementation
+    std::string status;
+    //The stage's tunable parameters, as written in its desc
+    std::map<std::string, int> params;
+
+    double compileSeconds = 0.0;
+    //Time of each kernel call from its profiling info according to the run's OpenCLTuner::TimingMode, and the
+    //weight it was given in the score. Calls with weight 0 are warmup.
+    std::vector<double> kernelSeconds;
+    std::vector<double> kernelWeights;
+    double callsPerSecond = 0.0;
+    double gflops = 0.0;
+    double gbytesPerSecond = 0.0;
+
+    //Compared against the reference config on the device
+    double squaredError = 0.0;
+    double maxAbsError = 0.0;
+    int numNonFinite = 0;
+    double errorProp = 0.0;
+    double score = 0.0;
+
+    int errorCode = 0;
+    std::string errorMessage;
+};
+
+//Appends one record per tested config to a file for offline analysis.
+//Writes CSV with a header line if the filename ends in ".csv", otherwise one JSON object per line.
+struct OpenCLTuneLog {
+    //runDesc identifies the device and model shape being tuned and is written into every record
+    OpenCLTuneLog(const std::string& filename, const std::string& runDesc);
+    ~OpenCLTuneLog();
+
+    OpenCLTuneLog() = delete;
+    OpenCLTuneLog(const OpenCLTuneLog&) = delete;
+    OpenCLTuneLog& operator=(const OpenCLTuneLog&) = delete;
+
+    void write(const OpenCLTuneLogRecord& record);
+
+private:
+    std::ofstream out;
+    std::string runDesc;
+    bool isCSV;
+
+    void writeJSON(const OpenCLTuneLogRecord& record);
+    void writeCSV(const OpenCLTuneLogRecord& record);
+};
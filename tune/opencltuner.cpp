@@ -2,12 +2,20 @@
 #include <vector>
 #include <random>
 #include <map>
+#include <set>
 #include <sstream>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 
 #include "openclhelpers.h"
 #include "opencltuner.h"
+#include "opencltunelog.h"
+#include "opencltunefailures.h"
+#include "opencltrace.h"
 #include "openclkernels.h"
+#include "openclreference.h"
 
 using namespace std;
 using namespace OpenCLHelpers;
@@ -112,6 +120,12 @@ bool OpenCLParams::XGemmDirectParams::isValid() const {
     if (!isMultipleOf(WGD, MDIMCD * NDIMCD / NDIMBD)) return false;
     return true;
 }
+int OpenCLParams::XGemmDirectParams::workGroupSize() const {
+    return MDIMCD * NDIMCD;
+}
+int OpenCLParams::XGemmDirectParams::localMemBytes(bool usingFP16Compute) const {
+    return (WGD * (WGD + PADA) + WGD * (WGD + PADB)) * (usingFP16Compute ? 2 : 4);
+}
 
 string OpenCLParams::XGemmParams::desc() const {
     string s;
@@ -129,6 +143,7 @@ string OpenCLParams::XGemmParams::desc() const {
     s += " STRN=" + to_string(STRN);
     s += " SA=" + to_string(SA);
     s += " SB=" + to_string(SB);
+    s += " FIXED_SHAPE=" + to_string(FIXED_SHAPE);
     return s;
 }
 string OpenCLParams::XGemmParams::compileOptions() const {
@@ -149,6 +164,15 @@ string OpenCLParams::XGemmParams::compileOptions() const {
     s += " -DSB=" + to_string(SB);
     return s;
 }
+string OpenCLParams::XGemmParams::compileOptions(int M, int N, int K) const {
+    string s = compileOptions();
+    if (FIXED_SHAPE == 1) {
+        s += " -DFIXED_M=" + to_string(M);
+        s += " -DFIXED_N=" + to_string(N);
+        s += " -DFIXED_K=" + to_string(K);
+    }
+    return s;
+}
 void OpenCLParams::XGemmParams::fillFromDesc(const string& fileName, const string& desc) {
     map<string, int> kvs = readDescKeyValues(fileName, desc);
     MWG = getInt(kvs, "MWG", MWG);
@@ -165,6 +189,7 @@ void OpenCLParams::XGemmParams::fillFromDesc(const string& fileName, const strin
     STRN = getInt(kvs, "STRN", STRN);
     SA = getInt(kvs, "SA", SA);
     SB = getInt(kvs, "SB", SB);
+    FIXED_SHAPE = getInt(kvs, "FIXED_SHAPE", FIXED_SHAPE);
 }
 bool OpenCLParams::XGemmParams::isValid() const {
     if (MWG <= 0) return false;
@@ -181,6 +206,7 @@ bool OpenCLParams::XGemmParams::isValid() const {
     if (STRN < 0 || STRN > 1) return false;
     if (SA < 0 || SA > 1) return false;
     if (SB < 0 || SB > 1) return false;
+    if (FIXED_SHAPE < 0 || FIXED_SHAPE > 1) return false;
     if (!isMultipleOf(KWG, KWI)) return false;
     if (!isMultipleOf(MWG, MDIMC * VWM)) return false;
     if (!isMultipleOf(NWG, NDIMC * VWN)) return false;
@@ -199,6 +225,22 @@ bool OpenCLParams::XGemmParams::isSimple() const {
     if (MWG != NWG) return false;
     return true;
 }
+string OpenCLParams::XGemmParams::effectiveDesc() const {
+    //MDIMA and NDIMB only shape the loads into local memory
+    XGemmParams p = *this;
+    if (SA == 0)
+        p.MDIMA = 0;
+    if (SB == 0)
+        p.NDIMB = 0;
+    return p.desc();
+}
+int OpenCLParams::XGemmParams::workGroupSize() const {
+    return MDIMC * NDIMC;
+}
+int OpenCLParams::XGemmParams::localMemBytes(bool usingFP16Storage) const {
+    //The local tiles are in the storage type
+    return (SA * KWG * MWG + SB * KWG * NWG) * (usingFP16Storage ? 2 : 4);
+}
 
 string OpenCLParams::HGemmWmmaParams::desc() const {
     string s;
@@ -280,6 +322,13 @@ bool OpenCLParams::HGemmWmmaParams::isSimple() const {
     if (MWG != NWG) return false;
     return true;
 }
+int OpenCLParams::HGemmWmmaParams::workGroupSize() const {
+    const int WARP_SIZE = 32;
+    return MWAVE / MWARP * WARP_SIZE * NWAVE / NWARP;
+}
+int OpenCLParams::HGemmWmmaParams::localMemBytes() const {
+    return (SA * KWG * MWG + SB * KWG * NWG) * 2;
+}
 
 string OpenCLParams::Conv3x3Params::desc() const {
     string s;
@@ -345,6 +394,12 @@ bool OpenCLParams::Conv3x3Params::isValid() const {
         return true;
     return false;
 }
+int OpenCLParams::Conv3x3Params::transWorkGroupSize() const {
+    return transLocalSize0 * transLocalSize1;
+}
+int OpenCLParams::Conv3x3Params::untransWorkGroupSize() const {
+    return untransLocalSize0 * untransLocalSize1 * untransLocalSize2;
+}
 
 bool OpenCLTuneParams::isValid() const {
     return
@@ -389,12 +444,17 @@ int OpenCLTuneParams::getXGemmKPaddingMult(bool usingFP16Compute, bool usingFP16
     return xGemm.KWG;
 }
 
-static const int TUNER_VERSION = 8;
 static const char* TUNEPARAMS_VERSION_LINE = "VERSION=8";
 void OpenCLTuneParams::save(const string& filename, const OpenCLTuneParams& config) {
     ofstream out(filename);
     if (out.fail())
         throw IOError("Could not create file: " + filename);
+    save(out, config);
+    out.flush();
+    out.close();
+}
+
+void OpenCLTuneParams::save(ostream& out, const OpenCLTuneParams& config) {
     out << TUNEPARAMS_VERSION_LINE << "\n";
     out << "#shouldUseFP16Storage" << "\n";
     out << config.shouldUseFP16Storage << "\n";
@@ -412,34 +472,103 @@ void OpenCLTuneParams::save(const string& filename, const OpenCLTuneParams& conf
     out << config.hGemmWmma.desc() << "\n";
     out << "#conv3x3" << "\n";
     out << config.conv3x3.desc() << "\n";
-    out.flush();
-    out.close();
 }
 
-static cl_mem constantReadOnlyBufferFloat(cl_context context, int numElts, float constant) {
+static bool parseBoolLine(const string& fileName, const string& line) {
+    int value;
+    if (!Global::tryStringToInt(line, value) || (value != 0 && value != 1))
+        throw IOError("OpenCLTuneParams::load: expected 0 or 1 but got " + line + " in file " + fileName);
+    return value != 0;
+}
+
+OpenCLTuneParams OpenCLTuneParams::load(const string& filename) {
+    ifstream in(filename);
+    if (in.fail())
+        throw IOError("Could not open file: " + filename);
+
+    vector<string> rawLines;
+    string line;
+    while (getline(in, line))
+        rawLines.push_back(line);
+    in.close();
+    return loadFromLines(filename, rawLines);
+}
+
+OpenCLTuneParams OpenCLTuneParams::loadFromLines(const string& filename, const vector<string>& rawLines) {
+    //Lines beginning with '#' are the section headers written by save, treat them as comments
+    vector<string> lines;
+    for (const string& rawLine : rawLines) {
+        string line = Global::trim(rawLine);
+        if (line.length() <= 0 || line[0] == '#')
+            continue;
+        lines.push_back(line);
+    }
+
+    if (lines.size() <= 0)
+        throw IOError("OpenCLTuneParams::load: no params in file " + filename);
+
+    map<string, int> versionKvs = readDescKeyValues(filename, lines[0]);
+    if (!contains(versionKvs, string("VERSION")))
+        throw IOError("OpenCLTuneParams::load: expected first line to be " + string(TUNEPARAMS_VERSION_LINE) + " in file " + filename);
+    int version = map_get(versionKvs, string("VERSION"));
+    if (version != TUNER_VERSION)
+        throw IOError(
+            "OpenCLTuneParams::load: file " + filename + " has version " + to_string(version) +
+            " but this tuner uses version " + to_string(TUNER_VERSION) + ", please re-tune"
+        );
+
+    if (lines.size() != 9)
+        throw IOError("OpenCLTuneParams::load: unexpected number of parameter lines in file " + filename);
+
+    OpenCLTuneParams config;
+    config.shouldUseFP16Storage = parseBoolLine(filename, lines[1]);
+    config.shouldUseFP16Compute = parseBoolLine(filename, lines[2]);
+    config.shouldUseFP16TensorCores = parseBoolLine(filename, lines[3]);
+    config.xGemmDirect.fillFromDesc(filename, lines[4]);
+    config.xGemm.fillFromDesc(filename, lines[5]);
+    config.xGemm16.fillFromDesc(filename, lines[6]);
+    config.hGemmWmma.fillFromDesc(filename, lines[7]);
+    config.conv3x3.fillFromDesc(filename, lines[8]);
+
+    if (!config.isValid())
+        throw IOError("OpenCLTuneParams::load: params in file " + filename + " are not a valid config");
+    return config;
+}
+
+static cl_mem constantReadOnlyBufferFloat(cl_context context, bool hostUnifiedMemory, int numElts, float constant) {
     vector<float> buf(numElts);
     for (int i = 0; i < numElts; i++)
         buf[i] = constant;
-    return createReadOnlyBuffer(context, buf);
+    return createReadOnlyBuffer(context, hostUnifiedMemory, buf);
 }
-static cl_mem randomReadOnlyBufferFloat(const int64_t seed, cl_context context, int numElts, double scale) {
+static vector<float> randomValuesFloat(const int64_t seed, int numElts, double scale) {
     vector<float> buf(numElts);
     mt19937_64 mt(seed);
     uniform_real_distribution<float> rand(0.0, scale);
     for (int i = 0; i < numElts; i++)
         buf[i] = rand(mt);
-    return createReadOnlyBuffer(context, buf);
+    return buf;
+}
+static vector<half_t> toHalfs(const vector<float>& floats) {
+    vector<half_t> buf(floats.size());
+    floatsToHalfs(floats.data(), buf.data(), floats.size());
+    return buf;
+}
+static vector<float> toFloats(const vector<half_t>& halfs) {
+    vector<float> buf(halfs.size());
+    halfsToFloats(halfs.data(), buf.data(), halfs.size());
+    return buf;
 }
-static cl_mem randomReadOnlyBufferHalf(const int64_t seed, cl_context context, int numElts, double scale) {
-    vector<half_t> buf(numElts);
+static vector<half_t> randomValuesHalf(const int64_t seed, int numElts, double scale) {
+    vector<float> buf(numElts);
     mt19937_64 mt(seed);
     uniform_real_distribution<double> rand(0.0, scale);
     for (int i = 0; i < numElts; i++)
-        buf[i] = half_float::half_cast<half_t>(rand(mt));
-    return createReadOnlyBuffer(context, buf);
+        buf[i] = (float)rand(mt);
+    return toHalfs(buf);
 }
-static cl_mem randomReadOnly3dPaddedBufferFloat(
-    const int64_t seed, cl_context context,
+static vector<float> random3dPaddedValuesFloat(
+    const int64_t seed,
     int batchSize, int ySize, int ySizePadded, int xSize, int xSizePadded,
     double scale
 ) {
@@ -457,14 +586,14 @@ static cl_mem randomReadOnly3dPaddedBufferFloat(
             }
         }
     }
-    return createReadOnlyBuffer(context, buf);
+    return buf;
 }
-static cl_mem randomReadOnly3dPaddedBufferHalf(
-    const int64_t seed, cl_context context,
+static vector<half_t> random3dPaddedValuesHalf(
+    const int64_t seed,
     int batchSize, int ySize, int ySizePadded, int xSize, int xSizePadded,
     double scale
 ) {
-    vector<half_t> buf((size_t)batchSize * ySizePadded * xSizePadded);
+    vector<float> buf((size_t)batchSize * ySizePadded * xSizePadded);
     mt19937_64 mt(seed);
     uniform_real_distribution<double> rand(0.0, scale);
     size_t i = 0;
@@ -472,13 +601,54 @@ static cl_mem randomReadOnly3dPaddedBufferHalf(
         for (int y = 0; y < ySizePadded; y++) {
             for (int x = 0; x < xSizePadded; x++) {
                 if (y < ySize && x < xSize)
-                    buf[i++] = half_float::half_cast<half_t>(rand(mt));
+                    buf[i++] = (float)rand(mt);
                 else
-                    buf[i++] = half_float::half_cast<half_t>(0.0f);
+                    buf[i++] = 0.0f;
             }
         }
     }
-    return createReadOnlyBuffer(context, buf);
+    return toHalfs(buf);
+}
+
+static PooledBuffer randomReadOnlyBufferFloat(const int64_t seed, BufferPool& bufferPool, cl_command_queue commandQueue, int numElts, double scale) {
+    vector<float> buf = randomValuesFloat(seed, numElts, scale);
+    return acquireReadOnlyBuffer(bufferPool, commandQueue, buf);
+}
+static PooledBuffer randomReadOnlyBufferHalf(const int64_t seed, BufferPool& bufferPool, cl_command_queue commandQueue, int numElts, double scale) {
+    vector<half_t> buf = randomValuesHalf(seed, numElts, scale);
+    return acquireReadOnlyBuffer(bufferPool, commandQueue, buf);
+}
+static PooledBuffer randomReadOnly3dPaddedBufferFloat(
+    const int64_t seed, BufferPool& bufferPool, cl_command_queue commandQueue,
+    int batchSize, int ySize, int ySizePadded, int xSize, int xSizePadded,
+    double scale
+) {
+    vector<float> buf = random3dPaddedValuesFloat(seed, batchSize, ySize, ySizePadded, xSize, xSizePadded, scale);
+    return acquireReadOnlyBuffer(bufferPool, commandQueue, buf);
+}
+static PooledBuffer randomReadOnly3dPaddedBufferHalf(
+    const int64_t seed, BufferPool& bufferPool, cl_command_queue commandQueue,
+    int batchSize, int ySize, int ySizePadded, int xSize, int xSizePadded,
+    double scale
+) {
+    vector<half_t> buf = random3dPaddedValuesHalf(seed, batchSize, ySize, ySizePadded, xSize, xSizePadded, scale);
+    return acquireReadOnlyBuffer(bufferPool, commandQueue, buf);
+}
+
+//The same values as the random buffers above, as floats on the host for the reference implementations
+static vector<float> hostRandomValues(const int64_t seed, int numElts, double scale, bool useFP16Storage) {
+    if (useFP16Storage)
+        return toFloats(randomValuesHalf(seed, numElts, scale));
+    return randomValuesFloat(seed, numElts, scale);
+}
+static vector<float> hostRandom3dPaddedValues(
+    const int64_t seed,
+    int batchSize, int ySize, int ySizePadded, int xSize, int xSizePadded,
+    double scale, bool useFP16Storage
+) {
+    if (useFP16Storage)
+        return toFloats(random3dPaddedValuesHalf(seed, batchSize, ySize, ySizePadded, xSize, xSizePadded, scale));
+    return random3dPaddedValuesFloat(seed, batchSize, ySize, ySizePadded, xSize, xSizePadded, scale);
 }
 
 
@@ -512,6 +682,35 @@ static void filterConfigs(
     configs = newCfgs;
 }
 
+//Drops configs whose work group size or local memory exceed what any of the devices allow, before compiling them
+static void filterConfigsByDeviceLimits(
+    vector<OpenCLTuneParams>& configs,
+    const vector<cl_device_id>& deviceIds,
+    std::function<int(const OpenCLTuneParams&)> workGroupSize,
+    std::function<int(const OpenCLTuneParams&)> localMemBytes,
+    ostream& out
+) {
+    size_t maxWorkGroupSize = std::numeric_limits<size_t>::max();
+    cl_ulong maxLocalMemBytes = std::numeric_limits<cl_ulong>::max();
+    for (cl_device_id deviceId : deviceIds) {
+        size_t deviceMaxWorkGroupSize;
+        cl_ulong deviceLocalMemSize;
+        cl_int err;
+        err = clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &deviceMaxWorkGroupSize, NULL); CHECK_ERR(err);
+        err = clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &deviceLocalMemSize, NULL); CHECK_ERR(err);
+        maxWorkGroupSize = std::min(maxWorkGroupSize, deviceMaxWorkGroupSize);
+        maxLocalMemBytes = std::min(maxLocalMemBytes, deviceLocalMemSize);
+    }
+
+    size_t numBefore = configs.size();
+    filterConfigs(configs, [&](const OpenCLTuneParams& cfg) {
+        return (size_t)workGroupSize(cfg) <= maxWorkGroupSize && (cl_ulong)localMemBytes(cfg) <= maxLocalMemBytes;
+    });
+    if (configs.size() < numBefore)
+        out << "Skipping " << (numBefore - configs.size()) << " configs exceeding the device's max work group size "
+            << maxWorkGroupSize << " or local memory " << maxLocalMemBytes << " bytes" << endl;
+}
+
 static void shuffleConfigs(
     vector<OpenCLTuneParams>& configs
 ) {
@@ -525,114 +724,669 @@ static void shuffleConfigs(
     }
 }
 
+static int countDifferingValues(const map<string, int>& a, const map<string, int>& b) {
+    int count = 0;
+    for (auto iter = a.begin(); iter != a.end(); ++iter) {
+        auto other = b.find(iter->first);
+        if (other == b.end() || other->second != iter->second)
+            count++;
+    }
+    return count;
+}
+
+//Move the seed configs and every config that differs from one of them in a single parameter to the front,
+//so that results from similar hardware are tested before the rest of the search space.
+static void prioritizeSeedConfigs(
+    vector<OpenCLTuneParams>& configs,
+    const vector<OpenCLTuneParams>& seedConfigs,
+    const OpenCLTuneParams& currentConfig,
+    std::function<void(OpenCLTuneParams&, const OpenCLTuneParams&)> applySeed,
+    std::function<bool(const OpenCLTuneParams&)> isValid,
+    std::function<string(const OpenCLTuneParams&)> getDesc
+) {
+    if (seedConfigs.size() == 0)
+        return;
+
+    vector<OpenCLTuneParams> seeds;
+    vector<map<string, int>> seedValues;
+    for (size_t i = 0; i < seedConfigs.size(); i++) {
+        //Only take this stage's values from the seed, everything else stays as tuned so far on this device
+        OpenCLTuneParams cfg = currentConfig;
+        applySeed(cfg, seedConfigs[i]);
+        if (!isValid(cfg))
+            continue;
+        map<string, int> values = readDescKeyValues("seed config", getDesc(cfg));
+        bool isDuplicate = false;
+        for (size_t j = 0; j < seedValues.size(); j++) {
+            if (countDifferingValues(values, seedValues[j]) == 0)
+                isDuplicate = true;
+        }
+        if (isDuplicate)
+            continue;
+        seeds.push_back(cfg);
+        seedValues.push_back(values);
+    }
+
+    vector<OpenCLTuneParams> neighbors;
+    vector<OpenCLTuneParams> rest;
+    for (size_t i = 0; i < configs.size(); i++) {
+        map<string, int> values = readDescKeyValues("seed config", getDesc(configs[i]));
+        int minDiffering = INT_MAX;
+        for (size_t j = 0; j < seedValues.size(); j++)
+            minDiffering = std::min(minDiffering, countDifferingValues(values, seedValues[j]));
+        if (minDiffering == 0)
+            continue;
+        else if (minDiffering == 1)
+            neighbors.push_back(configs[i]);
+        else
+            rest.push_back(configs[i]);
+    }
+
+    configs = seeds;
+    configs.insert(configs.end(), neighbors.begin(), neighbors.end());
+    configs.insert(configs.end(), rest.begin(), rest.end());
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//Floating point operations of a winograd transform or untransform of one tile of one channel, counted as the two dense
+//small matrix products B^T d B or A^T m A even though the kernels skip the zeros in B and A
+static double winogradTransformFlops(int inTileXSize, int inTileYSize) {
+    return 2.0 * inTileXSize * inTileYSize * (inTileXSize + inTileYSize);
+}
+static double winogradUntransformFlops(int inTileXSize, int inTileYSize, int outTileXSize, int outTileYSize) {
+    return 2.0 * outTileXSize * inTileYSize * (inTileXSize + outTileYSize);
+}
+
 struct OpenCLTuneAccums {
     bool bad = false;
     cl_int badErr = 0;
     string detailedErrorMessage;
     double weightCounted = 0;
     double weightedTimeTaken = 0;
-
-    void countResultAndFreeEvent(cl_int err, cl_event event, double weight) {
+    double weightedFlops = 0;
+    double weightedBytes = 0;
+
+    OpenCLTuner::TimingMode timingMode;
+    OpenCLTrace* trace;
+
+    //Only for the tuning log
+    double compileSeconds = 0;
+    vector<double> kernelSeconds;
+    vector<double> kernelWeights;
+
+    //Set by checkKernelResources for kernels that run but likely poorly, which must win by a margin to be chosen
+    bool deprioritized = false;
+    string deprioritizedReason;
+
+    explicit OpenCLTuneAccums(const OpenCLTuner::TuneRunOptions& runOptions)
+        : timingMode(runOptions.timingMode),
+        trace(runOptions.trace)
+    {}
+
+    //Records a kernel call enqueued with the given result and event, to be timed by finishAndCountResults.
+    //round is which repetition of the config's sequence of calls this call is part of, each giving one sample of its
+    //time per call.
+    //flops is the number of useful floating point operations the kernel call performs, not counting padding.
+    //bytes is the global memory traffic if every element of the padded inputs is read once and every element
+    //of the padded output is written once.
+    void addEnqueued(cl_int err, cl_event event, int round, double weight, double flops, double bytes) {
         if (err != 0) {
-            if (!bad) {
-                bad = true;
-                badErr = err;
-            }
+            markBad(err);
             return;
         }
+        pending.push_back(PendingCall{ event, round, weight, flops, bytes });
+    }
 
-        err = clWaitForEvents(1, &event);
+    //Waits once for all enqueued calls and counts their profiled times, so that the host does not add a round trip
+    //between calls. Must be called after the last addEnqueued, even if it failed, to free the events.
+    void finishAndCountResults(cl_command_queue commandQueue) {
+        cl_int err = clFinish(commandQueue);
         //If the kernel does bad things the error might also pop up here
-        if (err != 0) {
+        if (err != 0)
+            markBad(err);
+
+        cl_ulong prevTimeEnd = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            const PendingCall& call = pending[i];
+            cl_int status;
+            err = clGetEventInfo(call.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL); CHECK_ERR(err);
+            if (status < 0)
+                markBad(status);
+
             if (!bad) {
-                bad = true;
-                badErr = err;
+                cl_ulong time_start, time_end;
+                err = clGetEventProfilingInfo(call.event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL); CHECK_ERR(err);
+                err = clGetEventProfilingInfo(call.event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL); CHECK_ERR(err);
+
+                double seconds = (time_end - time_start) * 1e-9;
+                //Sustained time is from the previous call ending to this one ending, including any gap between them
+                double countedSeconds = seconds;
+                if (timingMode == OpenCLTuner::TimingMode::SUSTAINED && i > 0 && time_end > prevTimeEnd)
+                    countedSeconds = (time_end - prevTimeEnd) * 1e-9;
+                prevTimeEnd = time_end;
+
+                weightedTimeTaken += countedSeconds * call.weight;
+                weightedFlops += call.flops * call.weight;
+                weightedBytes += call.bytes * call.weight;
+                weightCounted += call.weight;
+                if (roundSeconds.size() <= (size_t)call.round) {
+                    roundSeconds.resize(call.round + 1, 0.0);
+                    roundWeights.resize(call.round + 1, 0.0);
+                }
+                roundSeconds[call.round] += countedSeconds * call.weight;
+                roundWeights[call.round] += call.weight;
+                kernelSeconds.push_back(countedSeconds);
+                kernelWeights.push_back(call.weight);
+                if (trace != nullptr)
+                    trace->addDeviceEvent(call.event);
             }
-            return;
+            clReleaseEvent(call.event);
+        }
+        pending.clear();
+    }
+
+    //The weighted mean time per kernel call of each round
+    vector<double> secondsPerCallSamples() const {
+        vector<double> samples;
+        for (size_t r = 0; r < roundSeconds.size(); r++) {
+            if (roundWeights[r] > 0)
+                samples.push_back(roundSeconds[r] / roundWeights[r]);
+        }
+        return samples;
+    }
+
+private:
+    struct PendingCall {
+        cl_event event;
+        int round;
+        double weight;
+        double flops;
+        double bytes;
+    };
+    vector<PendingCall> pending;
+    vector<double> roundSeconds;
+    vector<double> roundWeights;
+
+    void markBad(cl_int err) {
+        if (!bad) {
+            bad = true;
+            badErr = err;
+        }
+    }
+};
+
+//The output of a tested config, left on the device. The values compared are a 3D view of the buffer of
+//size0 x size1 x size2 with element (i0,i1,i2) at i0 + stride1 * i1 + stride2 * i2, so that padding is skipped.
+struct OpenCLTuneOutput {
+    cl_mem buffer = nullptr;
+    //The pool the buffer goes back to on release
+    BufferPool* pool = nullptr;
+    bool isHalf = false;
+    int size0 = 0;
+    int size1 = 1;
+    int size2 = 1;
+    int stride1 = 0;
+    int stride2 = 0;
+
+    static OpenCLTuneOutput contiguous(PooledBuffer&& buffer, bool isHalf, int numElts) {
+        return strided(std::move(buffer), isHalf, numElts, 1, 1, numElts, numElts);
+    }
+    static OpenCLTuneOutput strided(PooledBuffer&& buffer, bool isHalf, int size0, int size1, int size2, int stride1, int stride2) {
+        OpenCLTuneOutput ret;
+        ret.pool = buffer.getPool();
+        ret.buffer = buffer.detach();
+        ret.isHalf = isHalf;
+        ret.size0 = size0;
+        ret.size1 = size1;
+        ret.size2 = size2;
+        ret.stride1 = stride1;
+        ret.stride2 = stride2;
+        return ret;
+    }
+
+    void release() {
+        if (buffer != nullptr)
+            pool->release(buffer);
+        buffer = nullptr;
+    }
+};
+
+struct OpenCLOutputComparison {
+    double squaredError = 0.0;
+    double squaredMagnitude = 0.0;
+    double maxAbsError = 0.0;
+    //Elements non-finite in one output but not the other, see OpenCLKernels::compareOutputs
+    int numNonFinite = 0;
+};
+
+//Compares outputs on the device with OpenCLKernels::compareOutputs, reading back only a few partial sums
+struct OpenCLOutputComparer {
+    static constexpr int NUM_GROUPS = 64;
+
+    OpenCLOutputComparer(const cl_context& c, const vector<cl_device_id>& d, cl_command_queue q)
+        : context(c), deviceIds(d), commandQueue(q), partialsBuf(), partials(nullptr)
+    {
+        for (int i = 0; i < 2; i++) {
+            programs[i] = nullptr;
+            kernels[i] = nullptr;
+            localSizes[i] = 0;
+        }
+    }
+    ~OpenCLOutputComparer() {
+        for (int i = 0; i < 2; i++) {
+            if (kernels[i] != nullptr)
+                clReleaseKernel(kernels[i]);
+            if (programs[i] != nullptr)
+                clReleaseProgram(programs[i]);
+        }
+        if (partials != nullptr)
+            clReleaseMemObject(partials);
+    }
+    OpenCLOutputComparer(const OpenCLOutputComparer&) = delete;
+    OpenCLOutputComparer& operator=(const OpenCLOutputComparer&) = delete;
+
+    //Returns false if the outputs have different shapes or storage and cannot be compared
+    bool compare(const OpenCLTuneOutput& reference, const OpenCLTuneOutput& output, OpenCLOutputComparison& buf) {
+        if (reference.isHalf != output.isHalf ||
+            reference.size0 != output.size0 || reference.size1 != output.size1 || reference.size2 != output.size2)
+            return false;
+
+        int idx = reference.isHalf ? 1 : 0;
+        if (kernels[idx] == nullptr) {
+            cl_int err;
+            programs[idx] = compileProgram(
+                "compareOutputsProgram", context, deviceIds, OpenCLKernels::compareOutputs,
+                reference.isHalf ? OpenCLKernels::fp16StorageDefine : ""
+            );
+            kernels[idx] = clCreateKernel(programs[idx], "compareOutputs", &err); CHECK_ERR(err);
+            size_t maxLocalSize;
+            err = clGetKernelWorkGroupInfo(kernels[idx], deviceIds[0], CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxLocalSize), &maxLocalSize, NULL); CHECK_ERR(err);
+            //Largest power of 2 up to 64 that the kernel can run with
+            localSizes[idx] = 1;
+            while (localSizes[idx] * 2 <= std::min(maxLocalSize, (size_t)64))
+                localSizes[idx] *= 2;
+        }
+        //Small and read back once per comparison, so plain device memory is fine even on unified memory
+        if (partials == nullptr)
+            partials = createReadWriteBufferFloat(context, false, NUM_GROUPS * 4);
+
+        cl_kernel kernel = kernels[idx];
+        size_t localSize = localSizes[idx];
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&reference.buffer);
+        clSetKernelArg(kernel, 1, sizeof(int), (void*)&reference.stride1);
+        clSetKernelArg(kernel, 2, sizeof(int), (void*)&reference.stride2);
+        clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&output.buffer);
+        clSetKernelArg(kernel, 4, sizeof(int), (void*)&output.stride1);
+        clSetKernelArg(kernel, 5, sizeof(int), (void*)&output.stride2);
+        clSetKernelArg(kernel, 6, sizeof(int), (void*)&output.size0);
+        clSetKernelArg(kernel, 7, sizeof(int), (void*)&output.size1);
+        clSetKernelArg(kernel, 8, sizeof(int), (void*)&output.size2);
+        clSetKernelArg(kernel, 9, sizeof(cl_mem), (void*)&partials);
+        clSetKernelArg(kernel, 10, localSize * 4 * sizeof(float), NULL);
+
+        size_t globalSize = NUM_GROUPS * localSize;
+        cl_int err = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL); CHECK_ERR(err);
+        blockingReadBuffer(commandQueue, partials, NUM_GROUPS * 4, partialsBuf);
+
+        buf = OpenCLOutputComparison();
+        for (int i = 0; i < NUM_GROUPS; i++) {
+            buf.squaredError += partialsBuf[i * 4 + 0];
+            buf.squaredMagnitude += partialsBuf[i * 4 + 1];
+            buf.maxAbsError = std::max(buf.maxAbsError, (double)partialsBuf[i * 4 + 2]);
+            buf.numNonFinite += (int)partialsBuf[i * 4 + 3];
+        }
+        return true;
+    }
+
+private:
+    cl_context context;
+    vector<cl_device_id> deviceIds;
+    cl_command_queue commandQueue;
+    //Index 0 for float storage, 1 for half storage
+    cl_program programs[2];
+    cl_kernel kernels[2];
+    size_t localSizes[2];
+    vector<float> partialsBuf;
+    cl_mem partials;
+};
+
+//Checks the leading values of a config's output against the host reference implementation of its stage.
+//Returns true if there is no host reference for the config. On a mismatch, fills mismatchBuf with the reason.
+static bool matchesHostReference(
+    cl_command_queue commandQueue,
+    const OpenCLTuneParams& cfg,
+    const OpenCLTuneOutput& output,
+    bool usesFP16Compute,
+    std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)> computeHostReference,
+    string& mismatchBuf
+) {
+    vector<float> expected;
+    if (!computeHostReference(cfg, expected))
+        return true;
+
+    vector<float> actual;
+    if (output.isHalf)
+        blockingReadBufferHalfToFloat(commandQueue, output.buffer, expected.size(), actual);
+    else
+        blockingReadBuffer(commandQueue, output.buffer, expected.size(), actual);
+
+    double squerr = 0.0;
+    double sqmag = 0.0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (!isfinite(actual[i])) {
+            mismatchBuf = "non-finite value at index " + to_string(i);
+            return false;
         }
+        double diff = (double)expected[i] - (double)actual[i];
+        squerr += diff * diff;
+        sqmag += (double)expected[i] * (double)expected[i];
+    }
+    //Loose enough for the rounding of fp16 storage and compute, a wrong kernel is typically off by order 1
+    double tolerance = (usesFP16Compute || output.isHalf) ? 0.05 : 0.001;
+    double errorProp = sqrt(squerr / (sqmag + 1e-30));
+    if (!(errorProp <= tolerance)) {
+        mismatchBuf = "relative L2 error " + to_string(errorProp) + " exceeds " + to_string(tolerance);
+        return false;
+    }
+    return true;
+}
 
-        cl_ulong time_start, time_end;
-        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL); CHECK_ERR(err);
-        err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL); CHECK_ERR(err);
+//The output of the last call of the winograd gemm tuning stages, with inChannels = FEATURES1_NUM and
+//outChannels = trunkNumChannels, over the same random input and filter as the device
+static void computeWinogradGemmHostReference(
+    uint64_t inputSeed, uint64_t filterSeed, bool useFP16Storage,
+    int numTilesTotal, int numTilesTotalPadded, int inTileXYSize,
+    int maxChannels, int maxInChannelsPadded, int maxOutChannelsPadded,
+    int inChannelsPadded, int outChannelsPadded,
+    vector<float>& expected
+) {
+    vector<float> input = hostRandom3dPaddedValues(
+        inputSeed, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0, useFP16Storage);
+    vector<float> filter = hostRandom3dPaddedValues(
+        filterSeed, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3), useFP16Storage);
+    expected.resize((size_t)numTilesTotalPadded * outChannelsPadded * inTileXYSize);
+    OpenCLReference::stridedBatchedGemm_KM_KN_NM(
+        numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
+        input.data(), numTilesTotalPadded * inChannelsPadded,
+        filter.data(), outChannelsPadded * inChannelsPadded,
+        expected.data(), numTilesTotalPadded * outChannelsPadded,
+        inTileXYSize
+    );
+}
 
-        weightedTimeTaken += (time_end - time_start) * 1e-9 * weight;
-        weightCounted += weight;
+//How much faster than the best so far a deprioritized config must be to be chosen
+static constexpr double DEPRIORITIZED_MARGIN = 0.03;
+//Fraction of the samples dropped from each end for the trimmed mean
+static constexpr double TIMING_TRIM = 0.2;
+//The sweep over all configs of a stage runs each config's sequence of calls once and ranks by that point estimate.
+//The best configs of the sweep are then re-raced against the config the stage started from at the end of the stage,
+//with the same number of samples each, enough for Yuen's test to tell real differences from noise: NUM_FINAL_RACE_PASSES * FINAL_RACE_ROUNDS = 15, or 9 after
+//trimming. That costs NUM_FINALISTS * 15 = 60 runs of a call sequence per stage on top of the one per config.
+static constexpr int NUM_FINALISTS = 4;
+//Times each finalist is tested in the re-race, interleaved with the others
+static constexpr int NUM_FINAL_RACE_PASSES = 3;
+//Repetitions of the sequence of calls in each test of a finalist, each giving one sample
+static constexpr int FINAL_RACE_ROUNDS = 5;
+
+//Quantile of Student's t distribution for a one-sided test at 5% or a two-sided 95% confidence interval
+static double studentT(double degreesOfFreedom, bool twoSided) {
+    static const double oneSided95[30] = {
+        6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812, 1.796, 1.782, 1.771, 1.761, 1.753,
+        1.746, 1.740, 1.734, 1.729, 1.725, 1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697
+    };
+    static const double twoSided95[30] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+        2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    //Rounding down the degrees of freedom errs on the side of a wider interval
+    int df = std::max(1, (int)degreesOfFreedom);
+    if (df > 30)
+        return twoSided ? 1.960 : 1.645;
+    return twoSided ? twoSided95[df - 1] : oneSided95[df - 1];
+}
 
-        clReleaseEvent(event);
+//Robust summary of the samples of a config's time per kernel call, insensitive to a few calls slowed down by
+//something else running on the device
+struct OpenCLTimingStats {
+    int numSamples = 0;
+    //Samples left after trimming
+    int numTrimmed = 0;
+    double median = 0.0;
+    double trimmedMean = 0.0;
+    //Squared standard error of the trimmed mean, from the winsorized variance as in Yuen's test
+    double trimmedMeanVariance = 0.0;
+
+    static OpenCLTimingStats compute(vector<double> samples) {
+        OpenCLTimingStats stats;
+        int n = (int)samples.size();
+        stats.numSamples = n;
+        if (n <= 0)
+            return stats;
+        std::sort(samples.begin(), samples.end());
+        stats.median = (n % 2 == 1) ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+
+        int g = (int)(TIMING_TRIM * n);
+        int h = n - 2 * g;
+        stats.numTrimmed = h;
+        double sum = 0.0;
+        for (int i = g; i < n - g; i++)
+            sum += samples[i];
+        stats.trimmedMean = sum / h;
+        if (h >= 2) {
+            double winsorizedSum = 0.0;
+            for (int i = 0; i < n; i++)
+                winsorizedSum += samples[std::min(std::max(i, g), n - g - 1)];
+            double winsorizedMean = winsorizedSum / n;
+            double winsorizedSquares = 0.0;
+            for (int i = 0; i < n; i++) {
+                double diff = samples[std::min(std::max(i, g), n - g - 1)] - winsorizedMean;
+                winsorizedSquares += diff * diff;
+            }
+            stats.trimmedMeanVariance = winsorizedSquares / ((double)h * (h - 1));
+        }
+        return stats;
     }
 
+    //Half width of the 95% confidence interval of the trimmed mean
+    double confidence95() const {
+        if (numTrimmed < 2)
+            return 0.0;
+        return studentT(numTrimmed - 1, true) * sqrt(trimmedMeanVariance);
+    }
 };
 
+//Whether a config with timing a is faster than one with timing b at 5% significance by Yuen's test on their trimmed
+//means, after dividing each config's times by its scoreFactor, the fraction of its calls per second it is scored by.
+//Without enough samples to tell, just compares the trimmed means.
+static bool significantlyFaster(const OpenCLTimingStats& a, double aScoreFactor, const OpenCLTimingStats& b, double bScoreFactor) {
+    double aTime = a.trimmedMean / aScoreFactor;
+    double bTime = b.trimmedMean / bScoreFactor;
+    if (a.numTrimmed < 2 || b.numTrimmed < 2)
+        return aTime < bTime;
+    double aVariance = a.trimmedMeanVariance / (aScoreFactor * aScoreFactor);
+    double bVariance = b.trimmedMeanVariance / (bScoreFactor * bScoreFactor);
+    double variance = aVariance + bVariance;
+    if (variance <= 0)
+        return aTime < bTime;
+    double degreesOfFreedom = variance * variance / (aVariance * aVariance / (a.numTrimmed - 1) + bVariance * bVariance / (b.numTrimmed - 1));
+    return bTime - aTime > studentT(degreesOfFreedom, false) * sqrt(variance);
+}
+
+//Errors that come from the kernel and its compile options rather than the state of the device, so that the config
+//will fail the same way every time on this driver. Not CL_OUT_OF_RESOURCES, which drivers also report for transient
+//conditions such as memory taken by other processes or a reset after a watchdog timeout.
+static bool isPersistentFailure(cl_int err) {
+    return
+        err == CL_BUILD_PROGRAM_FAILURE ||
+        err == CL_COMPILE_PROGRAM_FAILURE ||
+        err == CL_LINK_PROGRAM_FAILURE ||
+        err == CL_INVALID_WORK_GROUP_SIZE;
+}
+
+//Tests the reference config and then configsToTest, keeping the best in currentConfig. The config currentConfig
+//starts as is the incumbent of the final race, which a challenger must beat significantly to replace.
+//Configs with the same getEffectiveDesc run the same kernel, so only the first of them is tested. It need not catch
+//every equivalent pair, only never match configs whose kernels differ.
+//Configs in runOptions.knownFailures are skipped too, except for the reference.
 static bool testAllConfigs(
     bool stopOnReferenceImplFail,
     const vector<OpenCLTuneParams>& configsToTest,
     OpenCLTuneParams& currentConfig,
     OpenCLTuneParams referenceConfig,
+    const cl_context& context,
+    cl_command_queue& commandQueue,
+    const vector<cl_device_id>& deviceIdsToUse,
     ostream& out,
     bool verboseErrors,
     bool verboseTuner,
+    const string& stageName,
+    bool usesFP16Compute,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     double errorToleranceScale,
     std::function<string(const OpenCLTuneParams&)> getDesc,
-    std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)> testConfig,
+    std::function<string(const OpenCLTuneParams&)> getEffectiveDesc,
+    std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)> testConfig,
+    std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)> computeHostReference,
     double& bestKernelsPerSecondBuf
 ) {
     vector<OpenCLTuneParams> configs = configsToTest;
+    const string incumbentDesc = getEffectiveDesc(currentConfig);
 
     //Insert the reference configuration first
     configs.insert(configs.begin(), referenceConfig);
 
+    {
+        std::set<string> effectiveDescs;
+        vector<OpenCLTuneParams> uniqueConfigs;
+        for (const OpenCLTuneParams& cfg : configs) {
+            if (effectiveDescs.insert(getEffectiveDesc(cfg)).second)
+                uniqueConfigs.push_back(cfg);
+        }
+        if (uniqueConfigs.size() < configs.size())
+            out << "Skipping " << (configs.size() - uniqueConfigs.size()) << " configs equivalent to others" << endl;
+        configs = uniqueConfigs;
+    }
+
+    if (runOptions.knownFailures != nullptr && !runOptions.reprobeKnownFailures) {
+        vector<OpenCLTuneParams> untestedConfigs;
+        for (size_t i = 0; i < configs.size(); i++) {
+            if (i == 0 || runOptions.knownFailures->find(stageName, getEffectiveDesc(configs[i])) == nullptr)
+                untestedConfigs.push_back(configs[i]);
+        }
+        if (untestedConfigs.size() < configs.size())
+            out << "Skipping " << (configs.size() - untestedConfigs.size()) << " configs known to fail on this device and driver" << endl;
+        configs = untestedConfigs;
+    }
+
     double bestScore = 0.0;
     double bestKernelsPerSecond = 0.0;
+    double bestGFlops = 0.0;
+    double bestGBytesPerSecond = 0.0;
     int lastBestIdx = 0;
     bool anythingGoodYet = false;
     int numTested = 0;
     int numTestedRunnable = 0;
+    //For picking the finalists, 0 for configs that did not run
+    vector<double> rankScores(configs.size(), 0.0);
+    vector<double> scoreFactors(configs.size(), 0.0);
+
+    //The output of the reference stays on the device for every other config to be compared against
+    OpenCLOutputComparer comparer(context, deviceIdsToUse, commandQueue);
+    OpenCLTuneOutput referenceOutput;
 
-    vector<float> referenceRet;
-    vector<float> ret;
+    OpenCLTrace::Span stageSpan(runOptions.trace, stageName);
 
     out << "Testing " << configs.size() << " different configs" << endl;
     for (int i = 0; i < configs.size(); i++) {
-        OpenCLTuneAccums accums = testConfig(configs[i], ret);
+        OpenCLTrace::Span configSpan(runOptions.trace, stageName + " config " + to_string(i));
+        if (runOptions.knownFailures != nullptr)
+            runOptions.knownFailures->beginConfig(stageName, getEffectiveDesc(configs[i]));
+        OpenCLTuneOutput ret;
+        OpenCLTuneAccums accums = testConfig(configs[i], 1, ret);
+
+        OpenCLTuneLogRecord record;
+        record.stage = stageName;
+        record.index = i;
+        record.numConfigs = (int)configs.size();
+        record.isReference = i == 0;
+        record.params = readDescKeyValues(stageName, getDesc(configs[i]));
+        record.compileSeconds = accums.compileSeconds;
+        record.kernelSeconds = accums.kernelSeconds;
+        record.kernelWeights = accums.kernelWeights;
 
         numTested++;
-        if (accums.bad) {
+        //Every other config is compared against the first one that works, so check that one on the host first
+        string hostMismatch;
+        if (!accums.bad && !anythingGoodYet &&
+            !matchesHostReference(commandQueue, configs[i], ret, usesFP16Compute, computeHostReference, hostMismatch)) {
+            ret.release();
+            record.status = "wrong_output";
+            record.errorMessage = hostMismatch;
+            if (runOptions.log != nullptr)
+                runOptions.log->write(record);
+
+            out << "Tuning " << i << "/" << configs.size() << (i == 0 ? " (reference)" : "")
+                << " does not match the host reference implementation: " << hostMismatch << endl;
+        }
+        else if (accums.bad) {
+            ret.release();
+            record.status = accums.badErr == CL_BUILD_PROGRAM_FAILURE ? "compile_failed" : "failed";
+            record.errorCode = accums.badErr;
+            record.errorMessage = getErrorMessage(accums.badErr);
+            if (accums.detailedErrorMessage.size() > 0)
+                record.errorMessage += "\n" + accums.detailedErrorMessage;
+            if (runOptions.log != nullptr)
+                runOptions.log->write(record);
+            if (runOptions.knownFailures != nullptr && isPersistentFailure(accums.badErr)) {
+                //Only the first line of a build log, the rest is in the tuning log
+                string message = getErrorMessage(accums.badErr);
+                if (accums.detailedErrorMessage.size() > 0)
+                    message += ": " + Global::split(accums.detailedErrorMessage, '\n')[0];
+                runOptions.knownFailures->add(stageName, getEffectiveDesc(configs[i]), accums.badErr, message);
+            }
+
             if (verboseErrors) {
                 out << "Tuning " << i << "/" << configs.size() << " failed: " << getErrorMessage(accums.badErr) << endl;
                 if (accums.detailedErrorMessage.size() > 0)
                     out << accums.detailedErrorMessage << endl;
             }
             if (i == 0) {
-                if (stopOnReferenceImplFail)
+                if (stopOnReferenceImplFail) {
+                    if (runOptions.knownFailures != nullptr)
+                        runOptions.knownFailures->endConfig();
                     return false;
+                }
                 out << "WARNING: Reference implementation failed: " << getErrorMessage(accums.badErr) << endl;
             }
         }
         else {
+            if (runOptions.knownFailures != nullptr)
+                runOptions.knownFailures->remove(stageName, getEffectiveDesc(configs[i]));
             if (!anythingGoodYet) {
                 //Just use the first thing that worked as the reference
                 //Unless something has gone really weird, this should be the reference implementation
-                referenceRet = ret;
+                referenceOutput = ret;
                 anythingGoodYet = true;
             }
 
             numTestedRunnable++;
 
+            OpenCLTrace::Span compareSpan(runOptions.trace, "compare");
+            OpenCLOutputComparison comparison;
             double squerr = 0.0;
             double sqmag = 0.0;
-            if (referenceRet.size() != ret.size())
+            if (!comparer.compare(referenceOutput, ret, comparison) || comparison.numNonFinite > 0)
                 squerr = std::numeric_limits<double>::infinity();
             else {
-                for (int j = 0; j < referenceRet.size(); j++) {
-                    if (!isfinite(referenceRet[j]) || !isfinite(ret[j]))
-                        squerr = std::numeric_limits<double>::infinity();
-                    else {
-                        double diff = (double)referenceRet[j] - (double)ret[j];
-                        squerr += diff * diff;
-                        sqmag += (double)referenceRet[j] * (double)referenceRet[j];
-                    }
-                }
+                squerr = comparison.squaredError;
+                sqmag = comparison.squaredMagnitude;
             }
+            if (ret.buffer != referenceOutput.buffer)
+                ret.release();
+            compareSpan.end();
 
             double kernelsPerSecond = accums.weightCounted / accums.weightedTimeTaken;
             double errorProp = sqrt(squerr / (sqmag + 1e-30));
@@ -640,20 +1394,52 @@ static bool testAllConfigs(
                 errorProp = 1.0;
 
             double score = kernelsPerSecond * (1.0 - sqrt(errorProp / (errorProp + errorToleranceScale)));
-            if (verboseTuner || score > bestScore) {
+            //The fraction of its calls per second that the config is ranked by, which for deprioritized configs is a bit
+            //less than the fraction in its score
+            double scoreFactor = score / kernelsPerSecond * (accums.deprioritized ? 1.0 - DEPRIORITIZED_MARGIN : 1.0);
+            double rankScore = kernelsPerSecond * scoreFactor;
+            rankScores[i] = rankScore;
+            scoreFactors[i] = scoreFactor;
+            //A single sample, so a lucky one can win here, the final race sorts that out
+            bool isNewBest = rankScore > bestScore;
+
+            double gflops = accums.weightedFlops / accums.weightCounted * kernelsPerSecond * 1e-9;
+            double gbytesPerSecond = accums.weightedBytes / accums.weightCounted * kernelsPerSecond * 1e-9;
+
+            record.status = "ok";
+            record.callsPerSecond = kernelsPerSecond;
+            record.gflops = gflops;
+            record.gbytesPerSecond = gbytesPerSecond;
+            record.squaredError = squerr;
+            record.maxAbsError = comparison.maxAbsError;
+            record.numNonFinite = comparison.numNonFinite;
+            record.errorProp = errorProp;
+            record.score = score;
+            if (runOptions.log != nullptr)
+                runOptions.log->write(record);
+
+            if (verboseTuner || isNewBest) {
                 out << "Tuning " << i << "/" << configs.size()
                     << (i == 0 ? " (reference)" : "")
-                    << " Calls/sec " << kernelsPerSecond
+                    << " GFLOP/s " << gflops
+                    << " GB/s " << gbytesPerSecond
                     << " L2Error " << squerr
-                    << " " << getDesc(configs[i]) << endl;
+                    << " " << getDesc(configs[i]);
+                if (accums.deprioritized)
+                    out << " (deprioritized, " << accums.deprioritizedReason << ")";
+                out << endl;
             }
-            if (score > bestScore) {
+            if (isNewBest) {
                 bestKernelsPerSecond = kernelsPerSecond;
-                bestScore = score;
+                bestGFlops = gflops;
+                bestGBytesPerSecond = gbytesPerSecond;
+                bestScore = rankScore;
                 currentConfig = configs[i];
                 lastBestIdx = i;
             }
         }
+        if (runOptions.knownFailures != nullptr)
+            runOptions.knownFailures->endConfig();
         if (i % 20 == 0 && i >= lastBestIdx + 10)
             out << "Tuning " << i << "/" << configs.size() << " ..." << endl;
     }
@@ -662,26 +1448,265 @@ static bool testAllConfigs(
         return false;
     }
 
+    //Clocks and other load on the device drift over a stage, which can favor whichever config happened to run at a
+    //good time, and the sweep only took one sample of each, so its best may just have been lucky. So re-race the
+    //best finalists of the sweep in interleaved order with many more samples each, together with the incumbent, the
+    //config the stage started from. The incumbent is kept unless another finalist is significantly faster in the race.
+    int incumbentIdx = -1;
+    for (int i = 0; i < (int)configs.size(); i++) {
+        if (rankScores[i] > 0 && getEffectiveDesc(configs[i]) == incumbentDesc) {
+            incumbentIdx = i;
+            break;
+        }
+    }
+    vector<int> finalists;
+    if (incumbentIdx >= 0)
+        finalists.push_back(incumbentIdx);
+    {
+        vector<int> byRank;
+        for (int i = 0; i < (int)configs.size(); i++) {
+            if (rankScores[i] > 0 && i != incumbentIdx)
+                byRank.push_back(i);
+        }
+        std::sort(byRank.begin(), byRank.end(), [&](int a, int b) { return rankScores[a] > rankScores[b]; });
+        for (size_t i = 0; i < byRank.size() && finalists.size() < NUM_FINALISTS; i++)
+            finalists.push_back(byRank[i]);
+    }
+    if (finalists.size() >= 2) {
+        OpenCLTrace::Span raceSpan(runOptions.trace, stageName + " final race");
+        out << "Re-racing the best " << finalists.size() << " configs" << endl;
+        vector<vector<double>> raceSamples(finalists.size());
+        vector<double> flopsPerCall(finalists.size(), 0.0);
+        vector<double> bytesPerCall(finalists.size(), 0.0);
+        vector<bool> raceFailed(finalists.size(), false);
+        for (int pass = 0; pass < NUM_FINAL_RACE_PASSES; pass++) {
+            for (int f = 0; f < (int)finalists.size(); f++) {
+                if (raceFailed[f])
+                    continue;
+                const OpenCLTuneParams& cfg = configs[finalists[f]];
+                if (runOptions.knownFailures != nullptr)
+                    runOptions.knownFailures->beginConfig(stageName, getEffectiveDesc(cfg));
+                OpenCLTuneOutput ret;
+                OpenCLTuneAccums accums = testConfig(cfg, FINAL_RACE_ROUNDS, ret);
+                ret.release();
+                if (runOptions.knownFailures != nullptr)
+                    runOptions.knownFailures->endConfig();
+                if (accums.bad) {
+                    raceFailed[f] = true;
+                    continue;
+                }
+                vector<double> samples = accums.secondsPerCallSamples();
+                raceSamples[f].insert(raceSamples[f].end(), samples.begin(), samples.end());
+                flopsPerCall[f] = accums.weightedFlops / accums.weightCounted;
+                bytesPerCall[f] = accums.weightedBytes / accums.weightCounted;
+            }
+        }
+
+        vector<OpenCLTimingStats> raceTiming(finalists.size());
+        int fastest = -1;
+        for (int f = 0; f < (int)finalists.size(); f++) {
+            if (raceFailed[f]) {
+                out << "Final race " << f << " failed " << getDesc(configs[finalists[f]]) << endl;
+                continue;
+            }
+            raceTiming[f] = OpenCLTimingStats::compute(raceSamples[f]);
+            double kernelsPerSecond = 1.0 / raceTiming[f].trimmedMean;
+            out << "Final race " << f << (f == 0 && incumbentIdx >= 0 ? " (incumbent)" : "")
+                << " GFLOP/s " << (flopsPerCall[f] * kernelsPerSecond * 1e-9)
+                << " +/-" << (100.0 * raceTiming[f].confidence95() / raceTiming[f].trimmedMean) << "%"
+                << " median " << (flopsPerCall[f] / raceTiming[f].median * 1e-9)
+                << " " << getDesc(configs[finalists[f]]) << endl;
+            if (fastest < 0 || raceTiming[f].trimmedMean / scoreFactors[finalists[f]] < raceTiming[fastest].trimmedMean / scoreFactors[finalists[fastest]])
+                fastest = f;
+        }
+
+        //Every finalist has the same number of samples. Keep the incumbent unless it is beaten fairly, or failed this
+        //time. Without one, the fastest by trimmed mean wins.
+        int winner = fastest;
+        if (incumbentIdx >= 0 && !raceFailed[0] && fastest > 0 &&
+            !significantlyFaster(raceTiming[fastest], scoreFactors[finalists[fastest]], raceTiming[0], scoreFactors[finalists[0]]))
+            winner = 0;
+        if (winner >= 0) {
+            if (incumbentIdx >= 0 && winner != 0)
+                out << "Final race " << winner << " is significantly faster than the incumbent, using it instead" << endl;
+            currentConfig = configs[finalists[winner]];
+            bestKernelsPerSecond = 1.0 / raceTiming[winner].trimmedMean;
+            bestGFlops = flopsPerCall[winner] * bestKernelsPerSecond * 1e-9;
+            bestGBytesPerSecond = bytesPerCall[winner] * bestKernelsPerSecond * 1e-9;
+        }
+    }
+
+    //Attainable performance is limited either by compute or by memory bandwidth, depending on the flops per byte
+    double peakGFlops = usesFP16Compute ? runOptions.peaks.gflopsFP16 : runOptions.peaks.gflopsFP32;
+    double peakGBytesPerSecond = runOptions.peaks.gbytesPerSecond;
+    double flopsPerByte = bestGFlops / bestGBytesPerSecond;
+    out << "Best " << stageName << ": " << bestGFlops << " GFLOP/s " << bestGBytesPerSecond << " GB/s " << flopsPerByte << " FLOP/byte";
+    if (peakGFlops > 0 && peakGBytesPerSecond > 0) {
+        double rooflineGFlops = std::min(peakGFlops, flopsPerByte * peakGBytesPerSecond);
+        out << ", " << (100.0 * bestGFlops / rooflineGFlops) << "% of roofline "
+            << rooflineGFlops << " GFLOP/s (" << (flopsPerByte * peakGBytesPerSecond < peakGFlops ? "memory" : "compute") << " bound)";
+    }
+    out << endl;
+
+    referenceOutput.release();
+
     bestKernelsPerSecondBuf = bestKernelsPerSecond;
     return true;
 }
 
+//Checks a compiled kernel against the work group size it is launched with. Fails the config, the way launching it
+//would, if the kernel cannot run with that many work items or needs more local memory than the device has.
+//Deprioritizes it if it uses private memory, which drivers place in global memory once registers run out, or if the
+//work group size is not a multiple of the kernel's preferred multiple.
+static bool checkKernelResources(
+    cl_kernel kernel,
+    const vector<cl_device_id>& deviceIds,
+    int workGroupSize,
+    OpenCLTuneAccums& accums
+) {
+    for (cl_device_id deviceId : deviceIds) {
+        size_t kernelMaxWorkGroupSize;
+        cl_ulong kernelLocalMemSize;
+        cl_ulong kernelPrivateMemSize;
+        size_t preferredMultiple;
+        cl_ulong deviceLocalMemSize;
+        cl_int err;
+        err = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxWorkGroupSize, NULL); CHECK_ERR(err);
+        err = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &kernelLocalMemSize, NULL); CHECK_ERR(err);
+        err = clGetKernelWorkGroupInfo(kernel, deviceId, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(cl_ulong), &kernelPrivateMemSize, NULL); CHECK_ERR(err);
+        err = clGetKernelWorkGroupInfo(
+            kernel, deviceId, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &preferredMultiple, NULL
+        ); CHECK_ERR(err);
+        err = clGetDeviceInfo(deviceId, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &deviceLocalMemSize, NULL); CHECK_ERR(err);
+
+        if ((size_t)workGroupSize > kernelMaxWorkGroupSize) {
+            accums.bad = true;
+            accums.badErr = CL_INVALID_WORK_GROUP_SIZE;
+            accums.detailedErrorMessage =
+                "Work group size " + to_string(workGroupSize) + " exceeds the compiled kernel's maximum " + to_string(kernelMaxWorkGroupSize);
+            return false;
+        }
+        if (kernelLocalMemSize > deviceLocalMemSize) {
+            accums.bad = true;
+            accums.badErr = CL_OUT_OF_RESOURCES;
+            accums.detailedErrorMessage =
+                "Kernel uses " + to_string(kernelLocalMemSize) + " bytes of local memory, device has " + to_string(deviceLocalMemSize);
+            return false;
+        }
+        if (kernelPrivateMemSize > 0) {
+            accums.deprioritized = true;
+            accums.deprioritizedReason = "uses " + to_string(kernelPrivateMemSize) + " bytes of private memory";
+        }
+        else if (preferredMultiple > 1 && workGroupSize % preferredMultiple != 0) {
+            accums.deprioritized = true;
+            accums.deprioritizedReason =
+                "work group size " + to_string(workGroupSize) + " is not a multiple of " + to_string(preferredMultiple);
+        }
+    }
+    return true;
+}
+
+//Compiles a program for a candidate config. With programHeaders, headerSource is compiled as an embedded header for the
+//#include in sourceIncludingHeader, otherwise source, which starts with headerSource, is compiled whole.
+static bool tryCompileTunedProgram(
+    const string& name,
+    const cl_context& context,
+    const vector<cl_device_id>& deviceIds,
+    ProgramHeaders* programHeaders,
+    const string& source,
+    const string& headerName,
+    const string& headerSource,
+    const string& sourceIncludingHeader,
+    const string& options,
+    cl_program& buf,
+    string& errorMessage
+) {
+    if (programHeaders == nullptr)
+        return tryCompileProgram(name, context, deviceIds, source, options, buf, errorMessage);
+    return tryCompileProgramWithHeader(
+        name, context, deviceIds, *programHeaders, headerName, headerSource, sourceIncludingHeader, options, buf, errorMessage
+    );
+}
+
+//The XgemmBatched kernels of one xGemm config. With FIXED_SHAPE, each matrix shape gets its own program with the sizes
+//compiled in, otherwise one program serves every shape.
+struct OpenCLXGemmKernels {
+    OpenCLXGemmKernels(
+        const cl_context& c, const vector<cl_device_id>& d, ProgramHeaders* h, const OpenCLParams::XGemmParams& p, const string& o
+    )
+        : context(c), deviceIds(d), programHeaders(h), params(p), extraOptions(o), programs(), kernels()
+    {}
+    ~OpenCLXGemmKernels() {
+        for (auto iter = kernels.begin(); iter != kernels.end(); ++iter)
+            clReleaseKernel(iter->second);
+        for (cl_program program : programs)
+            clReleaseProgram(program);
+    }
+    OpenCLXGemmKernels(const OpenCLXGemmKernels&) = delete;
+    OpenCLXGemmKernels& operator=(const OpenCLXGemmKernels&) = delete;
+
+    //Compiles a program for the shape unless one already serves it. On failure returns false with the error,
+    //and the build log in errorMessageBuf if the program did not compile.
+    bool get(int M, int N, int K, cl_kernel& kernelBuf, cl_int& errBuf, string& errorMessageBuf) {
+        string options = params.compileOptions(M, N, K) + extraOptions;
+        auto iter = kernels.find(options);
+        if (iter != kernels.end()) {
+            kernelBuf = iter->second;
+            return true;
+        }
+        cl_program program;
+        bool compileSuc = tryCompileTunedProgram(
+            "xgemmProgram", context, deviceIds, programHeaders,
+            OpenCLKernels::xgemmBatched, OpenCLKernels::clblastCommonHeaderName, OpenCLKernels::clblastCommon, OpenCLKernels::xgemmBatchedIncludingCommon,
+            options, program, errorMessageBuf
+        );
+        if (!compileSuc) {
+            errBuf = CL_BUILD_PROGRAM_FAILURE;
+            return false;
+        }
+        programs.push_back(program);
+        cl_int err;
+        cl_kernel kernel = clCreateKernel(program, "XgemmBatched", &err);
+        if (err != 0) {
+            errBuf = err;
+            return false;
+        }
+        kernels[options] = kernel;
+        kernelBuf = kernel;
+        return true;
+    }
+
+private:
+    cl_context context;
+    vector<cl_device_id> deviceIds;
+    ProgramHeaders* programHeaders;
+    OpenCLParams::XGemmParams params;
+    string extraOptions;
+    vector<cl_program> programs;
+    //Keyed by compile options, so that shapes compiled the same way share a kernel
+    map<string, cl_kernel> kernels;
+};
+
 #define SETTER(field) std::function<void(OpenCLTuneParams&, int value)>([](OpenCLTuneParams& p, int value){ p.field = value; })
 #define ISVALID(field) std::function<bool(const OpenCLTuneParams&)>([](const OpenCLTuneParams& p){ return p.field.isValid(); })
 #define ISSIMPLE(field) std::function<bool(const OpenCLTuneParams&)>([](const OpenCLTuneParams& p){ return p.field.isSimple(); })
+#define SEEDCOPY(field) std::function<void(OpenCLTuneParams&, const OpenCLTuneParams&)>([](OpenCLTuneParams& p, const OpenCLTuneParams& seed){ p.field = seed.field; })
 
 static void tuneXGemmDirect(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     OpenCLTuner::ModelInfoForTuning modelInfo,
     bool full,
     ostream& out,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig
 ) {
     out << "------------------------------------------------------" << endl;
@@ -715,19 +1740,33 @@ static void tuneXGemmDirect(
     }
 
     filterConfigs(configs, ISVALID(xGemmDirect));
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.xGemmDirect.workGroupSize(); },
+        [](const OpenCLTuneParams& cfg) { return cfg.xGemmDirect.localMemBytes(false); },
+        out
+    );
     shuffleConfigs(configs);
 
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemmDirect.desc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        SEEDCOPY(xGemmDirect),
+        ISVALID(xGemmDirect),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
+
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.xGemmDirect.WGD = untunedConfig.xGemmDirect.WGD;
-    referenceConfig.xGemmDirect.MDIMCD = untunedConfig.xGemmDirect.MDIMCD;
-    referenceConfig.xGemmDirect.NDIMCD = untunedConfig.xGemmDirect.NDIMCD;
-    referenceConfig.xGemmDirect.MDIMAD = untunedConfig.xGemmDirect.MDIMAD;
-    referenceConfig.xGemmDirect.NDIMBD = untunedConfig.xGemmDirect.NDIMBD;
-    referenceConfig.xGemmDirect.KWID = untunedConfig.xGemmDirect.KWID;
-    referenceConfig.xGemmDirect.VWMD = untunedConfig.xGemmDirect.VWMD;
-    referenceConfig.xGemmDirect.VWND = untunedConfig.xGemmDirect.VWND;
-    referenceConfig.xGemmDirect.PADA = untunedConfig.xGemmDirect.PADA;
-    referenceConfig.xGemmDirect.PADB = untunedConfig.xGemmDirect.PADB;
+    referenceConfig.xGemmDirect.WGD = referenceBaseConfig.xGemmDirect.WGD;
+    referenceConfig.xGemmDirect.MDIMCD = referenceBaseConfig.xGemmDirect.MDIMCD;
+    referenceConfig.xGemmDirect.NDIMCD = referenceBaseConfig.xGemmDirect.NDIMCD;
+    referenceConfig.xGemmDirect.MDIMAD = referenceBaseConfig.xGemmDirect.MDIMAD;
+    referenceConfig.xGemmDirect.NDIMBD = referenceBaseConfig.xGemmDirect.NDIMBD;
+    referenceConfig.xGemmDirect.KWID = referenceBaseConfig.xGemmDirect.KWID;
+    referenceConfig.xGemmDirect.VWMD = referenceBaseConfig.xGemmDirect.VWMD;
+    referenceConfig.xGemmDirect.VWND = referenceBaseConfig.xGemmDirect.VWND;
+    referenceConfig.xGemmDirect.PADA = referenceBaseConfig.xGemmDirect.PADA;
+    referenceConfig.xGemmDirect.PADB = referenceBaseConfig.xGemmDirect.PADB;
     OpenCLTuneParams slightlyTunedConfig = referenceConfig;
     slightlyTunedConfig.xGemmDirect.MDIMCD = 8;
     slightlyTunedConfig.xGemmDirect.NDIMCD = 8;
@@ -740,22 +1779,31 @@ static void tuneXGemmDirect(
     configs.insert(configs.begin(), slightlyTunedConfig);
     configs.insert(configs.begin(), currentConfig);
 
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemmDirect.desc(); };
-
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
         cl_program program;
         string compileError;
-        bool compileSuc = tryCompileProgram(
-            "xgemmDirectProgram", context, deviceIdsToUse, OpenCLKernels::xgemmDirect,
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
+        bool compileSuc = tryCompileTunedProgram(
+            "xgemmDirectProgram", context, deviceIdsToUse, programHeaders,
+            OpenCLKernels::xgemmDirectStridedBatchedNN, OpenCLKernels::clblastCommonHeaderName, OpenCLKernels::clblastCommon,
+            OpenCLKernels::xgemmDirectStridedBatchedNNIncludingCommon,
             cfg.xGemmDirect.compileOptions() + " -DROUTINE_GEMMSTRIDEDBATCHED",
             program, compileError
         );
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
         if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
         cl_kernel kernel = clCreateKernel(program, "XgemmDirectStridedBatchedNN", &err);
         if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
+        if (!checkKernelResources(kernel, deviceIdsToUse, cfg.xGemmDirect.workGroupSize(), accums)) {
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return accums;
+        }
 
         int maxChannels = FEATURES1_NUM;
         maxChannels = std::max(FEATURES2_NUM, maxChannels);
@@ -764,12 +1812,15 @@ static void tuneXGemmDirect(
 
         int ioNumFloats = batchSize * nnXLen * nnYLen * maxChannels;
         int filterNumFloats = maxChannels * maxChannels;
-        cl_mem input = randomReadOnlyBufferFloat(6381147743675501234ULL/*tuneXGemmDirectInput*/, context, ioNumFloats, 1.0);
-        cl_mem filter = randomReadOnlyBufferFloat(1247869217574235315ULL/*tuneXGemmDirectFilter*/, context, filterNumFloats, 1.0 / sqrt(maxChannels));
-        cl_mem output = createReadWriteBufferFloat(context, ioNumFloats);
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input = randomReadOnlyBufferFloat(6381147743675501234ULL/*tuneXGemmDirectInput*/, bufferPool, commandQueue, ioNumFloats, 1.0);
+        PooledBuffer filter = randomReadOnlyBufferFloat(1247869217574235315ULL/*tuneXGemmDirectFilter*/, bufferPool, commandQueue, filterNumFloats, 1.0 / sqrt(maxChannels));
+        PooledBuffer output = acquireNaNFilledBufferFloat(bufferPool, commandQueue, ioNumFloats);
+        buffersSpan.end();
 
         const int reps = 4;
-        for (int i = 0; i < reps; i++) {
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
             int inChannels;
             int outChannels;
             double weight;
@@ -792,24 +1843,24 @@ static void tuneXGemmDirect(
                 cfg,
                 nnXLen * nnYLen, outChannels, inChannels,
                 inputStride, filterStride, outputStride,
-                input, filter, output,
+                input.get(), filter.get(), output.get(),
                 batchSize,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = 2.0 * nnXLen * nnYLen * outChannels * inChannels * batchSize;
+            double bytes = sizeof(float) * ((double)inputStride * batchSize + (double)inChannels * outChannels + (double)outputStride * batchSize);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(ioNumFloats, 0.0);
-        else
-            blockingReadBuffer(commandQueue, output, ioNumFloats, ret);
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseMemObject(input);
-        clReleaseMemObject(filter);
-        clReleaseMemObject(output);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::contiguous(std::move(output), false, ioNumFloats);
 
         clReleaseKernel(kernel);
         clReleaseProgram(program);
@@ -817,6 +1868,31 @@ static void tuneXGemmDirect(
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams&, vector<float>& expected) {
+        int maxChannels = FEATURES1_NUM;
+        maxChannels = std::max(FEATURES2_NUM, maxChannels);
+        maxChannels = std::max(modelInfo.trunkNumChannels, maxChannels);
+        maxChannels = std::max(MAX_MOVE_LABEL_NUM, maxChannels);
+
+        int ioNumFloats = batchSize * nnXLen * nnYLen * maxChannels;
+        int filterNumFloats = maxChannels * maxChannels;
+        vector<float> input = hostRandomValues(6381147743675501234ULL/*tuneXGemmDirectInput*/, ioNumFloats, 1.0, false);
+        vector<float> filter = hostRandomValues(1247869217574235315ULL/*tuneXGemmDirectFilter*/, filterNumFloats, 1.0 / sqrt(maxChannels), false);
+
+        int inChannels = modelInfo.trunkNumChannels;
+        int outChannels = MAX_MOVE_LABEL_NUM;
+        expected.resize((size_t)batchSize * nnXLen * nnYLen * outChannels);
+        OpenCLReference::stridedBatchedGemm_KM_KN_NM(
+            nnXLen * nnYLen, outChannels, inChannels,
+            input.data(), nnXLen * nnYLen * inChannels,
+            filter.data(), 0,
+            expected.data(), nnXLen * nnYLen * outChannels,
+            batchSize
+        );
+        return true;
+    };
+
     bool stopOnReferenceImplFail = false;
     double bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.05;
@@ -825,12 +1901,20 @@ static void tuneXGemmDirect(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        "xGemmDirect",
+        false,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
     tunedConfig = currentConfig;
@@ -838,10 +1922,12 @@ static void tuneXGemmDirect(
 
 static bool tuneXGemm(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     OpenCLTuner::ModelInfoForTuning modelInfo,
     bool full,
@@ -849,6 +1935,7 @@ static bool tuneXGemm(
     bool useFP16Storage,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig,
     double& bestKernelsPerSecond
 ) {
@@ -858,6 +1945,9 @@ static bool tuneXGemm(
     else
         out << "Tuning xGemm for convolutions" << endl;
 
+    //FIXED_SHAPE is only tried on the winner of the search below
+    currentConfig.xGemm.FIXED_SHAPE = 0;
+
     vector<OpenCLTuneParams> configs;
     configs.push_back(currentConfig);
     if (full) {
@@ -896,23 +1986,38 @@ static bool tuneXGemm(
         filterConfigs(configs, ISSIMPLE(xGemm));
     }
 
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.xGemm.workGroupSize(); },
+        [&](const OpenCLTuneParams& cfg) { return cfg.xGemm.localMemBytes(useFP16Storage); },
+        out
+    );
     shuffleConfigs(configs);
 
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm.desc(); };
+    auto getEffectiveDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm.effectiveDesc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        SEEDCOPY(xGemm),
+        ISVALID(xGemm),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
+
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.xGemm.MWG = untunedConfig.xGemm.MWG;
-    referenceConfig.xGemm.NWG = untunedConfig.xGemm.NWG;
-    referenceConfig.xGemm.KWG = untunedConfig.xGemm.KWG;
-    referenceConfig.xGemm.MDIMC = untunedConfig.xGemm.MDIMC;
-    referenceConfig.xGemm.NDIMC = untunedConfig.xGemm.NDIMC;
-    referenceConfig.xGemm.MDIMA = untunedConfig.xGemm.MDIMA;
-    referenceConfig.xGemm.NDIMB = untunedConfig.xGemm.NDIMB;
-    referenceConfig.xGemm.KWI = untunedConfig.xGemm.KWI;
-    referenceConfig.xGemm.VWM = untunedConfig.xGemm.VWM;
-    referenceConfig.xGemm.VWN = untunedConfig.xGemm.VWN;
-    referenceConfig.xGemm.STRM = untunedConfig.xGemm.STRM;
-    referenceConfig.xGemm.STRN = untunedConfig.xGemm.STRN;
-    referenceConfig.xGemm.SA = untunedConfig.xGemm.SA;
-    referenceConfig.xGemm.SB = untunedConfig.xGemm.SB;
+    referenceConfig.xGemm.MWG = referenceBaseConfig.xGemm.MWG;
+    referenceConfig.xGemm.NWG = referenceBaseConfig.xGemm.NWG;
+    referenceConfig.xGemm.KWG = referenceBaseConfig.xGemm.KWG;
+    referenceConfig.xGemm.MDIMC = referenceBaseConfig.xGemm.MDIMC;
+    referenceConfig.xGemm.NDIMC = referenceBaseConfig.xGemm.NDIMC;
+    referenceConfig.xGemm.MDIMA = referenceBaseConfig.xGemm.MDIMA;
+    referenceConfig.xGemm.NDIMB = referenceBaseConfig.xGemm.NDIMB;
+    referenceConfig.xGemm.KWI = referenceBaseConfig.xGemm.KWI;
+    referenceConfig.xGemm.VWM = referenceBaseConfig.xGemm.VWM;
+    referenceConfig.xGemm.VWN = referenceBaseConfig.xGemm.VWN;
+    referenceConfig.xGemm.STRM = referenceBaseConfig.xGemm.STRM;
+    referenceConfig.xGemm.STRN = referenceBaseConfig.xGemm.STRN;
+    referenceConfig.xGemm.SA = referenceBaseConfig.xGemm.SA;
+    referenceConfig.xGemm.SB = referenceBaseConfig.xGemm.SB;
 
     OpenCLTuneParams slightlyTunedConfig = referenceConfig;
     slightlyTunedConfig.xGemm.MDIMC = 8;
@@ -927,24 +2032,13 @@ static bool tuneXGemm(
     configs.insert(configs.begin(), slightlyTunedConfig2);
     configs.insert(configs.begin(), slightlyTunedConfig);
     configs.insert(configs.begin(), currentConfig);
+    for (OpenCLTuneParams& cfg : configs)
+        cfg.xGemm.FIXED_SHAPE = 0;
 
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm.desc(); };
-
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
-        cl_program program;
-        string compileError;
-        bool compileSuc = tryCompileProgram(
-            "xgemmProgram", context, deviceIdsToUse, OpenCLKernels::xgemm,
-            cfg.xGemm.compileOptions() + (useFP16Storage ? OpenCLKernels::fp16StorageDefine : ""),
-            program, compileError
-        );
-        if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
-        cl_kernel kernel = clCreateKernel(program, "XgemmBatched", &err);
-        if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
-
         int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
         int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
         int numTilesTotal = batchSize * numTilesX * numTilesY;
@@ -960,86 +2054,109 @@ static bool tuneXGemm(
         int maxOutChannelsPadded = roundUpToMultiple(maxChannels, cfg.xGemm.NWG);
         int maxInChannelsPadded = roundUpToMultiple(maxChannels, cfg.xGemm.KWG);
 
+        const int reps = 3;
+        //Weight 0 on first kernel call to warm up
+        const int repInChannels[reps] = { modelInfo.trunkNumChannels, modelInfo.trunkNumChannels, FEATURES1_NUM };
+        const int repOutChannels[reps] = { modelInfo.trunkNumChannels, modelInfo.trunkNumChannels, modelInfo.trunkNumChannels };
+        const double repWeights[reps] = { 0, 1, 0.02 };
+
+        //Compiled for every call before enqueueing any, since with FIXED_SHAPE the calls can need different programs
+        OpenCLXGemmKernels kernels(context, deviceIdsToUse, programHeaders, cfg.xGemm, useFP16Storage ? OpenCLKernels::fp16StorageDefine : "");
+        vector<cl_kernel> repKernels(reps);
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
+        for (int i = 0; i < reps; i++) {
+            int outChannelsPadded = roundUpToMultiple(repOutChannels[i], cfg.xGemm.NWG);
+            int inChannelsPadded = roundUpToMultiple(repInChannels[i], cfg.xGemm.KWG);
+            if (!kernels.get(numTilesTotalPadded, outChannelsPadded, inChannelsPadded, repKernels[i], err, accums.detailedErrorMessage)) {
+                accums.bad = true;
+                accums.badErr = err;
+                return accums;
+            }
+            if (!checkKernelResources(repKernels[i], deviceIdsToUse, cfg.xGemm.workGroupSize(), accums))
+                return accums;
+        }
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
+
         int outNumFloats = numTilesTotalPadded * maxOutChannelsPadded * inTileXYSize;
-        cl_mem input;
-        cl_mem filter;
-        cl_mem output;
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input;
+        PooledBuffer filter;
+        PooledBuffer output;
         if (useFP16Storage) {
             input = randomReadOnly3dPaddedBufferHalf(
-                4642632101795320974ULL/*tuneXGemm3x3Input*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
+                4642632101795320974ULL/*tuneXGemm3x3Input*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
             filter = randomReadOnly3dPaddedBufferHalf(
-                1602854403103414031ULL/*tuneXGemm3x3Filter*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
-            output = createReadWriteBufferHalf(context, outNumFloats);
+                1602854403103414031ULL/*tuneXGemm3x3Filter*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
+            output = acquireNaNFilledBufferHalf(bufferPool, commandQueue, outNumFloats);
         }
         else {
             input = randomReadOnly3dPaddedBufferFloat(
-                4642632101795320974ULL/*tuneXGemm3x3Input*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
+                4642632101795320974ULL/*tuneXGemm3x3Input*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
             filter = randomReadOnly3dPaddedBufferFloat(
-                1602854403103414031ULL/*tuneXGemm3x3Filter*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
-            output = createReadWriteBufferFloat(context, outNumFloats);
+                1602854403103414031ULL/*tuneXGemm3x3Filter*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
+            output = acquireNaNFilledBufferFloat(bufferPool, commandQueue, outNumFloats);
         }
+        buffersSpan.end();
 
-        const int reps = 3;
-        for (int i = 0; i < reps; i++) {
-            int inChannels;
-            int outChannels;
-            double weight;
-            switch (i) {
-                //Weight 0 on first kernel call to warm up
-            case 0: inChannels = modelInfo.trunkNumChannels; outChannels = modelInfo.trunkNumChannels; weight = 0; break;
-            case 1: inChannels = modelInfo.trunkNumChannels; outChannels = modelInfo.trunkNumChannels; weight = 1; break;
-            case 2: inChannels = FEATURES1_NUM; outChannels = modelInfo.trunkNumChannels; weight = 0.02; break;
-            }
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
+            int inChannels = repInChannels[i];
+            int outChannels = repOutChannels[i];
+            double weight = repWeights[i];
 
             int outChannelsPadded = roundUpToMultiple(outChannels, cfg.xGemm.NWG);
             int inChannelsPadded = roundUpToMultiple(inChannels, cfg.xGemm.KWG);
 
             cl_event event;
             err = doBatchedXGemm_KM_KN_NM(
-                kernel,
+                repKernels[i],
                 commandQueue,
                 cfg.xGemm,
                 numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
-                input, filter, output,
+                input.get(), filter.get(), output.get(),
                 inTileXYSize,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = 2.0 * numTilesTotal * outChannels * inChannels * inTileXYSize;
+            double bytes = (double)(useFP16Storage ? sizeof(half_t) : sizeof(float)) * inTileXYSize *
+                ((double)numTilesTotalPadded * inChannelsPadded + (double)outChannelsPadded * inChannelsPadded + (double)numTilesTotalPadded * outChannelsPadded);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(outNumFloats, 0.0);
-        else if (useFP16Storage)
-            blockingReadBufferHalfToFloat(commandQueue, output, outNumFloats, ret);
-        else
-            blockingReadBuffer(commandQueue, output, outNumFloats, ret);
-
-        //Compact ret down to only what we were supposed to get, without padding
-        {
-            int i = 0;
-            for (int n = 0; n < inTileXYSize; n++) {
-                for (int y = 0; y < maxChannels; y++) {
-                    for (int x = 0; x < numTilesTotal; x++) {
-                        ret[i++] = ret[x + numTilesTotalPadded * (y + maxOutChannelsPadded * n)];
-                    }
-                }
-            }
-            ret.resize(inTileXYSize * maxChannels * numTilesTotal);
-        }
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseMemObject(input);
-        clReleaseMemObject(filter);
-        clReleaseMemObject(output);
-
-        clReleaseKernel(kernel);
-        clReleaseProgram(program);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::strided(
+                std::move(output), useFP16Storage, numTilesTotal, maxChannels, inTileXYSize, numTilesTotalPadded, numTilesTotalPadded * maxOutChannelsPadded
+            );
 
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams& cfg, vector<float>& expected) {
+        int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
+        int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
+        int numTilesTotal = batchSize * numTilesX * numTilesY;
+        int inTileXYSize = cfg.conv3x3.INTILE_XSIZE * cfg.conv3x3.INTILE_YSIZE;
+        int maxChannels = std::max(modelInfo.trunkNumChannels, FEATURES1_NUM);
+        computeWinogradGemmHostReference(
+            4642632101795320974ULL/*tuneXGemm3x3Input*/, 1602854403103414031ULL/*tuneXGemm3x3Filter*/, useFP16Storage,
+            numTilesTotal, roundUpToMultiple(numTilesTotal, cfg.xGemm.MWG), inTileXYSize,
+            maxChannels, roundUpToMultiple(maxChannels, cfg.xGemm.KWG), roundUpToMultiple(maxChannels, cfg.xGemm.NWG),
+            roundUpToMultiple(FEATURES1_NUM, cfg.xGemm.KWG), roundUpToMultiple(modelInfo.trunkNumChannels, cfg.xGemm.NWG),
+            expected
+        );
+        return true;
+    };
+
     bool stopOnReferenceImplFail = useFP16Storage;
     bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.05;
@@ -1048,36 +2165,85 @@ static bool tuneXGemm(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        useFP16Storage ? "xGemmFP16Storage" : "xGemm",
+        false,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getEffectiveDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
+
+    //Then see whether compiling the best config separately for each matrix shape beats compiling it once. The generic
+    //config is the incumbent, so both get the same number of samples in the final race of testAllConfigs and
+    //FIXED_SHAPE is only kept if it is significantly faster there.
+    if (suc) {
+        OpenCLTuneParams fixedShapeConfig = currentConfig;
+        fixedShapeConfig.xGemm.FIXED_SHAPE = 1;
+        OpenCLTuneParams genericConfig = currentConfig;
+        double fixedShapeKernelsPerSecond = 0.0;
+        bool fixedShapeSuc = testAllConfigs(
+            false,
+            { fixedShapeConfig },
+            currentConfig,
+            genericConfig,
+            context,
+            commandQueue,
+            deviceIdsToUse,
+            out,
+            verboseErrors,
+            verboseTuner,
+            useFP16Storage ? "xGemmFP16StorageFixedShape" : "xGemmFixedShape",
+            false,
+            runOptions,
+            errorToleranceScale,
+            std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+            std::function<string(const OpenCLTuneParams& cfg)>(getEffectiveDesc),
+            std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+            std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
+            fixedShapeKernelsPerSecond
+        );
+        if (fixedShapeSuc && currentConfig.xGemm.FIXED_SHAPE == 1)
+            bestKernelsPerSecond = fixedShapeKernelsPerSecond;
+        else
+            currentConfig = genericConfig;
+    }
     tunedConfig = currentConfig;
     return suc;
 }
 
 static bool tuneXGemm16(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     OpenCLTuner::ModelInfoForTuning modelInfo,
     bool full,
     ostream& out,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig,
     double& bestKernelsPerSecond
 ) {
     out << "------------------------------------------------------" << endl;
     out << "Tuning xGemm16 for convolutions" << endl;
 
+    //FIXED_SHAPE is only tried on the winner of the search below
+    currentConfig.xGemm16.FIXED_SHAPE = 0;
+
     vector<OpenCLTuneParams> configs;
     configs.push_back(currentConfig);
     if (full) {
@@ -1116,23 +2282,38 @@ static bool tuneXGemm16(
         filterConfigs(configs, ISSIMPLE(xGemm16));
     }
 
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.xGemm16.workGroupSize(); },
+        [](const OpenCLTuneParams& cfg) { return cfg.xGemm16.localMemBytes(true); },
+        out
+    );
     shuffleConfigs(configs);
 
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm16.desc(); };
+    auto getEffectiveDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm16.effectiveDesc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        SEEDCOPY(xGemm16),
+        ISVALID(xGemm16),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
+
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.xGemm16.MWG = untunedConfig.xGemm16.MWG;
-    referenceConfig.xGemm16.NWG = untunedConfig.xGemm16.NWG;
-    referenceConfig.xGemm16.KWG = untunedConfig.xGemm16.KWG;
-    referenceConfig.xGemm16.MDIMC = untunedConfig.xGemm16.MDIMC;
-    referenceConfig.xGemm16.NDIMC = untunedConfig.xGemm16.NDIMC;
-    referenceConfig.xGemm16.MDIMA = untunedConfig.xGemm16.MDIMA;
-    referenceConfig.xGemm16.NDIMB = untunedConfig.xGemm16.NDIMB;
-    referenceConfig.xGemm16.KWI = untunedConfig.xGemm16.KWI;
-    referenceConfig.xGemm16.VWM = untunedConfig.xGemm16.VWM;
-    referenceConfig.xGemm16.VWN = untunedConfig.xGemm16.VWN;
-    referenceConfig.xGemm16.STRM = untunedConfig.xGemm16.STRM;
-    referenceConfig.xGemm16.STRN = untunedConfig.xGemm16.STRN;
-    referenceConfig.xGemm16.SA = untunedConfig.xGemm16.SA;
-    referenceConfig.xGemm16.SB = untunedConfig.xGemm16.SB;
+    referenceConfig.xGemm16.MWG = referenceBaseConfig.xGemm16.MWG;
+    referenceConfig.xGemm16.NWG = referenceBaseConfig.xGemm16.NWG;
+    referenceConfig.xGemm16.KWG = referenceBaseConfig.xGemm16.KWG;
+    referenceConfig.xGemm16.MDIMC = referenceBaseConfig.xGemm16.MDIMC;
+    referenceConfig.xGemm16.NDIMC = referenceBaseConfig.xGemm16.NDIMC;
+    referenceConfig.xGemm16.MDIMA = referenceBaseConfig.xGemm16.MDIMA;
+    referenceConfig.xGemm16.NDIMB = referenceBaseConfig.xGemm16.NDIMB;
+    referenceConfig.xGemm16.KWI = referenceBaseConfig.xGemm16.KWI;
+    referenceConfig.xGemm16.VWM = referenceBaseConfig.xGemm16.VWM;
+    referenceConfig.xGemm16.VWN = referenceBaseConfig.xGemm16.VWN;
+    referenceConfig.xGemm16.STRM = referenceBaseConfig.xGemm16.STRM;
+    referenceConfig.xGemm16.STRN = referenceBaseConfig.xGemm16.STRN;
+    referenceConfig.xGemm16.SA = referenceBaseConfig.xGemm16.SA;
+    referenceConfig.xGemm16.SB = referenceBaseConfig.xGemm16.SB;
 
     OpenCLTuneParams slightlyTunedConfig = referenceConfig;
     slightlyTunedConfig.xGemm16.MDIMC = 8;
@@ -1147,24 +2328,13 @@ static bool tuneXGemm16(
     configs.insert(configs.begin(), slightlyTunedConfig2);
     configs.insert(configs.begin(), slightlyTunedConfig);
     configs.insert(configs.begin(), currentConfig);
+    for (OpenCLTuneParams& cfg : configs)
+        cfg.xGemm16.FIXED_SHAPE = 0;
 
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.xGemm16.desc(); };
-
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
-        cl_program program;
-        string compileError;
-        bool compileSuc = tryCompileProgram(
-            "xgemmProgram", context, deviceIdsToUse, OpenCLKernels::xgemm,
-            cfg.xGemm16.compileOptions() + OpenCLKernels::fp16StorageDefine + OpenCLKernels::fp16ComputeDefine,
-            program, compileError
-        );
-        if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
-        cl_kernel kernel = clCreateKernel(program, "XgemmBatched", &err);
-        if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
-
         int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
         int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
         int numTilesTotal = batchSize * numTilesX * numTilesY;
@@ -1180,72 +2350,97 @@ static bool tuneXGemm16(
         int maxOutChannelsPadded = roundUpToMultiple(maxChannels, cfg.xGemm16.NWG);
         int maxInChannelsPadded = roundUpToMultiple(maxChannels, cfg.xGemm16.KWG);
 
-        int outNumFloats = numTilesTotalPadded * maxOutChannelsPadded * inTileXYSize;
-        cl_mem input = randomReadOnly3dPaddedBufferHalf(
-            4642632101795320974ULL/*tuneXGemm3x3Input*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
-        cl_mem filter = randomReadOnly3dPaddedBufferHalf(
-            1602854403103414031ULL/*tuneXGemm3x3Filter*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
-        cl_mem output = createReadWriteBufferHalf(context, outNumFloats);
-
         const int reps = 3;
+        //Weight 0 on first kernel call to warm up
+        const int repInChannels[reps] = { modelInfo.trunkNumChannels, modelInfo.trunkNumChannels, FEATURES1_NUM };
+        const int repOutChannels[reps] = { modelInfo.trunkNumChannels, modelInfo.trunkNumChannels, modelInfo.trunkNumChannels };
+        const double repWeights[reps] = { 0, 1, 0.02 };
+
+        //Compiled for every call before enqueueing any, since with FIXED_SHAPE the calls can need different programs
+        OpenCLXGemmKernels kernels(context, deviceIdsToUse, programHeaders, cfg.xGemm16, OpenCLKernels::fp16StorageDefine + OpenCLKernels::fp16ComputeDefine);
+        vector<cl_kernel> repKernels(reps);
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
         for (int i = 0; i < reps; i++) {
-            int inChannels;
-            int outChannels;
-            double weight;
-            switch (i) {
-                //Weight 0 on first kernel call to warm up
-            case 0: inChannels = modelInfo.trunkNumChannels; outChannels = modelInfo.trunkNumChannels; weight = 0; break;
-            case 1: inChannels = modelInfo.trunkNumChannels; outChannels = modelInfo.trunkNumChannels; weight = 1; break;
-            case 2: inChannels = FEATURES1_NUM;; outChannels = modelInfo.trunkNumChannels; weight = 0.02; break;
+            int outChannelsPadded = roundUpToMultiple(repOutChannels[i], cfg.xGemm16.NWG);
+            int inChannelsPadded = roundUpToMultiple(repInChannels[i], cfg.xGemm16.KWG);
+            if (!kernels.get(numTilesTotalPadded, outChannelsPadded, inChannelsPadded, repKernels[i], err, accums.detailedErrorMessage)) {
+                accums.bad = true;
+                accums.badErr = err;
+                return accums;
             }
+            if (!checkKernelResources(repKernels[i], deviceIdsToUse, cfg.xGemm16.workGroupSize(), accums))
+                return accums;
+        }
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
+
+        int outNumFloats = numTilesTotalPadded * maxOutChannelsPadded * inTileXYSize;
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input = randomReadOnly3dPaddedBufferHalf(
+            4642632101795320974ULL/*tuneXGemm3x3Input*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
+        PooledBuffer filter = randomReadOnly3dPaddedBufferHalf(
+            1602854403103414031ULL/*tuneXGemm3x3Filter*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
+        PooledBuffer output = acquireNaNFilledBufferHalf(bufferPool, commandQueue, outNumFloats);
+        buffersSpan.end();
+
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
+            int inChannels = repInChannels[i];
+            int outChannels = repOutChannels[i];
+            double weight = repWeights[i];
 
             int outChannelsPadded = roundUpToMultiple(outChannels, cfg.xGemm16.NWG);
             int inChannelsPadded = roundUpToMultiple(inChannels, cfg.xGemm16.KWG);
 
             cl_event event;
             err = doBatchedXGemm_KM_KN_NM(
-                kernel,
+                repKernels[i],
                 commandQueue,
                 cfg.xGemm16,
                 numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
-                input, filter, output,
+                input.get(), filter.get(), output.get(),
                 inTileXYSize,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = 2.0 * numTilesTotal * outChannels * inChannels * inTileXYSize;
+            double bytes = (double)sizeof(half_t) * inTileXYSize *
+                ((double)numTilesTotalPadded * inChannelsPadded + (double)outChannelsPadded * inChannelsPadded + (double)numTilesTotalPadded * outChannelsPadded);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(outNumFloats, 0.0);
-        else
-            blockingReadBufferHalfToFloat(commandQueue, output, outNumFloats, ret);
-
-        //Compact ret down to only what we were supposed to get, without padding
-        {
-            int i = 0;
-            for (int n = 0; n < inTileXYSize; n++) {
-                for (int y = 0; y < maxChannels; y++) {
-                    for (int x = 0; x < numTilesTotal; x++) {
-                        ret[i++] = ret[x + numTilesTotalPadded * (y + maxOutChannelsPadded * n)];
-                    }
-                }
-            }
-            ret.resize(inTileXYSize * maxChannels * numTilesTotal);
-        }
-
-        clReleaseMemObject(input);
-        clReleaseMemObject(filter);
-        clReleaseMemObject(output);
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseKernel(kernel);
-        clReleaseProgram(program);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::strided(
+                std::move(output), true, numTilesTotal, maxChannels, inTileXYSize, numTilesTotalPadded, numTilesTotalPadded * maxOutChannelsPadded
+            );
 
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams& cfg, vector<float>& expected) {
+        int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
+        int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
+        int numTilesTotal = batchSize * numTilesX * numTilesY;
+        int inTileXYSize = cfg.conv3x3.INTILE_XSIZE * cfg.conv3x3.INTILE_YSIZE;
+        int maxChannels = std::max(modelInfo.trunkNumChannels, FEATURES1_NUM);
+        computeWinogradGemmHostReference(
+            4642632101795320974ULL/*tuneXGemm3x3Input*/, 1602854403103414031ULL/*tuneXGemm3x3Filter*/, true,
+            numTilesTotal, roundUpToMultiple(numTilesTotal, cfg.xGemm16.MWG), inTileXYSize,
+            maxChannels, roundUpToMultiple(maxChannels, cfg.xGemm16.KWG), roundUpToMultiple(maxChannels, cfg.xGemm16.NWG),
+            roundUpToMultiple(FEATURES1_NUM, cfg.xGemm16.KWG), roundUpToMultiple(modelInfo.trunkNumChannels, cfg.xGemm16.NWG),
+            expected
+        );
+        return true;
+    };
+
     bool stopOnReferenceImplFail = true;
     bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.05;
@@ -1254,14 +2449,57 @@ static bool tuneXGemm16(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        "xGemm16",
+        true,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getEffectiveDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
+
+    //Then see whether compiling the best config separately for each matrix shape beats compiling it once. The generic
+    //config is the incumbent, so both get the same number of samples in the final race of testAllConfigs and
+    //FIXED_SHAPE is only kept if it is significantly faster there.
+    if (suc) {
+        OpenCLTuneParams fixedShapeConfig = currentConfig;
+        fixedShapeConfig.xGemm16.FIXED_SHAPE = 1;
+        OpenCLTuneParams genericConfig = currentConfig;
+        double fixedShapeKernelsPerSecond = 0.0;
+        bool fixedShapeSuc = testAllConfigs(
+            false,
+            { fixedShapeConfig },
+            currentConfig,
+            genericConfig,
+            context,
+            commandQueue,
+            deviceIdsToUse,
+            out,
+            verboseErrors,
+            verboseTuner,
+            "xGemm16FixedShape",
+            true,
+            runOptions,
+            errorToleranceScale,
+            std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+            std::function<string(const OpenCLTuneParams& cfg)>(getEffectiveDesc),
+            std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+            std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
+            fixedShapeKernelsPerSecond
+        );
+        if (fixedShapeSuc && currentConfig.xGemm16.FIXED_SHAPE == 1)
+            bestKernelsPerSecond = fixedShapeKernelsPerSecond;
+        else
+            currentConfig = genericConfig;
+    }
     if (suc) {
         tunedConfig = currentConfig;
     }
@@ -1271,16 +2509,19 @@ static bool tuneXGemm16(
 
 static bool tuneHGemmWmma(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     OpenCLTuner::ModelInfoForTuning modelInfo,
     bool full,
     ostream& out,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig,
     double& bestKernelsPerSecond
 ) {
@@ -1319,39 +2560,61 @@ static bool tuneHGemmWmma(
         filterConfigs(configs, ISSIMPLE(hGemmWmma));
     }
 
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.hGemmWmma.workGroupSize(); },
+        [](const OpenCLTuneParams& cfg) { return cfg.hGemmWmma.localMemBytes(); },
+        out
+    );
     shuffleConfigs(configs);
 
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.hGemmWmma.desc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        SEEDCOPY(hGemmWmma),
+        ISVALID(hGemmWmma),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
+
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.hGemmWmma.MWG = untunedConfig.hGemmWmma.MWG;
-    referenceConfig.hGemmWmma.NWG = untunedConfig.hGemmWmma.NWG;
-    referenceConfig.hGemmWmma.KWG = untunedConfig.hGemmWmma.KWG;
-    referenceConfig.hGemmWmma.MWAVE = untunedConfig.hGemmWmma.MWAVE;
-    referenceConfig.hGemmWmma.NWAVE = untunedConfig.hGemmWmma.NWAVE;
-    referenceConfig.hGemmWmma.MWARP = untunedConfig.hGemmWmma.MWARP;
-    referenceConfig.hGemmWmma.NWARP = untunedConfig.hGemmWmma.NWARP;
-    referenceConfig.hGemmWmma.VWM = untunedConfig.hGemmWmma.VWM;
-    referenceConfig.hGemmWmma.VWN = untunedConfig.hGemmWmma.VWN;
-    referenceConfig.hGemmWmma.SA = untunedConfig.hGemmWmma.SA;
-    referenceConfig.hGemmWmma.SB = untunedConfig.hGemmWmma.SB;
+    referenceConfig.hGemmWmma.MWG = referenceBaseConfig.hGemmWmma.MWG;
+    referenceConfig.hGemmWmma.NWG = referenceBaseConfig.hGemmWmma.NWG;
+    referenceConfig.hGemmWmma.KWG = referenceBaseConfig.hGemmWmma.KWG;
+    referenceConfig.hGemmWmma.MWAVE = referenceBaseConfig.hGemmWmma.MWAVE;
+    referenceConfig.hGemmWmma.NWAVE = referenceBaseConfig.hGemmWmma.NWAVE;
+    referenceConfig.hGemmWmma.MWARP = referenceBaseConfig.hGemmWmma.MWARP;
+    referenceConfig.hGemmWmma.NWARP = referenceBaseConfig.hGemmWmma.NWARP;
+    referenceConfig.hGemmWmma.VWM = referenceBaseConfig.hGemmWmma.VWM;
+    referenceConfig.hGemmWmma.VWN = referenceBaseConfig.hGemmWmma.VWN;
+    referenceConfig.hGemmWmma.SA = referenceBaseConfig.hGemmWmma.SA;
+    referenceConfig.hGemmWmma.SB = referenceBaseConfig.hGemmWmma.SB;
 
     configs.insert(configs.begin(), currentConfig);
 
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.hGemmWmma.desc(); };
-
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
         cl_program program;
         string compileError;
-        bool compileSuc = tryCompileProgram(
-            "hgemmWmmaProgram", context, deviceIdsToUse, OpenCLKernels::hgemmWmma,
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
+        bool compileSuc = tryCompileTunedProgram(
+            "hgemmWmmaProgram", context, deviceIdsToUse, programHeaders,
+            OpenCLKernels::hgemmWmma, OpenCLKernels::clblastCommonHeaderName, OpenCLKernels::clblastCommon, OpenCLKernels::hgemmWmmaIncludingCommon,
             cfg.hGemmWmma.compileOptions() + OpenCLKernels::fp16StorageDefine,
             program, compileError
         );
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
         if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
         cl_kernel kernel = clCreateKernel(program, "hgemmWmmaBatched", &err);
         if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
+        if (!checkKernelResources(kernel, deviceIdsToUse, cfg.hGemmWmma.workGroupSize(), accums)) {
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return accums;
+        }
 
         int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
         int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
@@ -1369,14 +2632,17 @@ static bool tuneHGemmWmma(
         int maxInChannelsPadded = roundUpToMultiple(maxChannels, cfg.hGemmWmma.KWG);
 
         int outNumFloats = numTilesTotalPadded * maxOutChannelsPadded * inTileXYSize;
-        cl_mem input = randomReadOnly3dPaddedBufferHalf(
-            7853736013337238298ULL/*tuneHGemmWmma3x3Input*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
-        cl_mem filter = randomReadOnly3dPaddedBufferHalf(
-            16554842652272687981ULL/*tuneHGemmWmma3x3Filter*/, context, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
-        cl_mem output = createReadWriteBufferHalf(context, outNumFloats);
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input = randomReadOnly3dPaddedBufferHalf(
+            7853736013337238298ULL/*tuneHGemmWmma3x3Input*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, numTilesTotal, numTilesTotalPadded, 1.0);
+        PooledBuffer filter = randomReadOnly3dPaddedBufferHalf(
+            16554842652272687981ULL/*tuneHGemmWmma3x3Filter*/, bufferPool, commandQueue, inTileXYSize, maxChannels, maxInChannelsPadded, maxChannels, maxOutChannelsPadded, 1.0 / sqrt(maxChannels * 3 * 3));
+        PooledBuffer output = acquireNaNFilledBufferHalf(bufferPool, commandQueue, outNumFloats);
+        buffersSpan.end();
 
         const int reps = 3;
-        for (int i = 0; i < reps; i++) {
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
             int inChannels;
             int outChannels;
             double weight;
@@ -1396,37 +2662,27 @@ static bool tuneHGemmWmma(
                 commandQueue,
                 cfg,
                 numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
-                input, filter, output,
+                input.get(), filter.get(), output.get(),
                 inTileXYSize,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = 2.0 * numTilesTotal * outChannels * inChannels * inTileXYSize;
+            double bytes = (double)sizeof(half_t) * inTileXYSize *
+                ((double)numTilesTotalPadded * inChannelsPadded + (double)outChannelsPadded * inChannelsPadded + (double)numTilesTotalPadded * outChannelsPadded);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(outNumFloats, 0.0);
-        else
-            blockingReadBufferHalfToFloat(commandQueue, output, outNumFloats, ret);
-
-        //Compact ret down to only what we were supposed to get, without padding
-        {
-            int i = 0;
-            for (int n = 0; n < inTileXYSize; n++) {
-                for (int y = 0; y < maxChannels; y++) {
-                    for (int x = 0; x < numTilesTotal; x++) {
-                        ret[i++] = ret[x + numTilesTotalPadded * (y + maxOutChannelsPadded * n)];
-                    }
-                }
-            }
-            ret.resize(inTileXYSize * maxChannels * numTilesTotal);
-        }
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseMemObject(input);
-        clReleaseMemObject(filter);
-        clReleaseMemObject(output);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::strided(
+                std::move(output), true, numTilesTotal, maxChannels, inTileXYSize, numTilesTotalPadded, numTilesTotalPadded * maxOutChannelsPadded
+            );
 
         clReleaseKernel(kernel);
         clReleaseProgram(program);
@@ -1434,6 +2690,23 @@ static bool tuneHGemmWmma(
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams& cfg, vector<float>& expected) {
+        int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
+        int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
+        int numTilesTotal = batchSize * numTilesX * numTilesY;
+        int inTileXYSize = cfg.conv3x3.INTILE_XSIZE * cfg.conv3x3.INTILE_YSIZE;
+        int maxChannels = std::max(modelInfo.trunkNumChannels, FEATURES1_NUM);
+        computeWinogradGemmHostReference(
+            7853736013337238298ULL/*tuneHGemmWmma3x3Input*/, 16554842652272687981ULL/*tuneHGemmWmma3x3Filter*/, true,
+            numTilesTotal, roundUpToMultiple(numTilesTotal, cfg.hGemmWmma.MWG), inTileXYSize,
+            maxChannels, roundUpToMultiple(maxChannels, cfg.hGemmWmma.KWG), roundUpToMultiple(maxChannels, cfg.hGemmWmma.NWG),
+            roundUpToMultiple(FEATURES1_NUM, cfg.hGemmWmma.KWG), roundUpToMultiple(modelInfo.trunkNumChannels, cfg.hGemmWmma.NWG),
+            expected
+        );
+        return true;
+    };
+
     bool stopOnReferenceImplFail = true;
     bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.02;
@@ -1442,12 +2715,20 @@ static bool tuneHGemmWmma(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        "hGemmWmma",
+        true,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
     if (suc) {
@@ -1458,10 +2739,12 @@ static bool tuneHGemmWmma(
 
 static void tuneTransform(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     int nnXLen,
     int nnYLen,
@@ -1471,6 +2754,7 @@ static void tuneTransform(
     const string& maybeFP16CompileOptions,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig
 ) {
     out << "------------------------------------------------------" << endl;
@@ -1488,29 +2772,54 @@ static void tuneTransform(
     }
 
     filterConfigs(configs, ISVALID(conv3x3));
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.transWorkGroupSize(); },
+        [](const OpenCLTuneParams&) { return 0; },
+        out
+    );
     shuffleConfigs(configs);
+
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.transDesc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        std::function<void(OpenCLTuneParams&, const OpenCLTuneParams&)>([](OpenCLTuneParams& p, const OpenCLTuneParams& seed){
+            p.conv3x3.transLocalSize0 = seed.conv3x3.transLocalSize0;
+            p.conv3x3.transLocalSize1 = seed.conv3x3.transLocalSize1;
+        }),
+        ISVALID(conv3x3),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
     configs.insert(configs.begin(), currentConfig);
 
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.conv3x3.transLocalSize0 = untunedConfig.conv3x3.transLocalSize0;
-    referenceConfig.conv3x3.transLocalSize1 = untunedConfig.conv3x3.transLocalSize1;
-
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.transDesc(); };
+    referenceConfig.conv3x3.transLocalSize0 = referenceBaseConfig.conv3x3.transLocalSize0;
+    referenceConfig.conv3x3.transLocalSize1 = referenceBaseConfig.conv3x3.transLocalSize1;
 
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
         cl_program program;
         string compileError;
-        bool compileSuc = tryCompileProgram(
-            "winogradConv3x3NCHWTransformProgram", context, deviceIdsToUse, OpenCLKernels::winogradTransformNCHW,
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
+        bool compileSuc = tryCompileTunedProgram(
+            "winogradConv3x3NCHWTransformProgram", context, deviceIdsToUse, programHeaders,
+            OpenCLKernels::winogradTransformNCHW, OpenCLKernels::commonHeaderName, OpenCLKernels::common, OpenCLKernels::winogradTransformNCHWIncludingCommon,
             cfg.conv3x3.compileOptions() + maybeFP16CompileOptions,
             program, compileError
         );
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
         if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
         cl_kernel kernel = clCreateKernel(program, "transform", &err);
         if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
+        if (!checkKernelResources(kernel, deviceIdsToUse, cfg.conv3x3.transWorkGroupSize(), accums)) {
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return accums;
+        }
 
         int convSize = 3;
         int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
@@ -1530,19 +2839,22 @@ static void tuneTransform(
         int inputNumFloats = batchSize * nnXLen * nnYLen * maxChannels;
         int outputNumFloats = roundUpToMultiple(numTilesTotal, mPaddingMult) * roundUpToMultiple(maxChannels, kPaddingMult) * inTileXSize * inTileYSize;
 
-        cl_mem input;
-        cl_mem output;
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input;
+        PooledBuffer output;
         if (cfg.shouldUseFP16Storage) {
-            input = randomReadOnlyBufferHalf(18303053403275884080ULL/*tune3x3TransInput*/, context, inputNumFloats, 1.0);
-            output = createReadWriteBufferHalf(context, outputNumFloats);
+            input = randomReadOnlyBufferHalf(18303053403275884080ULL/*tune3x3TransInput*/, bufferPool, commandQueue, inputNumFloats, 1.0);
+            output = acquireNaNFilledBufferHalf(bufferPool, commandQueue, outputNumFloats);
         }
         else {
-            input = randomReadOnlyBufferFloat(18303053403275884080ULL/*tune3x3TransInput*/, context, inputNumFloats, 1.0);
-            output = createReadWriteBufferFloat(context, outputNumFloats);
+            input = randomReadOnlyBufferFloat(18303053403275884080ULL/*tune3x3TransInput*/, bufferPool, commandQueue, inputNumFloats, 1.0);
+            output = acquireNaNFilledBufferFloat(bufferPool, commandQueue, outputNumFloats);
         }
+        buffersSpan.end();
 
         const int reps = 7;
-        for (int i = 0; i < reps; i++) {
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
             int inChannels;
             double weight;
             switch (i) {
@@ -1561,27 +2873,28 @@ static void tuneTransform(
                 kernel,
                 commandQueue,
                 cfg,
-                input, output,
+                input.get(), output.get(),
                 nnXLen, nnYLen,
                 batchSize, numTilesX, numTilesY, mPaddingMult,
                 inChannels, kPaddingMult,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = winogradTransformFlops(inTileXSize, inTileYSize) * numTilesTotal * inChannels;
+            double bytes = (double)(cfg.shouldUseFP16Storage ? sizeof(half_t) : sizeof(float)) *
+                ((double)batchSize * nnXLen * nnYLen * inChannels +
+                 (double)roundUpToMultiple(numTilesTotal, mPaddingMult) * roundUpToMultiple(inChannels, kPaddingMult) * inTileXSize * inTileYSize);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(outputNumFloats, 0.0);
-        else if (cfg.shouldUseFP16Storage)
-            blockingReadBufferHalfToFloat(commandQueue, output, outputNumFloats, ret);
-        else
-            blockingReadBuffer(commandQueue, output, outputNumFloats, ret);
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseMemObject(input);
-        clReleaseMemObject(output);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::contiguous(std::move(output), cfg.shouldUseFP16Storage, outputNumFloats);
 
         clReleaseKernel(kernel);
         clReleaseProgram(program);
@@ -1589,6 +2902,33 @@ static void tuneTransform(
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams& cfg, vector<float>& expected) {
+        int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
+        int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
+        int numTilesTotal = batchSize * numTilesX * numTilesY;
+
+        int maxChannels = modelInfo.maxConvChannels3x3;
+        maxChannels = std::max(modelInfo.trunkNumChannels, maxChannels);
+
+        int mPaddingMult = cfg.getXGemmMPaddingMult(cfg.shouldUseFP16Compute, cfg.shouldUseFP16TensorCores);
+        int kPaddingMult = cfg.getXGemmKPaddingMult(cfg.shouldUseFP16Compute, cfg.shouldUseFP16TensorCores);
+
+        int inputNumFloats = batchSize * nnXLen * nnYLen * maxChannels;
+        vector<float> input = hostRandomValues(18303053403275884080ULL/*tune3x3TransInput*/, inputNumFloats, 1.0, cfg.shouldUseFP16Storage);
+
+        int inChannels = FEATURES1_NUM;
+        int inChannelsPadded = roundUpToMultiple(inChannels, kPaddingMult);
+        int numTilesTotalPadded = roundUpToMultiple(numTilesTotal, mPaddingMult);
+        expected.resize((size_t)cfg.conv3x3.INTILE_XSIZE * cfg.conv3x3.INTILE_YSIZE * inChannelsPadded * numTilesTotalPadded);
+        return OpenCLReference::winogradTransform3x3(
+            input.data(), expected.data(),
+            batchSize, nnXLen, nnYLen,
+            cfg.conv3x3.INTILE_XSIZE, cfg.conv3x3.INTILE_YSIZE, cfg.conv3x3.OUTTILE_XSIZE, cfg.conv3x3.OUTTILE_YSIZE,
+            inChannels, inChannelsPadded, numTilesTotalPadded
+        );
+    };
+
     bool stopOnReferenceImplFail = false;
     double bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.05;
@@ -1597,12 +2937,20 @@ static void tuneTransform(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        "transform",
+        currentConfig.shouldUseFP16Compute,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
 
@@ -1611,10 +2959,12 @@ static void tuneTransform(
 
 static void tuneUntransform(
     OpenCLTuneParams currentConfig,
-    const OpenCLTuneParams& untunedConfig,
+    const OpenCLTuneParams& referenceBaseConfig,
     const cl_context& context,
     cl_command_queue& commandQueue,
     const vector<cl_device_id>& deviceIdsToUse,
+    BufferPool& bufferPool,
+    ProgramHeaders* programHeaders,
     int batchSize,
     int nnXLen,
     int nnYLen,
@@ -1624,6 +2974,7 @@ static void tuneUntransform(
     const string& maybeFP16CompileOptions,
     bool verboseErrors,
     bool verboseTuner,
+    const OpenCLTuner::TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig
 ) {
     out << "------------------------------------------------------" << endl;
@@ -1643,30 +2994,56 @@ static void tuneUntransform(
     }
 
     filterConfigs(configs, ISVALID(conv3x3));
+    filterConfigsByDeviceLimits(
+        configs, deviceIdsToUse,
+        [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.untransWorkGroupSize(); },
+        [](const OpenCLTuneParams&) { return 0; },
+        out
+    );
     shuffleConfigs(configs);
+
+    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.untransDesc(); };
+    prioritizeSeedConfigs(
+        configs, runOptions.seedConfigs, currentConfig,
+        std::function<void(OpenCLTuneParams&, const OpenCLTuneParams&)>([](OpenCLTuneParams& p, const OpenCLTuneParams& seed){
+            p.conv3x3.untransLocalSize0 = seed.conv3x3.untransLocalSize0;
+            p.conv3x3.untransLocalSize1 = seed.conv3x3.untransLocalSize1;
+            p.conv3x3.untransLocalSize2 = seed.conv3x3.untransLocalSize2;
+        }),
+        ISVALID(conv3x3),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc)
+    );
     configs.insert(configs.begin(), currentConfig);
 
     OpenCLTuneParams referenceConfig = currentConfig;
-    referenceConfig.conv3x3.untransLocalSize0 = untunedConfig.conv3x3.untransLocalSize0;
-    referenceConfig.conv3x3.untransLocalSize1 = untunedConfig.conv3x3.untransLocalSize1;
-    referenceConfig.conv3x3.untransLocalSize2 = untunedConfig.conv3x3.untransLocalSize2;
-
-    auto getDesc = [](const OpenCLTuneParams& cfg) { return cfg.conv3x3.untransDesc(); };
+    referenceConfig.conv3x3.untransLocalSize0 = referenceBaseConfig.conv3x3.untransLocalSize0;
+    referenceConfig.conv3x3.untransLocalSize1 = referenceBaseConfig.conv3x3.untransLocalSize1;
+    referenceConfig.conv3x3.untransLocalSize2 = referenceBaseConfig.conv3x3.untransLocalSize2;
 
-    auto test = [&](const OpenCLTuneParams& cfg, vector<float>& ret) {
-        OpenCLTuneAccums accums;
+    auto test = [&](const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret) {
+        OpenCLTuneAccums accums(runOptions);
 
         cl_int err;
         cl_program program;
         string compileError;
-        bool compileSuc = tryCompileProgram(
-            "winogradConv3x3NCHWUntransformProgram", context, deviceIdsToUse, OpenCLKernels::winogradUntransformNCHW,
+        OpenCLTrace::Span compileSpan(runOptions.trace, "compile");
+        auto compileStart = std::chrono::steady_clock::now();
+        bool compileSuc = tryCompileTunedProgram(
+            "winogradConv3x3NCHWUntransformProgram", context, deviceIdsToUse, programHeaders,
+            OpenCLKernels::winogradUntransformNCHW, OpenCLKernels::commonHeaderName, OpenCLKernels::common, OpenCLKernels::winogradUntransformNCHWIncludingCommon,
             cfg.conv3x3.compileOptions() + maybeFP16CompileOptions,
             program, compileError
         );
+        accums.compileSeconds = secondsSince(compileStart);
+        compileSpan.end();
         if (!compileSuc) { accums.bad = true; accums.detailedErrorMessage = compileError; accums.badErr = CL_BUILD_PROGRAM_FAILURE; return accums; }
         cl_kernel kernel = clCreateKernel(program, "untransform", &err);
         if (err != 0) { accums.bad = true; accums.badErr = err; return accums; }
+        if (!checkKernelResources(kernel, deviceIdsToUse, cfg.conv3x3.untransWorkGroupSize(), accums)) {
+            clReleaseKernel(kernel);
+            clReleaseProgram(program);
+            return accums;
+        }
 
         int convSize = 3;
         int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
@@ -1686,19 +3063,22 @@ static void tuneUntransform(
         int inputNumFloats = roundUpToMultiple(numTilesTotal, mPaddingMult) * roundUpToMultiple(maxChannels, nPaddingMult) * inTileXSize * inTileYSize;
         int outputNumFloats = batchSize * nnXLen * nnYLen * maxChannels;
 
-        cl_mem input;
-        cl_mem output;
+        OpenCLTrace::Span buffersSpan(runOptions.trace, "create buffers");
+        PooledBuffer input;
+        PooledBuffer output;
         if (cfg.shouldUseFP16Storage) {
-            input = randomReadOnlyBufferHalf(9094268440142369664ULL/*tune3x3UntransInput*/, context, inputNumFloats, 1.0);
-            output = createReadWriteBufferHalf(context, outputNumFloats);
+            input = randomReadOnlyBufferHalf(9094268440142369664ULL/*tune3x3UntransInput*/, bufferPool, commandQueue, inputNumFloats, 1.0);
+            output = acquireNaNFilledBufferHalf(bufferPool, commandQueue, outputNumFloats);
         }
         else {
-            input = randomReadOnlyBufferFloat(9094268440142369664ULL/*tune3x3UntransInput*/, context, inputNumFloats, 1.0);
-            output = createReadWriteBufferFloat(context, outputNumFloats);
+            input = randomReadOnlyBufferFloat(9094268440142369664ULL/*tune3x3UntransInput*/, bufferPool, commandQueue, inputNumFloats, 1.0);
+            output = acquireNaNFilledBufferFloat(bufferPool, commandQueue, outputNumFloats);
         }
+        buffersSpan.end();
 
         const int reps = 7;
-        for (int i = 0; i < reps; i++) {
+        for (int call = 0; call < numRounds * reps; call++) {
+            int i = call % reps;
             int outChannels;
             double weight;
             switch (i) {
@@ -1717,27 +3097,28 @@ static void tuneUntransform(
                 kernel,
                 commandQueue,
                 cfg,
-                input, output,
+                input.get(), output.get(),
                 nnXLen, nnYLen,
                 batchSize, numTilesX, numTilesY, mPaddingMult,
                 outChannels, nPaddingMult,
+                0, NULL,
                 &event
             );
 
-            accums.countResultAndFreeEvent(err, event, weight);
+            double flops = winogradUntransformFlops(inTileXSize, inTileYSize, cfg.conv3x3.OUTTILE_XSIZE, cfg.conv3x3.OUTTILE_YSIZE) * numTilesTotal * outChannels;
+            double bytes = (double)(cfg.shouldUseFP16Storage ? sizeof(half_t) : sizeof(float)) *
+                ((double)roundUpToMultiple(numTilesTotal, mPaddingMult) * roundUpToMultiple(outChannels, nPaddingMult) * inTileXSize * inTileYSize +
+                 (double)batchSize * nnXLen * nnYLen * outChannels);
+            accums.addEnqueued(err, event, call / reps, weight, flops, bytes);
             if (accums.bad)
                 break;
         }
 
-        if (accums.bad)
-            ret.assign(outputNumFloats, 0.0);
-        else if (cfg.shouldUseFP16Storage)
-            blockingReadBufferHalfToFloat(commandQueue, output, outputNumFloats, ret);
-        else
-            blockingReadBuffer(commandQueue, output, outputNumFloats, ret);
+        accums.finishAndCountResults(commandQueue);
 
-        clReleaseMemObject(input);
-        clReleaseMemObject(output);
+        //The output stays on the device to be compared against the reference
+        if (!accums.bad)
+            ret = OpenCLTuneOutput::contiguous(std::move(output), cfg.shouldUseFP16Storage, outputNumFloats);
 
         clReleaseKernel(kernel);
         clReleaseProgram(program);
@@ -1745,6 +3126,31 @@ static void tuneUntransform(
         return accums;
     };
 
+    //What the last call in test leaves at the start of the output
+    auto hostReference = [&](const OpenCLTuneParams& cfg, vector<float>& expected) {
+        int numTilesX = (nnXLen + cfg.conv3x3.OUTTILE_XSIZE - 1) / cfg.conv3x3.OUTTILE_XSIZE;
+        int numTilesY = (nnYLen + cfg.conv3x3.OUTTILE_YSIZE - 1) / cfg.conv3x3.OUTTILE_YSIZE;
+        int numTilesTotal = batchSize * numTilesX * numTilesY;
+
+        int maxChannels = FEATURES1_NUM;
+        maxChannels = std::max(modelInfo.trunkNumChannels, maxChannels);
+
+        int mPaddingMult = cfg.getXGemmMPaddingMult(cfg.shouldUseFP16Compute, cfg.shouldUseFP16TensorCores);
+        int nPaddingMult = cfg.getXGemmNPaddingMult(cfg.shouldUseFP16Compute, cfg.shouldUseFP16TensorCores);
+
+        int inputNumFloats = roundUpToMultiple(numTilesTotal, mPaddingMult) * roundUpToMultiple(maxChannels, nPaddingMult) * cfg.conv3x3.INTILE_XSIZE * cfg.conv3x3.INTILE_YSIZE;
+        vector<float> input = hostRandomValues(9094268440142369664ULL/*tune3x3UntransInput*/, inputNumFloats, 1.0, cfg.shouldUseFP16Storage);
+
+        int outChannels = FEATURES1_NUM;
+        expected.resize((size_t)batchSize * outChannels * nnXLen * nnYLen);
+        return OpenCLReference::winogradUntransform3x3(
+            input.data(), expected.data(),
+            batchSize, nnXLen, nnYLen,
+            cfg.conv3x3.INTILE_XSIZE, cfg.conv3x3.INTILE_YSIZE, cfg.conv3x3.OUTTILE_XSIZE, cfg.conv3x3.OUTTILE_YSIZE,
+            outChannels, roundUpToMultiple(outChannels, nPaddingMult), roundUpToMultiple(numTilesTotal, mPaddingMult)
+        );
+    };
+
     bool stopOnReferenceImplFail = false;
     double bestKernelsPerSecond = 0.0;
     double errorToleranceScale = 0.05;
@@ -1753,12 +3159,20 @@ static void tuneUntransform(
         configs,
         currentConfig,
         referenceConfig,
+        context,
+        commandQueue,
+        deviceIdsToUse,
         out,
         verboseErrors,
         verboseTuner,
+        "untransform",
+        currentConfig.shouldUseFP16Compute,
+        runOptions,
         errorToleranceScale,
         std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
-        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, vector<float>& ret)>(test),
+        std::function<string(const OpenCLTuneParams& cfg)>(getDesc),
+        std::function<OpenCLTuneAccums(const OpenCLTuneParams& cfg, int numRounds, OpenCLTuneOutput& ret)>(test),
+        std::function<bool(const OpenCLTuneParams& cfg, vector<float>& expected)>(hostReference),
         bestKernelsPerSecond
     );
 
@@ -1780,6 +3194,7 @@ void OpenCLTuner::tune(
     ostream& out,
     bool verboseErrors,
     bool verboseTuner,
+    const TuneRunOptions& runOptions,
     OpenCLTuneParams& tunedConfig
 ) {
     const InitializedDevice* device = devicesContext.findGpuExn(gpuIdx);
@@ -1788,6 +3203,8 @@ void OpenCLTuner::tune(
     const vector<cl_device_id>& deviceIdsToUse = { device->info.deviceId };
 
     out << "Beginning GPU tuning for " << device->info.name << " channels " << modelInfo.trunkNumChannels << endl;
+    if (device->info.hostUnifiedMemory)
+        out << "Device shares memory with the host, buffers will be allocated in host accessible memory" << endl;
 
     OpenCLTuneParams untunedConfig = OpenCLTuneParams();
     OpenCLTuneParams currentConfig = initialConfig;
@@ -1820,20 +3237,28 @@ void OpenCLTuner::tune(
         currentConfig = untunedConfig;
     }
 
+    //A valid initial config is normally the result of a previous tuning run on this device, so it is both a
+    //good starting point and a known-working reference to compare the error of every other config against.
+    //Without one, this is just the untuned config.
+    const OpenCLTuneParams referenceBaseConfig = currentConfig;
+
     {
         OpenCLTuneParams result;
         tuneXGemmDirect(
             currentConfig,
-            untunedConfig,
+            referenceBaseConfig,
             context,
             commandQueue,
             deviceIdsToUse,
+            *device->bufferPool,
+            device->programHeaders,
             batchSize,
             modelInfo,
             full,
             out,
             verboseErrors,
             verboseTuner,
+            runOptions,
             result
         );
         currentConfig = result;
@@ -1845,10 +3270,12 @@ void OpenCLTuner::tune(
         double bestKernelsPerSecond = 0.0;
         tuneXGemm(
             currentConfig,
-            untunedConfig,
+            referenceBaseConfig,
             context,
             commandQueue,
             deviceIdsToUse,
+            *device->bufferPool,
+            device->programHeaders,
             batchSize,
             modelInfo,
             full,
@@ -1856,6 +3283,7 @@ void OpenCLTuner::tune(
             useFP16Storage,
             verboseErrors,
             verboseTuner,
+            runOptions,
             result,
             bestKernelsPerSecond
         );
@@ -1886,16 +3314,19 @@ void OpenCLTuner::tune(
                 double bestKernelsPerSecond16 = 0.0;
                 bool suc = tuneHGemmWmma(
                     currentConfig,
-                    untunedConfig,
+                    referenceBaseConfig,
                     context,
                     commandQueue,
                     deviceIdsToUse,
+                    *device->bufferPool,
+                    device->programHeaders,
                     batchSize,
                     modelInfo,
                     full,
                     out,
                     verboseErrors,
                     verboseTuner,
+                    runOptions,
                     result16,
                     bestKernelsPerSecond16
                 );
@@ -1922,16 +3353,19 @@ void OpenCLTuner::tune(
                 double bestKernelsPerSecond16 = 0.0;
                 bool suc = tuneXGemm16(
                     currentConfig,
-                    untunedConfig,
+                    referenceBaseConfig,
                     context,
                     commandQueue,
                     deviceIdsToUse,
+                    *device->bufferPool,
+                    device->programHeaders,
                     batchSize,
                     modelInfo,
                     full,
                     out,
                     verboseErrors,
                     verboseTuner,
+                    runOptions,
                     result16,
                     bestKernelsPerSecond16
                 );
@@ -1967,10 +3401,12 @@ void OpenCLTuner::tune(
                 double bestKernelsPerSecond16 = 0.0;
                 bool suc = tuneXGemm(
                     currentConfig,
-                    untunedConfig,
+                    referenceBaseConfig,
                     context,
                     commandQueue,
                     deviceIdsToUse,
+                    *device->bufferPool,
+                    device->programHeaders,
                     batchSize,
                     modelInfo,
                     full,
@@ -1978,6 +3414,7 @@ void OpenCLTuner::tune(
                     useFP16Storage16,
                     verboseErrors,
                     verboseTuner,
+                    runOptions,
                     result16,
                     bestKernelsPerSecond16
                 );
@@ -2026,10 +3463,12 @@ void OpenCLTuner::tune(
         OpenCLTuneParams result;
         tuneTransform(
             currentConfig,
-            untunedConfig,
+            referenceBaseConfig,
             context,
             commandQueue,
             deviceIdsToUse,
+            *device->bufferPool,
+            device->programHeaders,
             batchSize,
             nnXLen,
             nnYLen,
@@ -2039,6 +3478,7 @@ void OpenCLTuner::tune(
             maybeFP16CompileOptions,
             verboseErrors,
             verboseTuner,
+            runOptions,
             result
         );
         currentConfig = result;
@@ -2048,10 +3488,12 @@ void OpenCLTuner::tune(
         OpenCLTuneParams result;
         tuneUntransform(
             currentConfig,
-            untunedConfig,
+            referenceBaseConfig,
             context,
             commandQueue,
             deviceIdsToUse,
+            *device->bufferPool,
+            device->programHeaders,
             batchSize,
             nnXLen,
             nnYLen,
@@ -2061,12 +3503,410 @@ void OpenCLTuner::tune(
             maybeFP16CompileOptions,
             verboseErrors,
             verboseTuner,
+            runOptions,
             result
         );
         currentConfig = result;
     }
 
+    const BufferPool& bufferPool = *device->bufferPool;
+    out << "Peak device memory for tuning buffers: " << (bufferPool.peakBytesAllocated() / 1048576.0) << " MB, "
+        << bufferPool.numDriverAllocations() << " allocations for " << bufferPool.numAcquires() << " buffers used" << endl;
     out << "Done tuning" << endl;
     out << "------------------------------------------------------" << endl;
     tunedConfig = currentConfig;
 }
+
+vector<double> OpenCLTuner::measureConcurrentStreams(
+    const OpenCLTuneParams& config,
+    DevicesContext& devicesContext,
+    int gpuIdx,
+    int batchSize,
+    OpenCLTuner::ModelInfoForTuning modelInfo,
+    int maxNumStreams,
+    ostream& out
+) {
+    const InitializedDevice* device = devicesContext.findGpuExn(gpuIdx);
+    const vector<cl_device_id> deviceIds = { device->info.deviceId };
+    BufferPool& bufferPool = *device->bufferPool;
+
+    out << "------------------------------------------------------" << endl;
+    out << "Measuring concurrent streams on " << device->info.name << " with " << device->queuePool->numQueues() << " compute queues" << endl;
+
+    int numTilesX = (nnXLen + config.conv3x3.OUTTILE_XSIZE - 1) / config.conv3x3.OUTTILE_XSIZE;
+    int numTilesY = (nnYLen + config.conv3x3.OUTTILE_YSIZE - 1) / config.conv3x3.OUTTILE_YSIZE;
+    int numTilesTotal = batchSize * numTilesX * numTilesY;
+    int inTileXYSize = config.conv3x3.INTILE_XSIZE * config.conv3x3.INTILE_YSIZE;
+    int channels = modelInfo.trunkNumChannels;
+    int numTilesTotalPadded = roundUpToMultiple(numTilesTotal, config.xGemm.MWG);
+    int outChannelsPadded = roundUpToMultiple(channels, config.xGemm.NWG);
+    int inChannelsPadded = roundUpToMultiple(channels, config.xGemm.KWG);
+
+    bool useFP16Storage = config.shouldUseFP16Storage;
+    cl_program program = compileProgram(
+        "xgemmProgram", device->context, deviceIds, OpenCLKernels::xgemmBatched,
+        config.xGemm.compileOptions(numTilesTotalPadded, outChannelsPadded, inChannelsPadded) + (useFP16Storage ? OpenCLKernels::fp16StorageDefine : "")
+    );
+
+    //Everything a stream needs is set up before timing, so that threads only enqueue and wait
+    struct Stream {
+        CommandQueueLease queue;
+        cl_kernel kernel;
+        PooledBuffer input;
+        PooledBuffer filter;
+        PooledBuffer output;
+        Stream(CommandQueuePool* pool) : queue(pool), kernel(nullptr), input(), filter(), output() {}
+    };
+
+    const int callsPerStream = 20;
+    vector<double> callsPerSecond;
+    for (int numStreams = 1; numStreams <= maxNumStreams; numStreams++) {
+        vector<Stream> streams;
+        streams.reserve(numStreams);
+        for (int s = 0; s < numStreams; s++) {
+            streams.emplace_back(device->queuePool);
+            Stream& stream = streams.back();
+            cl_int err;
+            //Kernel args are set per enqueue, so each thread needs its own kernel object
+            stream.kernel = clCreateKernel(program, "XgemmBatched", &err); CHECK_ERR(err);
+            size_t inputNumElts = (size_t)inTileXYSize * numTilesTotalPadded * inChannelsPadded;
+            size_t filterNumElts = (size_t)inTileXYSize * outChannelsPadded * inChannelsPadded;
+            size_t outputNumElts = (size_t)inTileXYSize * numTilesTotalPadded * outChannelsPadded;
+            if (useFP16Storage) {
+                stream.input = randomReadOnlyBufferHalf(4642632101795320974ULL/*tuneXGemm3x3Input*/, bufferPool, stream.queue.get(), (int)inputNumElts, 1.0);
+                stream.filter = randomReadOnlyBufferHalf(1602854403103414031ULL/*tuneXGemm3x3Filter*/, bufferPool, stream.queue.get(), (int)filterNumElts, 1.0 / sqrt(channels * 3 * 3));
+                stream.output = acquireReadWriteBufferHalf(bufferPool, outputNumElts);
+            }
+            else {
+                stream.input = randomReadOnlyBufferFloat(4642632101795320974ULL/*tuneXGemm3x3Input*/, bufferPool, stream.queue.get(), (int)inputNumElts, 1.0);
+                stream.filter = randomReadOnlyBufferFloat(1602854403103414031ULL/*tuneXGemm3x3Filter*/, bufferPool, stream.queue.get(), (int)filterNumElts, 1.0 / sqrt(channels * 3 * 3));
+                stream.output = acquireReadWriteBufferFloat(bufferPool, outputNumElts);
+            }
+        }
+
+        auto runStream = [&](Stream& stream, int numCalls) {
+            for (int i = 0; i < numCalls; i++) {
+                cl_int err = doBatchedXGemm_KM_KN_NM(
+                    stream.kernel,
+                    stream.queue.get(),
+                    config.xGemm,
+                    numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
+                    stream.input.get(), stream.filter.get(), stream.output.get(),
+                    inTileXYSize,
+                    0, NULL,
+                    NULL
+                );
+                CHECK_ERR(err);
+            }
+            cl_int err = clFinish(stream.queue.get()); CHECK_ERR(err);
+        };
+
+        //Warm up every stream
+        for (Stream& stream : streams)
+            runStream(stream, 1);
+
+        //Errors are passed back to this thread rather than terminating from inside a worker
+        vector<std::exception_ptr> errors(numStreams);
+        auto start = std::chrono::steady_clock::now();
+        vector<std::thread> threads;
+        for (int s = 0; s < numStreams; s++) {
+            threads.push_back(std::thread([&, s]() {
+                try {
+                    runStream(streams[s], callsPerStream);
+                }
+                catch (...) {
+                    errors[s] = std::current_exception();
+                }
+            }));
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        double seconds = secondsSince(start);
+
+        for (Stream& stream : streams)
+            clReleaseKernel(stream.kernel);
+        for (const std::exception_ptr& error : errors) {
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        callsPerSecond.push_back(numStreams * callsPerStream / seconds);
+        out << numStreams << " streams: " << callsPerSecond.back() << " calls/s, "
+            << (callsPerSecond.back() / callsPerSecond[0]) << "x one stream" << endl;
+    }
+
+    clReleaseProgram(program);
+    return callsPerSecond;
+}
+
+//Relative L2 distance of actual from expected, infinite if actual has any non-finite value
+static double relativeL2Error(const vector<float>& expected, const vector<float>& actual) {
+    double squerr = 0.0;
+    double sqmag = 0.0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (!isfinite(actual[i]))
+            return std::numeric_limits<double>::infinity();
+        double diff = (double)expected[i] - (double)actual[i];
+        squerr += diff * diff;
+        sqmag += (double)expected[i] * (double)expected[i];
+    }
+    return sqrt(squerr / (sqmag + 1e-30));
+}
+
+bool OpenCLTuner::checkConvolutionChain(
+    const OpenCLTuneParams& config,
+    DevicesContext& devicesContext,
+    int gpuIdx,
+    int batchSize,
+    OpenCLTuner::ModelInfoForTuning modelInfo,
+    ostream& out
+) {
+    const InitializedDevice* device = devicesContext.findGpuExn(gpuIdx);
+    const vector<cl_device_id> deviceIds = { device->info.deviceId };
+    BufferPool& bufferPool = *device->bufferPool;
+    cl_command_queue commandQueue = device->commandQueue;
+
+    out << "------------------------------------------------------" << endl;
+    out << "Checking the tuned kernels together as a 3x3 convolution" << endl;
+
+    const int numHalves = 2;
+    int halfBatchSize = std::max(1, batchSize / numHalves);
+    int channels = modelInfo.trunkNumChannels;
+    int numTilesX = (nnXLen + config.conv3x3.OUTTILE_XSIZE - 1) / config.conv3x3.OUTTILE_XSIZE;
+    int numTilesY = (nnYLen + config.conv3x3.OUTTILE_YSIZE - 1) / config.conv3x3.OUTTILE_YSIZE;
+    int numTilesTotal = halfBatchSize * numTilesX * numTilesY;
+    int inTileXYSize = config.conv3x3.INTILE_XSIZE * config.conv3x3.INTILE_YSIZE;
+
+    //In FP32, with the matrix multiply of the xGemm stage
+    int mPaddingMult = config.getXGemmMPaddingMult(false, false);
+    int nPaddingMult = config.getXGemmNPaddingMult(false, false);
+    int kPaddingMult = config.getXGemmKPaddingMult(false, false);
+    int numTilesTotalPadded = roundUpToMultiple(numTilesTotal, mPaddingMult);
+    int outChannelsPadded = roundUpToMultiple(channels, nPaddingMult);
+    int inChannelsPadded = roundUpToMultiple(channels, kPaddingMult);
+
+    cl_int err;
+    cl_program transformProgram = compileProgram(
+        "winogradConv3x3NCHWTransformProgram", device->context, deviceIds, OpenCLKernels::winogradTransformNCHW,
+        config.conv3x3.compileOptions()
+    );
+    cl_program xgemmProgram = compileProgram(
+        "xgemmProgram", device->context, deviceIds, OpenCLKernels::xgemmBatched,
+        config.xGemm.compileOptions(numTilesTotalPadded, outChannelsPadded, inChannelsPadded)
+    );
+    cl_program untransformProgram = compileProgram(
+        "winogradConv3x3NCHWUntransformProgram", device->context, deviceIds, OpenCLKernels::winogradUntransformNCHW,
+        config.conv3x3.compileOptions()
+    );
+    cl_kernel transformKernel = clCreateKernel(transformProgram, "transform", &err); CHECK_ERR(err);
+    cl_kernel xgemmKernel = clCreateKernel(xgemmProgram, "XgemmBatched", &err); CHECK_ERR(err);
+    cl_kernel untransformKernel = clCreateKernel(untransformProgram, "untransform", &err); CHECK_ERR(err);
+
+    size_t ioNumFloats = (size_t)halfBatchSize * channels * nnYLen * nnXLen;
+    size_t transformedNumFloats = (size_t)inTileXYSize * inChannelsPadded * numTilesTotalPadded;
+    size_t gemmOutNumFloats = (size_t)inTileXYSize * outChannelsPadded * numTilesTotalPadded;
+    const uint64_t inputSeed = 7186531904671312409ULL/*checkChainInput*/;
+    const uint64_t filterSeed = 2309741625817736515ULL/*checkChainFilter*/;
+    const double filterScale = 1.0 / sqrt(channels * 3 * 3);
+
+    //Both halves share the filter, everything else is their own
+    PooledBuffer filter = randomReadOnly3dPaddedBufferFloat(
+        filterSeed, bufferPool, commandQueue, inTileXYSize, channels, inChannelsPadded, channels, outChannelsPadded, filterScale);
+    vector<PooledBuffer> inputs;
+    vector<PooledBuffer> transformed;
+    vector<PooledBuffer> gemmOuts;
+    vector<PooledBuffer> directOutputs;
+    vector<PooledBuffer> graphOutputs;
+    vector<PooledBuffer> planOutputs;
+    for (int h = 0; h < numHalves; h++) {
+        inputs.push_back(randomReadOnlyBufferFloat(inputSeed + h, bufferPool, commandQueue, (int)ioNumFloats, 1.0));
+        transformed.push_back(acquireReadWriteBufferFloat(bufferPool, transformedNumFloats));
+        gemmOuts.push_back(acquireReadWriteBufferFloat(bufferPool, gemmOutNumFloats));
+        directOutputs.push_back(acquireNaNFilledBufferFloat(bufferPool, commandQueue, ioNumFloats));
+        graphOutputs.push_back(acquireNaNFilledBufferFloat(bufferPool, commandQueue, ioNumFloats));
+        planOutputs.push_back(acquireNaNFilledBufferFloat(bufferPool, commandQueue, ioNumFloats));
+    }
+
+    //Stage 0 is the transform, 1 the matrix multiply and 2 the untransform, for half h of the batch
+    const int numStages = 3;
+    const cl_kernel stageKernels[numStages] = { transformKernel, xgemmKernel, untransformKernel };
+    auto prepareStage = [&](int stage, int h, cl_kernel kernel, cl_mem output) {
+        if (stage == 0) {
+            return prepareWinogradTransform(
+                kernel, config, inputs[h].get(), transformed[h].get(),
+                nnXLen, nnYLen, halfBatchSize, numTilesX, numTilesY, mPaddingMult, channels, kPaddingMult
+            );
+        }
+        if (stage == 1) {
+            return prepareBatchedXGemm_KM_KN_NM(
+                kernel, config.xGemm, numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
+                transformed[h].get(), filter.get(), gemmOuts[h].get(), inTileXYSize
+            );
+        }
+        return prepareWinogradUntransform(
+            kernel, config, gemmOuts[h].get(), output,
+            nnXLen, nnYLen, halfBatchSize, numTilesX, numTilesY, mPaddingMult, channels, nPaddingMult
+        );
+    };
+    //The same as calling the launcher of the stage
+    auto launchStage = [&](
+        int stage, int h, cl_mem output, cl_command_queue queue,
+        cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf
+    ) {
+        return prepareStage(stage, h, stageKernels[stage], output).enqueue(queue, numEventsInWaitList, eventWaitList, eventBuf);
+    };
+    auto stageReads = [&](int stage, int h) {
+        if (stage == 0)
+            return vector<cl_mem>({ inputs[h].get() });
+        if (stage == 1)
+            return vector<cl_mem>({ transformed[h].get(), filter.get() });
+        return vector<cl_mem>({ gemmOuts[h].get() });
+    };
+    auto stageWrites = [&](int stage, int h, cl_mem output) {
+        if (stage == 0)
+            return vector<cl_mem>({ transformed[h].get() });
+        if (stage == 1)
+            return vector<cl_mem>({ gemmOuts[h].get() });
+        return vector<cl_mem>({ output });
+    };
+    auto readOutputs = [&](const vector<PooledBuffer>& outputs) {
+        vector<vector<float>> ret(numHalves);
+        for (int h = 0; h < numHalves; h++)
+            blockingReadBuffer(commandQueue, outputs[h].get(), ioNumFloats, ret[h]);
+        return ret;
+    };
+
+    //One call after another on the in-order queue, what every other way of running the chain must match
+    auto runDirect = [&]() {
+        for (int h = 0; h < numHalves; h++) {
+            for (int stage = 0; stage < numStages; stage++) {
+                cl_int launchErr = launchStage(stage, h, directOutputs[h].get(), commandQueue, 0, NULL, NULL);
+                CHECK_ERR(launchErr);
+            }
+        }
+    };
+    runDirect();
+    err = clFinish(commandQueue); CHECK_ERR(err);
+    vector<vector<float>> directResults = readOutputs(directOutputs);
+
+    bool allMatch = true;
+    const double tolerance = 0.001;
+    auto report = [&](const string& what, const vector<vector<float>>& expected, const vector<vector<float>>& actual) {
+        double error = 0.0;
+        for (int h = 0; h < numHalves; h++)
+            error = std::max(error, relativeL2Error(expected[h], actual[h]));
+        bool matches = error <= tolerance;
+        out << what << ": relative L2 error " << error << (matches ? "" : ", MISMATCH") << endl;
+        allMatch = allMatch && matches;
+    };
+
+    //The same convolution on the host
+    vector<float> hostFilter = hostRandom3dPaddedValues(
+        filterSeed, inTileXYSize, channels, inChannelsPadded, channels, outChannelsPadded, filterScale, false);
+    vector<vector<float>> hostResults(numHalves);
+    bool hasHostReference = true;
+    for (int h = 0; h < numHalves && hasHostReference; h++) {
+        vector<float> input = hostRandomValues(inputSeed + h, (int)ioNumFloats, 1.0, false);
+        vector<float> hostTransformed(transformedNumFloats);
+        vector<float> hostGemmOut(gemmOutNumFloats);
+        hostResults[h].resize(ioNumFloats);
+        hasHostReference = OpenCLReference::winogradTransform3x3(
+            input.data(), hostTransformed.data(),
+            halfBatchSize, nnXLen, nnYLen,
+            config.conv3x3.INTILE_XSIZE, config.conv3x3.INTILE_YSIZE, config.conv3x3.OUTTILE_XSIZE, config.conv3x3.OUTTILE_YSIZE,
+            channels, inChannelsPadded, numTilesTotalPadded
+        );
+        if (!hasHostReference)
+            break;
+        OpenCLReference::stridedBatchedGemm_KM_KN_NM(
+            numTilesTotalPadded, outChannelsPadded, inChannelsPadded,
+            hostTransformed.data(), numTilesTotalPadded * inChannelsPadded,
+            hostFilter.data(), outChannelsPadded * inChannelsPadded,
+            hostGemmOut.data(), numTilesTotalPadded * outChannelsPadded,
+            inTileXYSize
+        );
+        hasHostReference = OpenCLReference::winogradUntransform3x3(
+            hostGemmOut.data(), hostResults[h].data(),
+            halfBatchSize, nnXLen, nnYLen,
+            config.conv3x3.INTILE_XSIZE, config.conv3x3.INTILE_YSIZE, config.conv3x3.OUTTILE_XSIZE, config.conv3x3.OUTTILE_YSIZE,
+            channels, outChannelsPadded, numTilesTotalPadded
+        );
+    }
+    if (hasHostReference)
+        report("Kernels one after another vs host", hostResults, directResults);
+    else
+        out << "No host reference for this tile size" << endl;
+
+    //Through an event graph, so that on an out-of-order queue the two halves only wait on their own earlier stages.
+    //Out-of-order queues are optional in OpenCL 1.2, without one the graph still runs but nothing overlaps.
+    cl_command_queue graphQueue = commandQueue;
+    bool ownsGraphQueue = false;
+    if (!device->outOfOrderExecution) {
+        cl_command_queue_properties supportedProperties;
+        err = clGetDeviceInfo(device->info.deviceId, CL_DEVICE_QUEUE_PROPERTIES, sizeof(cl_command_queue_properties), &supportedProperties, NULL);
+        CHECK_ERR(err);
+        if ((supportedProperties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0) {
+            graphQueue = clCreateCommandQueue(device->context, device->info.deviceId, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+            CHECK_ERR(err);
+            ownsGraphQueue = true;
+        }
+    }
+    bool graphOutOfOrder = ownsGraphQueue || device->outOfOrderExecution;
+
+    OpenCLEventGraph graph;
+    for (int stage = 0; stage < numStages; stage++) {
+        for (int h = 0; h < numHalves; h++) {
+            cl_mem output = graphOutputs[h].get();
+            err = graph.enqueue(
+                stageReads(stage, h), stageWrites(stage, h, output),
+                [&](cl_uint numEventsInWaitList, const cl_event* eventWaitList, cl_event* eventBuf) {
+                    return launchStage(stage, h, output, graphQueue, numEventsInWaitList, eventWaitList, eventBuf);
+                },
+                NULL
+            );
+            CHECK_ERR(err);
+        }
+    }
+    err = graph.waitAll(); CHECK_ERR(err);
+    report(string("Event graph on ") + (graphOutOfOrder ? "an out-of-order" : "an in-order") + " queue vs one after another",
+        directResults, readOutputs(graphOutputs));
+
+    if (ownsGraphQueue)
+        clReleaseCommandQueue(graphQueue);
+
+    //Replayed from an OpenCLLaunchPlan, where the arguments and sizes of every call are set once up front
+    OpenCLLaunchPlan plan;
+    for (int h = 0; h < numHalves; h++) {
+        for (int stage = 0; stage < numStages; stage++)
+            plan.add(prepareStage(stage, h, plan.newKernelLike(stageKernels[stage]), planOutputs[h].get()));
+    }
+    err = plan.replay(commandQueue, NULL); CHECK_ERR(err);
+    err = clFinish(commandQueue); CHECK_ERR(err);
+    report("Launch plan replay vs one after another", directResults, readOutputs(planOutputs));
+
+    //Host time to enqueue the chain each way, the part of a small batch that a launch plan saves on.
+    //The queue is drained after each batch of enqueues so that it never fills up and blocks the host.
+    const int numChainsTimed = 50;
+    double directSeconds = 0.0;
+    double planSeconds = 0.0;
+    for (int i = 0; i < numChainsTimed; i++) {
+        auto start = std::chrono::steady_clock::now();
+        runDirect();
+        directSeconds += secondsSince(start);
+        err = clFinish(commandQueue); CHECK_ERR(err);
+
+        start = std::chrono::steady_clock::now();
+        err = plan.replay(commandQueue, NULL); CHECK_ERR(err);
+        planSeconds += secondsSince(start);
+        err = clFinish(commandQueue); CHECK_ERR(err);
+    }
+    out << "Host time to enqueue the " << plan.size() << " calls: " << (directSeconds / numChainsTimed * 1e6) << " us one after another, "
+        << (planSeconds / numChainsTimed * 1e6) << " us replaying the launch plan" << endl;
+    clReleaseKernel(transformKernel);
+    clReleaseKernel(xgemmKernel);
+    clReleaseKernel(untransformKernel);
+    clReleaseProgram(transformProgram);
+    clReleaseProgram(xgemmProgram);
+    clReleaseProgram(untransformProgram);
+    return allMatch;
+}
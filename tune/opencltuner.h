@@ -1,15 +1,24 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <ostream>
 #include "core/commontypes.h"
 #include "openclhelpers.h"
 
+struct OpenCLTuneLog;
+struct OpenCLTrace;
+struct OpenCLTuneFailures;
+
 constexpr int FEATURES1_NUM = 62;
 constexpr int FEATURES2_NUM = 57;
 constexpr int MAX_MOVE_LABEL_NUM = 27;
 constexpr int nnXLen = 9;
 constexpr int nnYLen = 9;
 
+//Version of the params written by OpenCLTuneParams::save, bumped whenever their meaning changes
+constexpr int TUNER_VERSION = 8;
+
 namespace OpenCLParams {
     struct XGemmDirectParams {
         int WGD = 8;
@@ -27,6 +36,9 @@ namespace OpenCLParams {
         std::string compileOptions() const;
         void fillFromDesc(const std::string& fileName, const std::string& desc);
         bool isValid() const;
+        //Work items per work group and __local bytes per work group of the kernel
+        int workGroupSize() const;
+        int localMemBytes(bool usingFP16Compute) const;
     };
 
     struct XGemmParams {
@@ -44,12 +56,24 @@ namespace OpenCLParams {
         int STRN = 0;
         int SA = 0;
         int SB = 0;
+        //1 to compile a separate program for each matrix shape with the sizes fixed in it, which some compilers
+        //optimize better. Chosen by the tuner after the other params.
+        int FIXED_SHAPE = 0;
 
         std::string desc() const;
         std::string compileOptions() const;
+        //The options for a program that computes M x N x K matrix multiplies, with the sizes as defines if FIXED_SHAPE
+        std::string compileOptions(int M, int N, int K) const;
         void fillFromDesc(const std::string& fileName, const std::string& desc);
         bool isValid() const;
         bool isSimple() const;
+        //desc() with MDIMA set to 0 if SA == 0 and NDIMB set to 0 if SB == 0, since the kernel then ignores them.
+        //Only those are normalized, so configs that differ in anything else, even where it compiles to the same
+        //kernel, still differ here.
+        std::string effectiveDesc() const;
+        //Work items per work group and __local bytes per work group of the kernel
+        int workGroupSize() const;
+        int localMemBytes(bool usingFP16Storage) const;
     };
 
     struct HGemmWmmaParams {
@@ -70,6 +94,9 @@ namespace OpenCLParams {
         void fillFromDesc(const std::string& fileName, const std::string& desc);
         bool isValid() const;
         bool isSimple() const;
+        //Work items per work group and __local bytes per work group of the kernel
+        int workGroupSize() const;
+        int localMemBytes() const;
     };
 
     struct Conv3x3Params {
@@ -92,6 +119,8 @@ namespace OpenCLParams {
         std::string compileOptions() const;
         void fillFromDesc(const std::string& fileName, const std::string& desc);
         bool isValid() const;
+        int transWorkGroupSize() const;
+        int untransWorkGroupSize() const;
     };
 
     struct Conv5x5Params {
@@ -148,7 +177,10 @@ struct OpenCLTuneParams {
     int getXGemmKPaddingMult(bool usingFP16Compute, bool usingFP16TensorCores) const;
 
     static void save(const std::string& filename, const OpenCLTuneParams& config);
+    static void save(std::ostream& out, const OpenCLTuneParams& config);
     static OpenCLTuneParams load(const std::string& filename);
+    //Parse the lines of a file written by save, filename is only used for error messages
+    static OpenCLTuneParams loadFromLines(const std::string& filename, const std::vector<std::string>& lines);
 };
 
 namespace OpenCLTuner {
@@ -161,6 +193,40 @@ namespace OpenCLTuner {
         int trunkNumChannels;
     };
 
+    //Peak throughput of the device, used to report how close the tuned kernels get to the roofline. 0 if unknown.
+    struct RooflinePeaks {
+        double gflopsFP32 = 0.0;
+        double gflopsFP16 = 0.0;
+        double gbytesPerSecond = 0.0;
+    };
+
+    //How the time of a config's kernel calls is measured. In both modes all calls are enqueued back to back
+    //and waited for once.
+    enum class TimingMode {
+        //Each call's own START to END profiling time
+        KERNEL,
+        //Time from the previous call ending to this call ending, including launch gaps, like the engine sees
+        SUSTAINED
+    };
+
+    //Optional inputs to a tuning run beyond the basic device and model settings
+    struct TuneRunOptions {
+        //Configs tuned elsewhere, typically on similar hardware. Within each stage, their values for that stage,
+        //and configs one parameter away from them, are tested before the rest of the search space.
+        std::vector<OpenCLTuneParams> seedConfigs;
+        //If not null, every tested config is recorded here
+        OpenCLTuneLog* log = nullptr;
+        //If not null, host work and kernel timings are recorded here
+        OpenCLTrace* trace = nullptr;
+        //If not null, configs recorded here as failing on this device and driver are not tested again, and new
+        //compile failures and kernels the device cannot run are added
+        OpenCLTuneFailures* knownFailures = nullptr;
+        //Test the configs in knownFailures anyway, and remove the ones that now work
+        bool reprobeKnownFailures = false;
+        RooflinePeaks peaks;
+        TimingMode timingMode = TimingMode::KERNEL;
+    };
+
     void tune(
         const OpenCLTuneParams& initialConfig,
         DevicesContext& devicesContext,
@@ -176,6 +242,35 @@ namespace OpenCLTuner {
         std::ostream& out,
         bool verboseErrors,
         bool verboseTuner,
+        const TuneRunOptions& runOptions,
         OpenCLTuneParams& tunedConfig
     );
+
+    //Measures how the throughput of the tuned 3x3 convolution matrix multiply scales with the number of threads
+    //enqueueing it at once, each on its own leased compute queue, for 1 up to maxNumStreams streams.
+    //Returns the total kernel calls per second for each number of streams, starting from 1.
+    //Streams beyond the device's number of compute queues share queues, see DevicesContext.
+    std::vector<double> measureConcurrentStreams(
+        const OpenCLTuneParams& config,
+        DevicesContext& devicesContext,
+        int gpuIdx,
+        int batchSize,
+        ModelInfoForTuning modelInfo,
+        int maxNumStreams,
+        std::ostream& out
+    );
+
+    //Runs the tuned winograd transform, matrix multiply and untransform one after another as a 3x3 convolution in FP32,
+    //for two independent halves of the batch. Checks the output against the host reference, and against running the
+    //same chain through an OpenCLEventGraph on an out-of-order queue if the device has one, where the two halves are
+    //free to overlap, and against replaying it from an OpenCLLaunchPlan. Reports the host time to enqueue the chain
+    //with and without the launch plan. Returns false if any of them does not match.
+    bool checkConvolutionChain(
+        const OpenCLTuneParams& config,
+        DevicesContext& devicesContext,
+        int gpuIdx,
+        int batchSize,
+        ModelInfoForTuning modelInfo,
+        std::ostream& out
+    );
 }
@@ -0,0 +1,185 @@
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <csignal>
+  #include <sys/types.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+#include "opencltuneworker.h"
+#include "openclhelpers.h"
+
+using namespace std;
+
+//How often the worker is checked on
+static constexpr int POLL_MILLISECONDS = 1000;
+
+#ifdef _WIN32
+typedef HANDLE WorkerHandle;
+
+//Quoting for CommandLineToArgvW and the C runtime: backslashes are literal except before a quote
+static string quoteArg(const string& arg) {
+    string ret = "\"";
+    size_t numBackslashes = 0;
+    for (size_t i = 0; i < arg.size(); i++) {
+        if (arg[i] == '\\') {
+            numBackslashes++;
+            continue;
+        }
+        if (arg[i] == '"')
+            ret += string(numBackslashes * 2 + 1, '\\');
+        else
+            ret += string(numBackslashes, '\\');
+        numBackslashes = 0;
+        ret += arg[i];
+    }
+    ret += string(numBackslashes * 2, '\\');
+    ret += "\"";
+    return ret;
+}
+
+static WorkerHandle startWorker(const string& program, const vector<string>& args) {
+    string commandLine = quoteArg(program);
+    for (const string& arg : args)
+        commandLine += " " + quoteArg(arg);
+    STARTUPINFOA startupInfo;
+    PROCESS_INFORMATION processInfo;
+    ZeroMemory(&startupInfo, sizeof(startupInfo));
+    startupInfo.cb = sizeof(startupInfo);
+    ZeroMemory(&processInfo, sizeof(processInfo));
+    vector<char> commandLineBuf(commandLine.begin(), commandLine.end());
+    commandLineBuf.push_back('\0');
+    if (!CreateProcessA(NULL, commandLineBuf.data(), NULL, NULL, FALSE, 0, NULL, NULL, &startupInfo, &processInfo))
+        throw StringError("Could not start tuner worker: " + program);
+    CloseHandle(processInfo.hThread);
+    return processInfo.hProcess;
+}
+
+//Waits up to POLL_MILLISECONDS, returns true and fills exitCodeBuf if the worker exited
+static bool waitWorker(WorkerHandle worker, int& exitCodeBuf) {
+    if (WaitForSingleObject(worker, POLL_MILLISECONDS) != WAIT_OBJECT_0)
+        return false;
+    DWORD exitCode = 1;
+    GetExitCodeProcess(worker, &exitCode);
+    CloseHandle(worker);
+    exitCodeBuf = (int)exitCode;
+    return true;
+}
+
+static void killWorker(WorkerHandle worker) {
+    TerminateProcess(worker, 1);
+    WaitForSingleObject(worker, INFINITE);
+    CloseHandle(worker);
+}
+#else
+typedef pid_t WorkerHandle;
+
+static WorkerHandle startWorker(const string& program, const vector<string>& args) {
+    vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (const string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        throw StringError("Could not start tuner worker: " + program);
+    if (pid == 0) {
+        execvp(program.c_str(), argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+//Waits up to POLL_MILLISECONDS, returns true and fills exitCodeBuf if the worker exited
+static bool waitWorker(WorkerHandle worker, int& exitCodeBuf) {
+    int status;
+    pid_t ret = waitpid(worker, &status, WNOHANG);
+    if (ret == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MILLISECONDS));
+        ret = waitpid(worker, &status, WNOHANG);
+    }
+    if (ret == 0)
+        return false;
+    //Killed by a signal counts as a failure like any other nonzero exit
+    exitCodeBuf = (ret > 0 && WIFEXITED(status)) ? WEXITSTATUS(status) : 1;
+    return true;
+}
+
+static void killWorker(WorkerHandle worker) {
+    kill(worker, SIGKILL);
+    int status;
+    waitpid(worker, &status, 0);
+}
+#endif
+
+static string readCurrentConfig(const string& currentFilename) {
+    ifstream in(currentFilename);
+    if (!in.good())
+        return string();
+    ostringstream contents;
+    contents << in.rdbuf();
+    //Fields are tab-separated, spaces read better in messages
+    string ret = Global::trim(contents.str());
+    for (size_t i = 0; i < ret.size(); i++) {
+        if (ret[i] == '\t')
+            ret[i] = ' ';
+    }
+    return ret;
+}
+
+int OpenCLTuneWorker::supervise(
+    const string& program,
+    const vector<string>& args,
+    const vector<string>& restartArgs,
+    const string& currentFilename,
+    double timeoutSeconds,
+    ostream& out
+) {
+    string lastFailedConfig;
+    for (int numStarted = 0; ; numStarted++) {
+        WorkerHandle worker = startWorker(program, numStarted == 0 ? args : restartArgs);
+
+        //Only time spent on a single config counts towards the timeout, stage setup and host reference work can be slow
+        string currentConfig;
+        auto currentConfigStart = std::chrono::steady_clock::now();
+        bool hung = false;
+        int exitCode = 0;
+        while (!waitWorker(worker, exitCode)) {
+            string config = readCurrentConfig(currentFilename);
+            auto now = std::chrono::steady_clock::now();
+            if (config != currentConfig) {
+                currentConfig = config;
+                currentConfigStart = now;
+            }
+            else if (config.size() > 0 && std::chrono::duration<double>(now - currentConfigStart).count() > timeoutSeconds) {
+                killWorker(worker);
+                hung = true;
+                exitCode = 1;
+                break;
+            }
+        }
+        if (!hung && exitCode == 0)
+            return 0;
+
+        string failedConfig = readCurrentConfig(currentFilename);
+        if (failedConfig.size() == 0) {
+            out << "Tuner worker exited with code " << exitCode << " while not testing any config, not restarting" << endl;
+            return exitCode;
+        }
+        if (failedConfig == lastFailedConfig) {
+            out << "Tuner worker " << (hung ? "hung" : "crashed") << " again on the same config, not restarting: " << failedConfig << endl;
+            return 1;
+        }
+        out << "Tuner worker " << (hung ? "hung" : "crashed") << " testing " << failedConfig << ", restarting" << endl;
+        lastFailedConfig = failedConfig;
+    }
+}
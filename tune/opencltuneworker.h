@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+//Running the tuner in a child process so that a config that crashes the driver or hangs the device only costs
+//a restart instead of the whole run. The worker records the config it is testing with
+//OpenCLTuneFailures::trackCurrentConfig, and each new worker skips the configs that earlier workers died on.
+namespace OpenCLTuneWorker {
+    //Runs program with args until it exits by itself, restarting it whenever it crashes or spends more than
+    //timeoutSeconds on a single config according to currentFilename. Restarted workers are run with restartArgs
+    //instead. Gives up if a worker dies while not testing any config, or on the same config as the worker before it,
+    //since restarting would not get any further. Returns the exit code of the last worker, or 1 if it crashed or hung.
+    int supervise(
+        const std::string& program,
+        const std::vector<std::string>& args,
+        const std::vector<std::string>& restartArgs,
+        const std::string& currentFilename,
+        double timeoutSeconds,
+        std::ostream& out
+    );
+}